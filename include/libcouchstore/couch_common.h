@@ -34,7 +34,14 @@ extern "C" {
     /** Document content metadata flags */
     typedef uint8_t couchstore_content_meta_flags;
     enum {
-        COUCH_DOC_IS_COMPRESSED = 128,  /**< Document contents compressed via Snappy */
+        COUCH_DOC_IS_COMPRESSED = 128,  /**< Document contents compressed */
+        /* Codec the contents are compressed with, if they are
+           ((content_meta & 0x30) >> 4, see couchstore_codec). From disk
+           version 17 on these bits are couchstore's, not the client's:
+           they are overwritten when a body is compressed, and are cleared
+           when compaction upgrades an older file, where they were left to
+           the client: */
+        COUCH_DOC_CODEC_MASK = 0x30,
         /* Content Type Reasons (content_meta & 0x0F): */
         COUCH_DOC_IS_JSON = 0,      /**< Document is valid JSON data */
         COUCH_DOC_INVALID_JSON = 1, /**< Document was checked, and was not valid JSON */
@@ -43,13 +50,30 @@ extern "C" {
         COUCH_DOC_NON_JSON_MODE = 3 /**< Document was not checked (DB running in non-JSON mode) */
     };
 
+    /** Codecs that B-tree nodes and document bodies are compressed with */
+    typedef uint8_t couchstore_codec;
+    enum {
+        COUCHSTORE_CODEC_SNAPPY = 0, /**< Snappy (the default) */
+        COUCHSTORE_CODEC_LZ4 = 1,    /**< LZ4, faster to decompress */
+        COUCHSTORE_CODEC_ZSTD = 2,   /**< Zstandard, compresses better; only
+                                          if built with libzstd */
+        COUCHSTORE_CODEC_ZSTD_DICT = 3 /**< Zstandard with the dictionary
+                                            trained for the file's document
+                                            bodies (see
+                                            COUCHSTORE_COMPACT_TRAIN_DICTIONARY);
+                                            document bodies only */
+    };
+
     typedef enum {
 #ifdef POSIX_FADV_NORMAL
         /* Evict this range from FS caches if possible */
-        COUCHSTORE_FILE_ADVICE_EVICT = POSIX_FADV_DONTNEED
+        COUCHSTORE_FILE_ADVICE_EVICT = POSIX_FADV_DONTNEED,
+        /* This range will be read soon; start reading it in if possible */
+        COUCHSTORE_FILE_ADVICE_WILLNEED = POSIX_FADV_WILLNEED
 #else
         /* Assign these whatever values, we'll be ignoring them.. */
-        COUCHSTORE_FILE_ADVICE_EVICT
+        COUCHSTORE_FILE_ADVICE_EVICT,
+        COUCHSTORE_FILE_ADVICE_WILLNEED
 #endif
     } couchstore_file_advice_t;
 
@@ -115,6 +139,12 @@ extern "C" {
     /** Opaque reference to an open database. */
     typedef struct _db Db;
 
+    /** Opaque reference to a group committer of an open database. */
+    typedef struct _group_commit GroupCommit;
+
+    /** Opaque reference to a bulk load into an empty database. */
+    typedef struct _bulk_load BulkLoad;
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,6 +43,31 @@ extern "C" {
          * primarily intended for testing purposes.
          */
         COUCHSTORE_OPEN_FLAG_UNBUFFERED = 8,
+        /**
+         * Serve reads from the process-wide shared block cache.
+         *
+         * Instead of keeping its own small set of read buffers, the
+         * database shares one cache (and one memory budget) with every
+         * other database opened with this flag. The cache must first be
+         * sized with couchstore_set_shared_block_cache_size(); until then
+         * (or if buffering is disabled) this flag has no effect.
+         * COUCHSTORE_OPEN_WITH_CUSTOM_BUFFER settings are ignored for
+         * databases using the shared cache.
+         */
+        COUCHSTORE_OPEN_WITH_SHARED_BLOCK_CACHE = 0x10,
+        /**
+         * Cache decoded B+tree nodes.
+         *
+         * Keeps recently read nodes in memory after they have been
+         * checksummed and decompressed, so that frequently visited nodes
+         * (e.g. the upper levels of the trees) don't have to be read and
+         * decoded again on every lookup.
+         * These 3 bits specify the memory budget of the cache:
+         *     256KB * 1 << (N-1)
+         * ranging from 256KB to 16MB. Zero disables the cache.
+         * See couchstore_get_node_cache_stats().
+         */
+        COUCHSTORE_OPEN_WITH_NODE_CACHE = 0xe0,
         /**
          * Customize IO buffer configurations.
          *
@@ -83,8 +108,119 @@ extern "C" {
          * A value of N=0 specifies that automatic fsync is disabled.
          */
         COUCHSTORE_OPEN_WITH_PERIODIC_SYNC = 0x1f000000,
+
+        /**
+         * Read the database through a memory mapping of the file.
+         *
+         * Reads become copies out of the mapping (and compressed data is
+         * decompressed straight from it), with no system call and no IO
+         * buffer in between. Requires COUCHSTORE_OPEN_FLAG_RDONLY.
+         * Only takes effect with the default file ops, and on platforms
+         * supporting it; otherwise the file is read as usual.
+         * The file must not be truncated while it is open.
+         */
+        COUCHSTORE_OPEN_FLAG_MMAP = 0x20000000,
+
+        /**
+         * Read ahead during B-tree scans.
+         *
+         * While folding over a range (couchstore_changes_since(),
+         * couchstore_all_docs(), couchstore_walk_id_tree() etc.), advise
+         * the file ops that the next few child nodes of the current
+         * B-tree node will be needed, so that they can be read in from
+         * disk while the current subtree is being processed.
+         */
+        COUCHSTORE_OPEN_WITH_PREFETCH = 0x40000000,
     };
 
+    /*
+     * The open flags below don't fit in an enumerator, whose value C
+     * restricts to the range of int, so they are defined as constants.
+     */
+
+    /**
+     * Write out the IO buffer in the background.
+     *
+     * When the write buffer fills up, it is handed to a background
+     * thread to be written to the file while writing carries on into
+     * a second buffer, instead of waiting for the write. Data pending
+     * in either buffer is still visible to reads, and
+     * couchstore_commit() still returns only once everything has been
+     * written and synced. An error writing in the background is
+     * returned by a later save or commit.
+     * Has no effect if buffering is disabled or the file is read only.
+     */
+#define COUCHSTORE_OPEN_WITH_BACKGROUND_FLUSH ((couchstore_open_flags)0x80000000)
+
+    /**
+     * Customize the IO buffer's write buffer capacity.
+     *
+     * Writes are collected in the write buffer and written to the file
+     * once it is full (or on commit). These 4 bits specify its
+     * capacity:
+     *     4KB * 1 << (N-1)
+     * ranging from 4KB to 64MB. Zero represents the default, 128KB.
+     */
+#define COUCHSTORE_OPEN_WITH_CUSTOM_WRITE_BUFFER ((couchstore_open_flags)0xf00000000)
+
+    /**
+     * Customize the IO buffer's document read buffer capacity.
+     *
+     * Document bodies are read through a buffer of their own rather
+     * than the read buffers (which hold B+tree nodes), so that reading
+     * documents doesn't evict nodes; reads of consecutive documents
+     * are served from one read of the file. These 4 bits specify its
+     * capacity:
+     *     4KB * 1 << (N-1)
+     * ranging from 4KB to 64MB. Zero represents the default, 64KB.
+     * Databases using the shared block cache read documents through
+     * the cache instead.
+     */
+#define COUCHSTORE_OPEN_WITH_CUSTOM_DOC_BUFFER ((couchstore_open_flags)0xf000000000)
+
+    /**
+     * Select the codec B-tree nodes are compressed with.
+     *
+     * These 2 bits hold a couchstore_codec; zero is Snappy. Each node
+     * records the codec it was written with, so a file can be read
+     * whatever codec it was written with, and nodes written with one
+     * codec are replaced by nodes written with another as the file is
+     * updated or compacted. Codecs other than Snappy need a file at
+     * the latest version (see COUCHSTORE_COMPACT_FLAG_UPGRADE_DB);
+     * older files are written with Snappy. Opening fails with
+     * COUCHSTORE_ERROR_NOT_SUPPORTED if the codec isn't built in.
+     */
+#define COUCHSTORE_OPEN_WITH_NODE_CODEC ((couchstore_open_flags)0x30000000000)
+
+    /**
+     * Select the codec document bodies are compressed with (see
+     * COMPRESS_DOC_BODIES), in the same way as
+     * COUCHSTORE_OPEN_WITH_NODE_CODEC. LZ4 suits nodes, which are read
+     * most often, and Zstandard rarely read document bodies.
+     * COUCHSTORE_CODEC_ZSTD_DICT compresses them with the file's
+     * dictionary (see COUCHSTORE_COMPACT_TRAIN_DICTIONARY), or with
+     * plain Zstandard until it has one; it can't compress nodes, so
+     * selecting it for them fails with
+     * COUCHSTORE_ERROR_INVALID_ARGUMENTS. A file at the latest version
+     * records the codec it is created (or compacted) with, or last
+     * opened with, and opening it without selecting one selects that
+     * codec; so Snappy, being zero, can't be selected over another
+     * that a file records.
+     */
+#define COUCHSTORE_OPEN_WITH_DOC_CODEC ((couchstore_open_flags)0xc0000000000)
+
+    /**
+     * Encode the codecs to compress B-tree nodes and document bodies with
+     * to the correct couchstore_open_flags (or couchstore_compact_flags)
+     * encoding.
+     * @param node_codec codec for B-tree nodes
+     * @param doc_codec codec for document bodies
+     * @return encoded open_flags value
+     */
+    LIBCOUCHSTORE_API
+    couchstore_open_flags couchstore_encode_codec_flags(couchstore_codec node_codec,
+                                                        couchstore_codec doc_codec);
+
     /**
      * Encode a periodic sync specified in bytes to the correct
      * couchstore_open_flags encoding.
@@ -134,6 +270,69 @@ extern "C" {
                                              FileOpsInterface* ops,
                                              Db **db);
 
+    /**
+     * Statistics of the decoded B+tree node cache of a database.
+     */
+    typedef struct {
+        /** Number of node reads served from the cache. */
+        uint64_t hits;
+        /** Number of node reads which had to read from the file. */
+        uint64_t misses;
+        /** Bytes of node data currently cached. */
+        uint64_t size;
+    } couchstore_node_cache_stats;
+
+    /**
+     * Get statistics of the node cache enabled with
+     * COUCHSTORE_OPEN_WITH_NODE_CACHE. All values are zero if the database
+     * was opened without a node cache.
+     *
+     * @param db The database
+     * @param stats Pointer to where the statistics should be stored
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_get_node_cache_stats(Db *db,
+                                                       couchstore_node_cache_stats *stats);
+
+    /**
+     * Set the size of the process-wide block cache used by databases opened
+     * with COUCHSTORE_OPEN_WITH_SHARED_BLOCK_CACHE.
+     *
+     * Blocks are cached per (file, offset), so all handles on the same file
+     * share hot blocks such as the upper B+tree nodes, and the budget is
+     * spent on whichever files are busiest. Shrinking the size evicts the
+     * least recently used blocks immediately. The default size is zero,
+     * which disables the cache for databases opened afterwards.
+     *
+     * @param capacity_bytes Maximum amount of block data to cache
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_set_shared_block_cache_size(uint64_t capacity_bytes);
+
+    /**
+     * Open a read-only snapshot of a database, pinned to its most recently
+     * committed header.
+     *
+     * The snapshot shares the database's open file and its caches (the
+     * node cache and the shared block cache, if enabled) rather than
+     * opening the file again, and may be used from another thread while the
+     * database keeps being written to and committed. Changes committed
+     * afterwards aren't visible through it.
+     *
+     * This must be called from the thread using 'db'. The snapshot must be
+     * closed (with couchstore_close_file() and couchstore_free_db()) before
+     * 'db' is. A database opened with custom file ops and without buffering
+     * requires them to support concurrent preads.
+     *
+     * @param db The database to take a snapshot of
+     * @param snapshot Pointer to where you want the handle to the snapshot
+     *                 to be stored.
+     * @return COUCHSTORE_SUCCESS for success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_snapshot(Db *db, Db **snapshot);
+
     /**
      * Release all resources held by the database handle after the file
      * has been closed.
@@ -165,6 +364,10 @@ extern "C" {
      * If there is no next-oldest header, the db handle will be *closed*, and
      * COUCHSTORE_DB_NO_LONGER_VALID will be returned.
      *
+     * From disk version 16 on, each header links to the one it was committed
+     * on top of, which is followed directly rather than scanning back
+     * through the file for the previous header.
+     *
      * @param db The database handle to rewind
      * @return COUCHSTORE_SUCCESS upon success, COUCHSTORE_DB_NO_LONGER_VALID if
      * no next-oldest header was found.
@@ -172,6 +375,27 @@ extern "C" {
     LIBCOUCHSTORE_API
     couchstore_error_t couchstore_rewind_db_header(Db *db);
 
+    /**
+     * Rewind a db handle to the most recent header whose update_seq is no
+     * greater than the given sequence number. Does nothing if the current
+     * header already is.
+     *
+     * From disk version 16 on, headers are found through the links between
+     * them in a logarithmic number of reads; with older versions this is
+     * equivalent to calling couchstore_rewind_db_header() repeatedly.
+     *
+     * As with couchstore_rewind_db_header(), if there is no such header (or
+     * it can't be read) the db handle will be *closed* and freed, and
+     * COUCHSTORE_DB_NO_LONGER_VALID will be returned.
+     *
+     * @param db The database handle to rewind
+     * @param seq The sequence number to rewind to
+     * @return COUCHSTORE_SUCCESS upon success, COUCHSTORE_DB_NO_LONGER_VALID if
+     * no such header was found.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_rewind_to_seq(Db *db, uint64_t seq);
+
     /**
      * Get the default FileOpsInterface object
      */
@@ -228,10 +452,13 @@ extern "C" {
     typedef uint64_t couchstore_save_options;
     enum {
         /**
-         * Snappy compress document data if the high bit of the
-         * content_meta field of the DocInfo is set. This is NOT the
-         * default, and if this is not set the data field of the Doc will
-         * be written to disk as-is, regardless of the content_meta flags.
+         * Compress document data if the high bit of the content_meta field
+         * of the DocInfo is set, with the database's document codec
+         * (Snappy unless opened with COUCHSTORE_OPEN_WITH_DOC_CODEC), which
+         * is recorded in the COUCH_DOC_CODEC_MASK bits of the stored
+         * content_meta. This is NOT the default, and if this is not set
+         * the data field of the Doc will be written to disk as-is,
+         * regardless of the content_meta flags.
          */
         COMPRESS_DOC_BODIES = 1,
         /**
@@ -241,7 +468,15 @@ extern "C" {
          * sequence number as given. The update_seq for the DB will be set to
          * at least this sequence.
          * */
-        COUCHSTORE_SEQUENCE_AS_IS = 2
+        COUCHSTORE_SEQUENCE_AS_IS = 2,
+        /**
+         * Like COMPRESS_DOC_BODIES (which it implies), but compress the
+         * document bodies of a batch on worker threads before appending
+         * them to the file. The bodies are still appended in order, so the
+         * file written is the same. Worthwhile for batches of many
+         * sizeable documents.
+         */
+        COMPRESS_DOC_BODIES_IN_PARALLEL = 4
     };
 
     /**
@@ -300,6 +535,136 @@ extern "C" {
     couchstore_error_t couchstore_commit(Db *db);
 
 
+    /*////////////////////  GROUP COMMIT: */
+
+    /**
+     * Create a group committer for a database, allowing several threads to
+     * save documents concurrently with fewer commits.
+     *
+     * Each couchstore_group_commit_save_documents() call saves its batch
+     * and returns once the batch has been committed. Batches submitted
+     * while a commit is in progress are saved and committed together by
+     * one of their callers when it finishes, so a single fsync covers all
+     * of them.
+     *
+     * While the committer is in use the database must not be modified by
+     * any other means. Free the committer before closing the database.
+     *
+     * @param db the database to commit to
+     * @param pGroup where to store the new committer
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_group_commit(Db *db,
+                                                    GroupCommit **pGroup);
+
+    /**
+     * Save an array of docs, as couchstore_save_documents() does, and
+     * commit them. May be called from several threads at once.
+     *
+     * The arrays and the documents they reference must remain valid until
+     * the call returns; on return the db_seq fields of the DocInfos are
+     * filled in. If the same ID is saved by several concurrent calls, the
+     * last call to be submitted wins.
+     *
+     * @param group the group committer to save through
+     * @param docs an array of document pointers, or NULL to delete
+     * @param infos an array of docinfo pointers
+     * @param numDocs the number documents to save
+     * @param options see couchstore_save_documents()
+     * @return COUCHSTORE_SUCCESS once the documents are durable, otherwise
+     *         the error saving or committing them
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_group_commit_save_documents(
+            GroupCommit *group,
+            Doc* const docs[],
+            DocInfo *infos[],
+            unsigned numDocs,
+            couchstore_save_options options);
+
+    /**
+     * Free a group committer. No saves may be in progress through it.
+     *
+     * @param group the group committer to free
+     * @return COUCHSTORE_SUCCESS
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_free_group_commit(GroupCommit *group);
+
+
+    /*////////////////////  BULK LOADING: */
+
+    /**
+     * Start loading documents into an empty database, building its indexes
+     * bottom-up as the compactor does, instead of modifying them a batch
+     * at a time.
+     *
+     * Documents are loaded with couchstore_bulk_load_documents(), in
+     * ascending sequence order, and become visible (and durable) once
+     * couchstore_finish_bulk_load() has written the indexes and committed.
+     * Their bodies are appended as they are loaded, so the file is written
+     * sequentially. IDs may come in any order, but each may be loaded only
+     * once; when they come in ascending order no sort is needed.
+     *
+     * Until the load is finished or freed, the database must not be
+     * modified by any other means.
+     *
+     * @param db the database to load, which must have no documents
+     * @param pLoad where to store the new bulk load
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if the db has documents
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_bulk_load(Db *db, BulkLoad **pLoad);
+
+    /**
+     * Load an array of docs, as couchstore_save_documents() would save
+     * them. With COUCHSTORE_SEQUENCE_AS_IS the sequence numbers must be
+     * greater than any loaded before.
+     *
+     * On return, the db_seq fields of the DocInfos are filled in.
+     *
+     * @param load the bulk load to load documents with
+     * @param docs an array of document pointers, or NULL to load deletions
+     * @param infos an array of docinfo pointers
+     * @param numDocs the number documents to load
+     * @param options see couchstore_save_documents()
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if an ID is loaded again
+     *         while the IDs loaded so far are in ascending order
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_bulk_load_documents(
+            BulkLoad *load,
+            Doc* const docs[],
+            DocInfo *infos[],
+            unsigned numDocs,
+            couchstore_save_options options);
+
+    /**
+     * Write the indexes of the loaded documents and commit them. The db may
+     * be used as normal afterwards; the load must still be freed.
+     *
+     * @param load the bulk load to finish
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if an ID was loaded more
+     *         than once, in which case nothing is committed
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_finish_bulk_load(BulkLoad *load);
+
+    /**
+     * Free a bulk load. If it wasn't finished, the documents loaded are
+     * discarded.
+     *
+     * @param load the bulk load to free
+     * @return COUCHSTORE_SUCCESS
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_free_bulk_load(BulkLoad *load);
+
+
     /*////////////////////  RETRIEVING DOCUMENTS: */
 
     /**
@@ -655,6 +1020,10 @@ extern "C" {
      * To delete an existing doc, set the deleted flag on the LocalDoc
      * struct. The json buffer will be ignored for a deletion.
      *
+     * The document dictionary ("_local/_couchstore_doc_dictionary", see
+     * COUCHSTORE_COMPACT_TRAIN_DICTIONARY) is reserved; saving or deleting
+     * it fails with COUCHSTORE_ERROR_INVALID_ARGUMENTS.
+     *
      * @param db the database to store the document in
      * @param lDoc the document to store
      * @return COUCHSTORE_SUCCESS on success
@@ -699,8 +1068,14 @@ extern "C" {
 
         /**
          * Upgrade the database whilst compacting.
-         * The only supported upgrade is from version 11 to 12 which
-         * changes the CRC function used.
+         * Files are upgraded to the latest version (17). Version 12 changed
+         * the CRC function used, version 13 added an offset directory to
+         * B-tree nodes for in-node binary search, version 14 added
+         * prefix compression of the keys in B-tree nodes, version 15
+         * an optional Bloom filter over document IDs, version 16 links
+         * from each header to earlier ones, and version 17 records the
+         * codec each B-tree node and document body is compressed with.
+         * Without this flag the compacted file keeps the source's version.
          */
         COUCHSTORE_COMPACT_FLAG_UPGRADE_DB = 2,
 
@@ -721,10 +1096,61 @@ extern "C" {
          */
         COUCHSTORE_COMPACT_RECOVERY_MODE = 8,
 
+        /**
+         * Build a Bloom filter over the document IDs in the compacted
+         * file, which lets lookups of IDs that aren't in the file
+         * (couchstore_docinfo_by_id(), couchstore_docinfos_by_id(),
+         * couchstore_open_document()) mostly return without reading the
+         * by-id index. The filter is kept up to date as documents are
+         * saved, and rebuilt by later compactions without this flag.
+         * Requires the compacted file to be at the latest version.
+         */
+        COUCHSTORE_COMPACT_WITH_BLOOM_FILTER = 0x10,
+
+        /**
+         * Write the target database file out in the background
+         * (see COUCHSTORE_OPEN_WITH_BACKGROUND_FLUSH), so that reading and
+         * copying the source carries on while the target's IO buffer is
+         * being written.
+         */
+        COUCHSTORE_COMPACT_WITH_BACKGROUND_FLUSH = 0x20,
+
+        /**
+         * Recompress the compressed document bodies that weren't
+         * compressed with the compacted file's document codec (see
+         * COUCHSTORE_COMPACT_WITH_DOC_CODEC) into it, instead of copying
+         * them as they are.
+         */
+        COUCHSTORE_COMPACT_CONVERT_DOC_BODIES = 0x40,
+
+        /**
+         * Train a Zstandard dictionary from a sample of the compressed
+         * document bodies, store it in the compacted file (as the local
+         * document "_local/_couchstore_doc_dictionary") and recompress the
+         * compressed bodies with it, as COUCHSTORE_CODEC_ZSTD_DICT
+         * becomes the compacted file's document codec. Documents saved to
+         * the compacted file are compressed with the dictionary too, as
+         * the file records its document codec (see
+         * COUCHSTORE_OPEN_WITH_DOC_CODEC). Bodies are always read back
+         * with it, whatever the file was opened with. Needs a file at
+         * the latest version; if too few bodies are compressed to train
+         * a dictionary, the source's one is kept, if any.
+         */
+        COUCHSTORE_COMPACT_TRAIN_DICTIONARY = 0x80,
+
+        /**
+         * Read the document bodies on worker threads, several at once,
+         * ahead of copying them to the compacted file, instead of reading
+         * each as it is copied. Items are still copied, and passed to the
+         * hooks, in sequence order, but the bodies of items a hook drops
+         * may be read as well.
+         */
+        COUCHSTORE_COMPACT_WITH_PARALLEL_READS = 0x100,
+
         /**
          * Currently unused flag bits.
          */
-        COUCHSTORE_COMPACT_UNUSED = 0xfffff0,
+        COUCHSTORE_COMPACT_UNUSED = 0xfffe00,
 
         /**
          * Enable periodic sync().
@@ -736,6 +1162,24 @@ extern "C" {
         COUCHSTORE_COMPACT_WITH_PERIODIC_SYNC = 0x1f000000,
     };
 
+    /*
+     * As with couchstore_open_flags, the compact flags below don't fit in
+     * an enumerator, so they are defined as constants.
+     */
+
+    /**
+     * Select the codecs the compacted file compresses B-tree nodes and
+     * document bodies with. Same encoding as
+     * COUCHSTORE_OPEN_WITH_NODE_CODEC and COUCHSTORE_OPEN_WITH_DOC_CODEC
+     * - see couchstore_open_flags and couchstore_encode_codec_flags() -
+     * except that zero keeps the codec the source was opened with.
+     * All of the compacted file's nodes are written with its node
+     * codec; document bodies are copied as they are unless
+     * COUCHSTORE_COMPACT_CONVERT_DOC_BODIES is set.
+     */
+#define COUCHSTORE_COMPACT_WITH_NODE_CODEC ((couchstore_compact_flags)0x30000000000)
+#define COUCHSTORE_COMPACT_WITH_DOC_CODEC ((couchstore_compact_flags)0xc0000000000)
+
     /**
      * A compactor hook will be given each DocInfo, and can either keep or drop the item
      * based on its contents.
@@ -839,6 +1283,29 @@ extern "C" {
                                                  uint64_t max_seq,
                                                  uint64_t *count);
 
+     /**
+      * Counts the number of changes in several ranges of sequence numbers,
+      * as couchstore_changes_count() does for each, in one traversal of the
+      * by-sequence index.
+      *
+      * Nodes of the index read to count changes are kept by the db, so
+      * counting the changes since a recent sequence number again reads
+      * little or nothing.
+      *
+      * @param db The db to count changes in
+      * @param min_seqs The minimum sequence to count, for each range
+      * @param max_seqs The maximum sequence to count, for each range
+      * @param num_ranges The number of ranges
+      * @param counts Array to store the count of each range in
+      * @return COUCHSTORE_SUCCESS on success
+      */
+     LIBCOUCHSTORE_API
+     couchstore_error_t couchstore_changes_counts(Db* db,
+                                                  const uint64_t *min_seqs,
+                                                  const uint64_t *max_seqs,
+                                                  size_t num_ranges,
+                                                  uint64_t *counts);
+
 #ifdef __cplusplus
 }
 #endif
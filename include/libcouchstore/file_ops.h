@@ -40,6 +40,25 @@
 #endif
     } couchstore_error_info_t;
 
+    /**
+     * One element of a vectored write; see FileOpsInterface::pwritev().
+     */
+    typedef struct {
+        const void* base;
+        size_t len;
+    } couch_iovec;
+
+    /**
+     * One read of a batch; see FileOpsInterface::pread_batch().
+     */
+    typedef struct {
+        void* buf;
+        size_t nbytes;
+        cs_off_t offset;
+        /** Set to the number of bytes read, or a value <= 0 on error. */
+        ssize_t result;
+    } couch_read_request;
+
 
 
 #ifdef __cplusplus
@@ -144,6 +163,26 @@ public:
                           couch_file_handle handle, void* buf, size_t nbytes,
                           cs_off_t offset) = 0;
 
+    /**
+     * Perform several independent reads. Implementations may issue them
+     * to the device concurrently, and complete them in any order.
+     * Optional - defaults to calling pread() for each request in turn.
+     *
+     * @param handle file handle to read from
+     * @param reqs the reads to perform; the `result` of each is set to
+     *        what pread() would have returned for it
+     * @param count number of elements in reqs
+     */
+    virtual void pread_batch(couchstore_error_info_t* errinfo,
+                             couch_file_handle handle,
+                             couch_read_request* reqs,
+                             size_t count) {
+        for (size_t ii = 0; ii < count; ++ii) {
+            reqs[ii].result = pread(errinfo, handle, reqs[ii].buf,
+                                    reqs[ii].nbytes, reqs[ii].offset);
+        }
+    }
+
     /**
      * Write a chunk of data to a given offset in the file.
      *
@@ -158,6 +197,53 @@ public:
                            couch_file_handle handle, const void* buf,
                            size_t nbytes, cs_off_t offset) = 0;
 
+    /**
+     * Write the contents of several buffers, back to back, to a given
+     * offset in the file.
+     * Optional - defaults to calling pwrite() once per buffer.
+     *
+     * @param handle file handle to write to
+     * @param iov array of buffers to write, in order
+     * @param iovcnt number of elements in iov
+     * @param offset where to write the first buffer to
+     * @return number of bytes written (which may be less than the total
+     *         length of the buffers), or a value <= 0 if an error occurred
+     */
+    virtual ssize_t pwritev(couchstore_error_info_t* errinfo,
+                            couch_file_handle handle, const couch_iovec* iov,
+                            int iovcnt, cs_off_t offset) {
+        ssize_t total = 0;
+        for (int ii = 0; ii < iovcnt; ++ii) {
+            ssize_t written = pwrite(errinfo, handle, iov[ii].base,
+                                     iov[ii].len, offset + total);
+            if (written < 0) {
+                return written;
+            }
+            total += written;
+            if (size_t(written) < iov[ii].len) {
+                break;
+            }
+        }
+        return total;
+    }
+
+    /**
+     * Get direct, read-only access to a range of the file's contents,
+     * without copying it.
+     * Optional - defaults to returning nullptr, in which case the range
+     * must be read with pread().
+     *
+     * @param handle file handle to read from
+     * @param nbytes length of the range
+     * @param offset where the range starts
+     * @return pointer to the data, valid until the handle is closed, or
+     *         nullptr if the range can't be borrowed.
+     */
+    virtual const char* borrow(couch_file_handle handle, size_t nbytes,
+                               cs_off_t offset) {
+        return nullptr;
+    }
+
     /**
      * Find the end of the file.
      *
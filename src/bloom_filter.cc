@@ -0,0 +1,228 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+#include "bloom_filter.h"
+#include "bitfield.h"
+#include "util.h"
+
+#include <platform/cb_malloc.h>
+#include <string.h>
+
+#include <new>
+
+/* For a 1% false positive rate: ln(100) / ln(2)^2 bits per entry,
+ * ln(100) / ln(2) hash functions. */
+#define BLOOM_FILTER_BITS_PER_ENTRY 9.6
+#define BLOOM_FILTER_NUM_HASHES 7
+
+/* Serialized form of a filter: this header, followed by the bits */
+typedef struct {
+    raw_08 num_hashes;
+    raw_40 expected_entries;
+} raw_bloom_filter;
+
+/* The filter is written out again once this fraction of its expected
+ * entries has been added since it last was, to bound the number of
+ * changes that have to be added back when it is loaded. */
+#define BLOOM_FILTER_WRITE_DIVISOR 16
+
+/* 64-bit FNV-1a, followed by a final mix so that both halves of the hash
+ * are well distributed. Part of the file format: must not change. */
+static uint64_t hash_id(const sized_buf* key)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t ii = 0; ii < key->size; ++ii) {
+        hash ^= uint8_t(key->buf[ii]);
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+BloomFilter::BloomFilter(uint64_t _expected_entries)
+    : BloomFilter(_expected_entries,
+                  BLOOM_FILTER_NUM_HASHES,
+                  size_t(_expected_entries * BLOOM_FILTER_BITS_PER_ENTRY) / 8 + 1) {
+}
+
+BloomFilter::BloomFilter(uint64_t _expected_entries,
+                         uint8_t _num_hashes,
+                         size_t nbytes)
+    : expected_entries(_expected_entries),
+      num_hashes(_num_hashes),
+      bits(nbytes) {
+}
+
+BloomFilter* BloomFilter::deserialize(const char* buf, size_t size)
+{
+    if (size <= sizeof(raw_bloom_filter)) {
+        return NULL;
+    }
+    raw_bloom_filter raw;
+    memcpy(&raw, buf, sizeof(raw));
+    uint8_t num_hashes = decode_raw08(raw.num_hashes);
+    if (num_hashes == 0) {
+        return NULL;
+    }
+    try {
+        BloomFilter* filter = new BloomFilter(decode_raw40(raw.expected_entries),
+                                              num_hashes,
+                                              size - sizeof(raw));
+        memcpy(filter->bits.data(), buf + sizeof(raw), filter->bits.size());
+        return filter;
+    } catch (const std::bad_alloc&) {
+        return NULL;
+    }
+}
+
+std::vector<char> BloomFilter::serialize() const
+{
+    std::vector<char> buf(sizeof(raw_bloom_filter) + bits.size());
+    raw_bloom_filter raw;
+    raw.num_hashes = encode_raw08(num_hashes);
+    encode_raw40(expected_entries, &raw.expected_entries);
+    memcpy(buf.data(), &raw, sizeof(raw));
+    memcpy(buf.data() + sizeof(raw), bits.data(), bits.size());
+    return buf;
+}
+
+void BloomFilter::add(const sized_buf* key)
+{
+    const uint64_t hash = hash_id(key);
+    const uint64_t nbits = uint64_t(bits.size()) * 8;
+    const uint64_t h1 = hash & 0xffffffff;
+    const uint64_t h2 = (hash >> 32) | 1;
+    for (uint8_t ii = 0; ii < num_hashes; ++ii) {
+        uint64_t bit = (h1 + ii * h2) % nbits;
+        bits[bit / 8] |= uint8_t(1 << (bit % 8));
+    }
+}
+
+bool BloomFilter::maybeContains(const sized_buf* key) const
+{
+    const uint64_t hash = hash_id(key);
+    const uint64_t nbits = uint64_t(bits.size()) * 8;
+    const uint64_t h1 = hash & 0xffffffff;
+    const uint64_t h2 = (hash >> 32) | 1;
+    for (uint8_t ii = 0; ii < num_hashes; ++ii) {
+        uint64_t bit = (h1 + ii * h2) % nbits;
+        if (!(bits[bit / 8] & (1 << (bit % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int add_change_to_bloom_filter(Db* db, DocInfo* info, void* ctx)
+{
+    (void)db;
+    static_cast<BloomFilter*>(ctx)->add(&info->id);
+    return 0;
+}
+
+void db_load_bloom_filter(Db* db)
+{
+    if (db->bloom_filter || db->header.bloom_filter_pos == 0) {
+        return;
+    }
+
+    char* buf = NULL;
+    BloomFilter* filter = NULL;
+    int size;
+    {
+        ScopedFileTag tag(db->file.ops, db->file.handle, FileTag::BTree);
+        size = pread_bin(&db->file, db->header.bloom_filter_pos, &buf);
+    }
+    if (size > 0) {
+        filter = BloomFilter::deserialize(buf, size);
+    }
+    cb_free(buf);
+
+    // Add what was saved after the filter was last written out.
+    if (filter && db->header.update_seq > db->header.bloom_filter_seq) {
+        couchstore_error_t errcode = couchstore_changes_since(
+                db, db->header.bloom_filter_seq + 1, 0,
+                add_change_to_bloom_filter, filter);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            delete filter;
+            filter = NULL;
+        }
+    }
+
+    if (filter) {
+        db->bloom_filter = filter;
+        db->bloom_filter_pending =
+                db->header.update_seq - db->header.bloom_filter_seq;
+    } else {
+        // Carry on without one; it is rebuilt by the next compaction.
+        db->header.bloom_filter_pos = 0;
+        db->header.bloom_filter_seq = 0;
+    }
+}
+
+bool db_may_contain_id(Db* db, const sized_buf* id)
+{
+    db_load_bloom_filter(db);
+    return !db->bloom_filter || db->bloom_filter->maybeContains(id);
+}
+
+void db_add_to_bloom_filter(Db* db, const sized_buf* id, uint64_t seq)
+{
+    if (!db->bloom_filter) {
+        return;
+    }
+    db->bloom_filter->add(id);
+    if (seq <= db->header.bloom_filter_seq) {
+        // Wouldn't be added back from the by-sequence index when loading
+        // the filter, so it has to be written out.
+        db->bloom_filter_pending = UINT64_MAX;
+    } else if (db->bloom_filter_pending < UINT64_MAX) {
+        db->bloom_filter_pending++;
+    }
+}
+
+couchstore_error_t db_write_bloom_filter(Db* db, bool force)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (!db->bloom_filter || db->header.disk_version < COUCH_DISK_VERSION_15) {
+        return COUCHSTORE_SUCCESS;
+    }
+    if (!force && db->bloom_filter_pending <
+            db->bloom_filter->getExpectedEntries() / BLOOM_FILTER_WRITE_DIVISOR) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    try {
+        std::vector<char> data = db->bloom_filter->serialize();
+        sized_buf buf = {data.data(), data.size()};
+        cs_off_t pos;
+        error_pass(static_cast<couchstore_error_t>(
+                db_write_buf(&db->file, &buf, &pos, NULL)));
+        db->header.bloom_filter_pos = pos;
+        db->header.bloom_filter_seq = db->header.update_seq;
+        db->bloom_filter_pending = 0;
+    } catch (const std::bad_alloc&) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+cleanup:
+    return errcode;
+}
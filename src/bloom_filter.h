@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "internal.h"
+
+#include <vector>
+
+/* Minimum number of entries a Bloom filter is sized for */
+#define BLOOM_FILTER_MIN_ENTRIES 1024
+
+/**
+ * Bloom filter over the document IDs of a database, sized for a false
+ * positive rate of about 1% at its expected number of entries.
+ *
+ * The filter is written to the file as a chunk holding its serialized
+ * form, which the header points to (disk version 15 onwards), together
+ * with the update_seq it is complete up to. Documents saved after that
+ * are added when the filter is loaded, from the by-sequence index.
+ */
+class BloomFilter {
+public:
+    explicit BloomFilter(uint64_t _expected_entries);
+
+    /**
+     * Creates a filter from its serialized form (see serialize()).
+     * @return the filter, or NULL if 'buf' isn't a valid filter or memory
+     *         couldn't be allocated
+     */
+    static BloomFilter* deserialize(const char* buf, size_t size);
+
+    /** Returns the serialized form of the filter. */
+    std::vector<char> serialize() const;
+
+    void add(const sized_buf* key);
+
+    /** Returns false if 'key' was definitely never added. */
+    bool maybeContains(const sized_buf* key) const;
+
+    uint64_t getExpectedEntries() const {
+        return expected_entries;
+    }
+
+private:
+    BloomFilter(uint64_t _expected_entries, uint8_t _num_hashes, size_t nbytes);
+
+    uint64_t expected_entries;
+    uint8_t num_hashes;
+    std::vector<uint8_t> bits;
+};
+
+/**
+ * Loads the database's Bloom filter if the header points to one and it
+ * isn't loaded yet. On any failure the database is just left without a
+ * filter.
+ */
+void db_load_bloom_filter(Db* db);
+
+/**
+ * Returns false if the database has a Bloom filter and 'id' is definitely
+ * not in the by-id index.
+ */
+bool db_may_contain_id(Db* db, const sized_buf* id);
+
+/**
+ * Adds 'id', saved with sequence number 'seq', to the database's Bloom
+ * filter if it is loaded.
+ */
+void db_add_to_bloom_filter(Db* db, const sized_buf* id, uint64_t seq);
+
+/**
+ * Writes the database's Bloom filter to the file and points the header at
+ * it, if enough has been added to it since it was last written (or 'force'
+ * is set).
+ */
+couchstore_error_t db_write_bloom_filter(Db* db, bool force);
@@ -10,6 +10,7 @@
 #include "couch_btree.h"
 #include "util.h"
 #include "arena.h"
+#include "node_cache.h"
 #include "node_types.h"
 
 
@@ -111,6 +112,7 @@ couchfile_modify_result *new_btree_modres(arena *a, arena *transient_arena, tree
     rq->purge_kv = NULL;
     rq->kv_chunk_threshold = kv_chunk_threshold;
     rq->kp_chunk_threshold = kp_chunk_threshold;
+    rq->spine = NULL;
 
     couchfile_modify_result* mr = make_modres(a, rq);
     if (!mr)
@@ -213,14 +215,23 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
     cs_off_t diskpos;
     size_t disk_size;
     sized_buf final_key = {NULL, 0};
+    size_t entries_size;
+    size_t dirsize = 0;
+    char *prefixbuf = NULL;
 
     if (res->values_end == res->values || ! res->modified) {
         //Empty
         return COUCHSTORE_SUCCESS;
     }
 
+    // Every entry takes at least sizeof(raw_kv_length) bytes, which bounds
+    // the number of entries the offset directory may have to list.
+    if (res->rq->file->node_directory) {
+        dirsize = node_directory_size(res->node_len / sizeof(raw_kv_length));
+    }
+
     // nodebuf/writebuf is very short-lived and can be large, so use regular malloc heap for it:
-    nodebuf = static_cast<char*>(cb_malloc(res->node_len + 1));
+    nodebuf = static_cast<char*>(cb_malloc(res->node_len + 1 + dirsize));
     if (!nodebuf) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
@@ -246,10 +257,31 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
         itmcount++;
     }
 
-    writebuf.size = dst - nodebuf;
+    entries_size = dst - nodebuf;
+    writebuf.size = entries_size;
+    if (res->rq->file->node_prefix) {
+        prefixbuf = static_cast<char*>(cb_malloc(entries_size));
+        if (!prefixbuf) {
+            cb_free(nodebuf);
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        size_t prefixed_size = prefix_compress_node(nodebuf, entries_size, prefixbuf);
+        if (prefixed_size) {
+            writebuf.buf = prefixbuf;
+            writebuf.size = prefixed_size;
+        }
+    }
+    if (writebuf.buf == nodebuf && res->rq->file->node_directory) {
+        writebuf.size = write_node_directory(nodebuf, entries_size);
+    }
 
     errcode = static_cast<couchstore_error_t>(db_write_buf_compressed(res->rq->file, &writebuf, &diskpos, &disk_size));
+    if (errcode == COUCHSTORE_SUCCESS && res->rq->spine) {
+        res->rq->spine->written(res->rq->cmp, diskpos, nodebuf, entries_size,
+                                final_key);
+    }
     cb_free(nodebuf);  // here endeth the nodebuf.
+    cb_free(prefixbuf);
     if (errcode != COUCHSTORE_SUCCESS) {
         return errcode;
     }
@@ -295,7 +327,7 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
     res->pointers_end->next = pel;
     res->pointers_end = pel;
 
-    res->node_len -= (writebuf.size - 1);
+    res->node_len -= (entries_size - 1);
 
     res->values->next = i;
     if(i == NULL) {
@@ -411,29 +443,43 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
                                       couchfile_modify_result *dst)
 {
     char *nodebuf = NULL;  // FYI, nodebuf is a malloced block, not in the arena
+    // The node's entries: in nodebuf, or in spine_node
+    const char *entries = NULL;
     int bufpos = 1;
     int nodebuflen = 0;
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     couchfile_modify_result *local_result = NULL;
+    // Holds the entries instead, if the node is on the tree's kept right edge
+    CachedNodePtr spine_node;
 
     if (start == end) {
         return COUCHSTORE_SUCCESS;
     }
 
-    if (nptr) {
+    if (nptr && rq->spine && (spine_node = rq->spine->get(nptr->pointer))) {
+        entries = spine_node->buf;
+        nodebuflen = static_cast<int>(spine_node->size);
+    } else if (nptr) {
         if ((nodebuflen = pread_compressed(rq->file, nptr->pointer, (char **) &nodebuf)) < 0) {
             error_pass(static_cast<couchstore_error_t>(nodebuflen));
         }
+        if ((nodebuflen = expand_node(&nodebuf, nodebuflen)) < 0) {
+            error_pass(static_cast<couchstore_error_t>(nodebuflen));
+        }
+        // Only the entries are parsed, not any offset directory after them
+        nodebuflen = node_entries_end(nodebuf, nodebuflen);
+        error_unless(nodebuflen > 0, COUCHSTORE_ERROR_CORRUPT);
+        entries = nodebuf;
     }
 
     local_result = make_modres(dst->arena, rq);
     error_unless(local_result, COUCHSTORE_ERROR_ALLOC_FAIL);
 
-    if (nptr == NULL || nodebuf[0] == 1) { //KV Node
+    if (nptr == NULL || (entries[0] & NODE_TYPE_MASK) == KV_NODE) {
         local_result->node_type = KV_NODE;
         while (bufpos < nodebuflen) {
             sized_buf cmp_key, val_buf;
-            bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+            bufpos += read_kv(entries + bufpos, &cmp_key, &val_buf);
             int advance = 0;
             while (!advance && start < end) {
                 advance = 1;
@@ -517,11 +563,11 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
             }
             start++;
         }
-    } else if (nodebuf[0] == 0) { //KP Node
+    } else if ((entries[0] & NODE_TYPE_MASK) == KP_NODE) {
         local_result->node_type = KP_NODE;
         while (bufpos < nodebuflen && start < end) {
             sized_buf cmp_key, val_buf;
-            bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+            bufpos += read_kv(entries + bufpos, &cmp_key, &val_buf);
             int cmp_val = rq->cmp.compare(&cmp_key, rq->actions[start].key);
             if (bufpos == nodebuflen) {
                 //We're at the last item in the kpnode, must apply all our
@@ -577,7 +623,7 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
         }
         while (bufpos < nodebuflen) {
             sized_buf cmp_key, val_buf;
-            bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+            bufpos += read_kv(entries + bufpos, &cmp_key, &val_buf);
             node_pointer *add = read_pointer(dst->arena, &cmp_key, val_buf.buf);
             if (!add) {
                 errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -604,9 +650,7 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
         error_pass(mr_move_pointers(local_result, dst));
     }
 cleanup:
-    if (nodebuf) {
-        cb_free(nodebuf);
-    }
+    cb_free(nodebuf);
 
     return errcode;
 }
@@ -728,6 +772,9 @@ node_pointer *modify_btree(couchfile_modify_request *rq,
     root_result->node_type = KP_NODE;
     *errcode = modify_node(rq, root, 0, rq->num_actions, root_result);
     if (*errcode < 0) {
+        if (rq->spine) {
+            rq->spine->finish(NULL);
+        }
         delete_arena(a);
         return NULL;
     }
@@ -753,6 +800,9 @@ node_pointer *modify_btree(couchfile_modify_request *rq,
     if (ret_ptr != root) {
         ret_ptr = copy_node_pointer(ret_ptr);
     }
+    if (rq->spine) {
+        rq->spine->finish(ret_ptr);
+    }
     delete_arena(a);
     return ret_ptr;
 }
@@ -780,11 +830,16 @@ static couchstore_error_t purge_node(couchfile_modify_request *rq,
     if ((nodebuflen = pread_compressed(rq->file, nptr->pointer, (char **) &nodebuf)) < 0) {
         error_pass(static_cast<couchstore_error_t>(nodebuflen));
     }
+    if ((nodebuflen = expand_node(&nodebuf, nodebuflen)) < 0) {
+        error_pass(static_cast<couchstore_error_t>(nodebuflen));
+    }
+    nodebuflen = node_entries_end(nodebuf, nodebuflen);
+    error_unless(nodebuflen > 0, COUCHSTORE_ERROR_CORRUPT);
 
     local_result = make_modres(dst->arena, rq);
     error_unless(local_result, COUCHSTORE_ERROR_ALLOC_FAIL);
 
-    if (nodebuf[0] == 1) { //KV Node
+    if ((nodebuf[0] & NODE_TYPE_MASK) == KV_NODE) {
         local_result->node_type = KV_NODE;
         while (bufpos < nodebuflen) {
             sized_buf cmp_key, val_buf;
@@ -795,7 +850,7 @@ static couchstore_error_t purge_node(couchfile_modify_request *rq,
                 goto cleanup;
             }
         }
-    } else if (nodebuf[0] == 0) { //KP Node
+    } else if ((nodebuf[0] & NODE_TYPE_MASK) == KP_NODE) {
         local_result->node_type = KP_NODE;
         while (bufpos < nodebuflen) {
             sized_buf cmp_key, val_buf;
@@ -4,8 +4,11 @@
 #include <stdlib.h>
 #include "couch_btree.h"
 #include "util.h"
+#include "node_cache.h"
 #include "node_types.h"
 
+#include <vector>
+
 /* Helper function to handle lookup specific special cases */
 static int lookup_compare(couchfile_lookup_request *rq,
                           const sized_buf *key1,
@@ -23,34 +26,205 @@ static int lookup_compare(couchfile_lookup_request *rq,
     return rq->cmp.compare(key1, key2);
 }
 
+/* Returns the position of the first entry at or after 'bufpos' whose key is
+ * not less than 'key', using binary search over the node's offset directory.
+ * Only used while not folding, when the entries being skipped over would
+ * not have been acted on anyway. Returns 'bufpos' unchanged if the node has
+ * no (usable) offset directory, so that it is just scanned as before. */
+static int seek_entry(couchfile_lookup_request *rq,
+                      const char *nodebuf,
+                      int nodebuflen,
+                      int entries_end,
+                      int bufpos,
+                      const sized_buf *key)
+{
+    uint32_t count = node_directory_count(nodebuf, nodebuflen);
+    uint32_t lo = 0, hi = count;
+    // First entry at or after bufpos...
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int offset = node_directory_entry(nodebuf, nodebuflen, mid);
+        if (offset < 1 || offset >= entries_end) {
+            return bufpos;
+        }
+        if (offset < bufpos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    // ...then the first of those with a key >= 'key'.
+    hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int offset = node_directory_entry(nodebuf, nodebuflen, mid);
+        if (offset < 1 || offset >= entries_end) {
+            return bufpos;
+        }
+        sized_buf cmp_key, val_buf;
+        read_kv(nodebuf + offset, &cmp_key, &val_buf);
+        if (lookup_compare(rq, &cmp_key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == count) {
+        return count ? entries_end : bufpos;
+    }
+    return node_directory_entry(nodebuf, nodebuflen, lo);
+}
+
+/* A child node read ahead of being visited (see prefetch_children) */
+struct prefetched_node {
+    uint64_t pointer;
+    CachedNodePtr node;
+    int len;  // as returned by pread_node
+};
+
+/* When looking up individual keys (rather than folding over a range), the
+ * children of a KP node which are going to be visited are known before
+ * visiting any of them. Reads all of those for keys [current, end) in one
+ * batch, so that the reads can be in flight at the same time.
+ * If the batch can't be allocated 'children' is left empty and the nodes
+ * are just read one at a time as they are visited. A child whose read
+ * failed keeps the error, which is returned when it is visited. Reads that
+ * io_uring fails to complete are retried with pread() (see
+ * PosixFileOps::pread_batch()), once none of them is still in flight. */
+static void prefetch_children(couchfile_lookup_request *rq,
+                              const char *nodebuf,
+                              int nodebuflen,
+                              int entries_end,
+                              int current,
+                              int end,
+                              std::vector<prefetched_node>& children)
+{
+    try {
+        std::vector<cs_off_t> positions;
+        int bufpos = 1;
+        while (current < end) {
+            bufpos = seek_entry(rq, nodebuf, nodebuflen, entries_end, bufpos,
+                                rq->keys[current]);
+            if (bufpos >= entries_end) {
+                break;
+            }
+            sized_buf cmp_key, val_buf;
+            bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+            if (lookup_compare(rq, &cmp_key, rq->keys[current]) >= 0) {
+                do {
+                    current++;
+                } while (current < end && lookup_compare(rq, &cmp_key, rq->keys[current]) >= 0);
+                const raw_node_pointer *raw = (const raw_node_pointer*)val_buf.buf;
+                positions.push_back(decode_raw48(raw->pointer));
+            }
+        }
+        if (positions.size() < 2) {
+            return;
+        }
+
+        std::vector<CachedNodePtr> nodes(positions.size());
+        std::vector<int> lens(positions.size());
+        {
+            ScopedFileTag tag(rq->file->ops, rq->file->handle, FileTag::BTree);
+            pread_nodes(rq->file, positions.size(), positions.data(),
+                        nodes.data(), lens.data());
+        }
+        children.reserve(positions.size());
+        for (size_t ii = 0; ii < positions.size(); ++ii) {
+            children.push_back({uint64_t(positions[ii]), std::move(nodes[ii]),
+                                lens[ii]});
+        }
+    } catch (const std::bad_alloc&) {
+        children.clear();
+    }
+}
+
+/* In fold mode the children of a KP node are visited one after the other,
+ * until the end of the range. Before descending into the child whose entry
+ * ends at 'bufpos', advises the file ops that the nodes of the next few
+ * children will be needed too, so that they can be read in while the
+ * current subtree is being processed. '*advised_pos' is the end of the
+ * last entry advised so far, so that each child is only advised once. */
+static void prefetch_next_children(couchfile_lookup_request *rq,
+                                   const char *nodebuf,
+                                   int entries_end,
+                                   int bufpos,
+                                   int *advised_pos)
+{
+    tree_file *file = rq->file;
+    for (uint32_t ii = 0;
+         ii < file->options.prefetch_children && bufpos < entries_end;
+         ++ii) {
+        sized_buf cmp_key, val_buf;
+        int entry_pos = bufpos;
+        bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+        if (entry_pos < *advised_pos) {
+            continue;
+        }
+        const raw_node_pointer *raw = (const raw_node_pointer*)val_buf.buf;
+        // Only a hint; failures don't matter.
+        file->ops->advise(NULL, file->handle, decode_raw48(raw->pointer),
+                          PREFETCH_NODE_EXTENT,
+                          COUCHSTORE_FILE_ADVICE_WILLNEED);
+        *advised_pos = bufpos;
+    }
+}
+
 static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
                                              uint64_t diskpos,
                                              int current,
-                                             int end)
+                                             int end,
+                                             prefetched_node *prefetched)
 {
-    int bufpos = 1, nodebuflen = 0;
+    int bufpos = 1, nodebuflen = 0, entries_end = 0;
 
     if (current == end) {
         return COUCHSTORE_SUCCESS;
     }
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
 
-    char *nodebuf = NULL;
+    CachedNodePtr node;
+    const char *nodebuf = NULL;
 
-    {
+    if (prefetched) {
+        node = std::move(prefetched->node);
+        nodebuflen = prefetched->len;
+    } else {
         ScopedFileTag tag(rq->file->ops, rq->file->handle, FileTag::BTree);
-        nodebuflen = pread_compressed(rq->file, diskpos, &nodebuf);
+        nodebuflen = pread_node(rq->file, diskpos, &node);
     }
     error_unless(nodebuflen >= 0, (static_cast<couchstore_error_t>(nodebuflen)));  // if negative, it's an error code
+    nodebuf = node->buf;
+    entries_end = node_entries_end(nodebuf, nodebuflen);
+    error_unless(entries_end > 0, COUCHSTORE_ERROR_CORRUPT);
+
+    if ((nodebuf[0] & NODE_TYPE_MASK) == KP_NODE) {
+        std::vector<prefetched_node> children;
+        size_t next_child = 0;
+        int advised_pos = 0;
+        if (!rq->fold) {
+            prefetch_children(rq, nodebuf, nodebuflen, entries_end, current,
+                              end, children);
+        }
 
-    if (nodebuf[0] == 0) { //KP Node
-        while (bufpos < nodebuflen && current < end) {
+        while (bufpos < entries_end && current < end) {
+            if (!rq->in_fold) {
+                bufpos = seek_entry(rq, nodebuf, nodebuflen, entries_end,
+                                    bufpos, rq->keys[current]);
+                if (bufpos >= entries_end) {
+                    break;
+                }
+            }
             sized_buf cmp_key, val_buf;
             bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
 
             if (lookup_compare(rq, &cmp_key, rq->keys[current]) >= 0) {
                 if (rq->fold) {
                     rq->in_fold = 1;
+                    if (rq->file->options.prefetch_children) {
+                        prefetch_next_children(rq, nodebuf, entries_end,
+                                               bufpos, &advised_pos);
+                    }
                 }
 
                 uint64_t pointer = 0;
@@ -71,8 +245,14 @@ static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
 
                 pointer = decode_raw48(raw->pointer);
 
+                prefetched_node *child = NULL;
+                if (next_child < children.size() &&
+                    children[next_child].pointer == pointer) {
+                    child = &children[next_child++];
+                }
+
                 couchstore_error_t errcode_local =
-                        btree_lookup_inner(rq, pointer, current, last_item);
+                        btree_lookup_inner(rq, pointer, current, last_item, child);
                 if (rq->tolerate_corruption) {
                     error_tolerate(errcode_local);
                 } else {
@@ -87,11 +267,20 @@ static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
                 }
             }
         }
-    } else if (nodebuf[0] == 1) { //KV Node
+    } else if ((nodebuf[0] & NODE_TYPE_MASK) == KV_NODE) {
         sized_buf cmp_key, val_buf;
         bool next_key = true;
-        while (bufpos < nodebuflen && current < end) {
+        // The last entry may still have to be compared with the next key
+        // (when the previous key wasn't found).
+        while ((bufpos < entries_end || !next_key) && current < end) {
             if (next_key) {
+                if (!rq->in_fold) {
+                    bufpos = seek_entry(rq, nodebuf, nodebuflen, entries_end,
+                                        bufpos, rq->keys[current]);
+                    if (bufpos >= entries_end) {
+                        break;
+                    }
+                }
                 bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
             }
 
@@ -140,8 +329,6 @@ static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
     }
 
 cleanup:
-    cb_free(nodebuf);
-
     return errcode;
 }
 
@@ -149,5 +336,5 @@ couchstore_error_t btree_lookup(couchfile_lookup_request *rq,
                                 uint64_t root_pointer)
 {
     rq->in_fold = 0;
-    return btree_lookup_inner(rq, root_pointer, 0, rq->num_keys);
+    return btree_lookup_inner(rq, root_pointer, 0, rq->num_keys, NULL);
 }
@@ -0,0 +1,333 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+#include "codec.h"
+
+#include <memory>
+#include <new>
+
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_ZSTD
+// Contexts are costly to create, so each thread keeps one of each.
+static ZSTD_CCtx* zstd_cctx()
+{
+    static thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)>
+            cctx(nullptr, ZSTD_freeCCtx);
+    if (!cctx) {
+        cctx.reset(ZSTD_createCCtx());
+    }
+    return cctx.get();
+}
+
+static ZSTD_DCtx* zstd_dctx()
+{
+    static thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)>
+            dctx(nullptr, ZSTD_freeDCtx);
+    if (!dctx) {
+        dctx.reset(ZSTD_createDCtx());
+    }
+    return dctx.get();
+}
+
+static couchstore_error_t zstd_deflate(cb::const_char_buffer input,
+                                       cb::compression::Buffer& output,
+                                       const ZSTD_CDict* cdict)
+{
+    ZSTD_CCtx* cctx = zstd_cctx();
+    if (!cctx) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    output.resize(ZSTD_compressBound(input.size()));
+    size_t size;
+    if (cdict) {
+        size = ZSTD_compress_usingCDict(cctx, output.data(), output.size(),
+                                        input.data(), input.size(), cdict);
+    } else {
+        size = ZSTD_compressCCtx(cctx, output.data(), output.size(),
+                                 input.data(), input.size(),
+                                 ZSTD_COMPRESSION_LEVEL);
+    }
+    if (ZSTD_isError(size)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    output.resize(size);
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t zstd_inflate(cb::const_char_buffer input,
+                                       cb::compression::Buffer& output,
+                                       const ZSTD_DDict* ddict)
+{
+    ZSTD_DCtx* dctx = zstd_dctx();
+    if (!dctx) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    // Frames record the size of their content.
+    unsigned long long size = ZSTD_getFrameContentSize(input.data(),
+                                                       input.size());
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    output.resize(size_t(size));
+    size_t decompressed;
+    if (ddict) {
+        decompressed = ZSTD_decompress_usingDDict(dctx,
+                                                  output.data(), output.size(),
+                                                  input.data(), input.size(),
+                                                  ddict);
+    } else {
+        decompressed = ZSTD_decompressDCtx(dctx, output.data(), output.size(),
+                                           input.data(), input.size());
+    }
+    if (ZSTD_isError(decompressed) || decompressed != size) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+#endif
+
+DocDictionary::DocDictionary(std::vector<char> _data)
+    : data(std::move(_data)), cdict(nullptr), ddict(nullptr)
+{
+}
+
+DocDictionary::~DocDictionary()
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+#endif
+}
+
+DocDictionary* DocDictionary::train(const std::vector<char>& samples,
+                                    const std::vector<size_t>& sizes,
+                                    size_t capacity)
+{
+#ifdef HAVE_ZSTD
+    try {
+        std::vector<char> dict(capacity);
+        size_t size = ZDICT_trainFromBuffer(dict.data(), dict.size(),
+                                            samples.data(), sizes.data(),
+                                            unsigned(sizes.size()));
+        if (ZDICT_isError(size)) {
+            return NULL;
+        }
+        return create(dict.data(), size);
+    } catch (const std::bad_alloc&) {
+        return NULL;
+    }
+#else
+    return NULL;
+#endif
+}
+
+DocDictionary* DocDictionary::create(const char* buf, size_t size)
+{
+#ifdef HAVE_ZSTD
+    std::unique_ptr<DocDictionary> dict;
+    try {
+        dict.reset(new DocDictionary(std::vector<char>(buf, buf + size)));
+    } catch (const std::bad_alloc&) {
+        return NULL;
+    }
+    dict->cdict = ZSTD_createCDict(buf, size, ZSTD_COMPRESSION_LEVEL);
+    dict->ddict = ZSTD_createDDict(buf, size);
+    if (!dict->cdict || !dict->ddict) {
+        return NULL;
+    }
+    return dict.release();
+#else
+    return NULL;
+#endif
+}
+
+couchstore_error_t DocDictionary::deflate(cb::const_char_buffer input,
+                                          cb::compression::Buffer& output) const
+{
+#ifdef HAVE_ZSTD
+    return zstd_deflate(input, output, cdict);
+#else
+    return COUCHSTORE_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+couchstore_error_t DocDictionary::inflate(cb::const_char_buffer input,
+                                          cb::compression::Buffer& output) const
+{
+#ifdef HAVE_ZSTD
+    return zstd_inflate(input, output, ddict);
+#else
+    return COUCHSTORE_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+bool codec_supported(couchstore_codec codec)
+{
+    switch (codec) {
+    case COUCHSTORE_CODEC_SNAPPY:
+    case COUCHSTORE_CODEC_LZ4:
+        return true;
+    case COUCHSTORE_CODEC_ZSTD:
+    case COUCHSTORE_CODEC_ZSTD_DICT:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+couchstore_error_t codec_deflate(couchstore_codec codec,
+                                 const DocDictionary* dict,
+                                 cb::const_char_buffer input,
+                                 cb::compression::Buffer& output)
+{
+    using cb::compression::Algorithm;
+
+    try {
+        switch (codec) {
+        case COUCHSTORE_CODEC_SNAPPY:
+            return cb::compression::deflate(Algorithm::Snappy, input, output)
+                           ? COUCHSTORE_SUCCESS
+                           : COUCHSTORE_ERROR_CORRUPT;
+        case COUCHSTORE_CODEC_LZ4:
+            return cb::compression::deflate(Algorithm::LZ4, input, output)
+                           ? COUCHSTORE_SUCCESS
+                           : COUCHSTORE_ERROR_CORRUPT;
+#ifdef HAVE_ZSTD
+        case COUCHSTORE_CODEC_ZSTD:
+            return zstd_deflate(input, output, nullptr);
+        case COUCHSTORE_CODEC_ZSTD_DICT:
+            if (!dict) {
+                return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+            }
+            return dict->deflate(input, output);
+#endif
+        }
+    } catch (const std::bad_alloc&) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    return COUCHSTORE_ERROR_NOT_SUPPORTED;
+}
+
+couchstore_error_t codec_inflate(couchstore_codec codec,
+                                 const DocDictionary* dict,
+                                 cb::const_char_buffer input,
+                                 cb::compression::Buffer& output)
+{
+    using cb::compression::Algorithm;
+
+    try {
+        switch (codec) {
+        case COUCHSTORE_CODEC_SNAPPY:
+            return cb::compression::inflate(Algorithm::Snappy, input, output)
+                           ? COUCHSTORE_SUCCESS
+                           : COUCHSTORE_ERROR_CORRUPT;
+        case COUCHSTORE_CODEC_LZ4:
+            return cb::compression::inflate(Algorithm::LZ4, input, output)
+                           ? COUCHSTORE_SUCCESS
+                           : COUCHSTORE_ERROR_CORRUPT;
+        case COUCHSTORE_CODEC_ZSTD:
+        case COUCHSTORE_CODEC_ZSTD_DICT:
+#ifdef HAVE_ZSTD
+            if (codec == COUCHSTORE_CODEC_ZSTD) {
+                return zstd_inflate(input, output, nullptr);
+            }
+            // A body compressed with a dictionary the file doesn't have
+            if (!dict) {
+                return COUCHSTORE_ERROR_CORRUPT;
+            }
+            return dict->inflate(input, output);
+#else
+            return COUCHSTORE_ERROR_NOT_SUPPORTED;
+#endif
+        }
+    } catch (const std::bad_alloc&) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    // Not a codec: the node or body is damaged.
+    return COUCHSTORE_ERROR_CORRUPT;
+}
+
+couchstore_codec tree_file_doc_codec(const tree_file* file)
+{
+    return file->codec_ids ? file->options.doc_codec
+                           : couchstore_codec(COUCHSTORE_CODEC_SNAPPY);
+}
+
+couchstore_codec db_body_codec(const Db* db,
+                               couchstore_content_meta_flags content_meta)
+{
+    return db->file.codec_ids ? doc_codec(content_meta)
+                              : couchstore_codec(COUCHSTORE_CODEC_SNAPPY);
+}
+
+couchstore_error_t db_load_doc_dictionary(Db* db)
+{
+    if (db->doc_dictionary_loaded) {
+        return COUCHSTORE_SUCCESS;
+    }
+    if (!codec_supported(COUCHSTORE_CODEC_ZSTD_DICT)) {
+        return COUCHSTORE_ERROR_NOT_SUPPORTED;
+    }
+
+    LocalDoc* ldoc = NULL;
+    couchstore_error_t errcode = couchstore_open_local_document(
+            db, DOC_DICTIONARY_ID, sizeof(DOC_DICTIONARY_ID) - 1, &ldoc);
+    if (errcode == COUCHSTORE_ERROR_DOC_NOT_FOUND) {
+        db->doc_dictionary_loaded = true;
+        return COUCHSTORE_SUCCESS;
+    }
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    if (!ldoc->deleted) {
+        db->doc_dictionary = DocDictionary::create(ldoc->json.buf,
+                                                   ldoc->json.size);
+        if (!db->doc_dictionary) {
+            errcode = COUCHSTORE_ERROR_CORRUPT;
+        }
+    }
+    couchstore_free_local_document(ldoc);
+    db->doc_dictionary_loaded = errcode == COUCHSTORE_SUCCESS;
+    return errcode;
+}
+
+couchstore_error_t db_doc_codec(Db* db,
+                                couchstore_codec* codec,
+                                const DocDictionary** dict)
+{
+    *codec = tree_file_doc_codec(&db->file);
+    *dict = NULL;
+    if (*codec == COUCHSTORE_CODEC_ZSTD_DICT) {
+        couchstore_error_t errcode = db_load_doc_dictionary(db);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+        *dict = db->doc_dictionary;
+        if (!*dict) {
+            *codec = COUCHSTORE_CODEC_ZSTD;
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
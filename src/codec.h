@@ -0,0 +1,148 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "internal.h"
+
+#include <platform/compress.h>
+
+#include <vector>
+
+/*
+ * Compression of B-tree nodes and document bodies with the codec
+ * (couchstore_codec) selected for them.
+ *
+ * From disk version 17 on, each compressed B-tree node starts with a byte
+ * holding the codec it was compressed with, and the content_meta of each
+ * compressed document body holds its codec (COUCH_DOC_CODEC_MASK). Files
+ * at older versions are compressed with Snappy throughout.
+ */
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+/**
+ * Zstandard dictionary trained from a sample of a file's document bodies
+ * (COUCHSTORE_CODEC_ZSTD_DICT), which compresses small bodies sharing the
+ * same field names far better than compressing each on its own. It is
+ * kept in the file as the local document DOC_DICTIONARY_ID, and digested
+ * once when loaded.
+ */
+class DocDictionary {
+public:
+    /**
+     * Trains a dictionary of at most 'capacity' bytes from samples
+     * concatenated in 'samples', of the sizes in 'sizes'.
+     * @return the dictionary, or NULL if there are too few samples to
+     *         train one, Zstandard isn't built in, or memory couldn't be
+     *         allocated
+     */
+    static DocDictionary* train(const std::vector<char>& samples,
+                                const std::vector<size_t>& sizes,
+                                size_t capacity);
+
+    /**
+     * Creates a dictionary from its serialized form (see getData()).
+     * @return the dictionary, or NULL if 'buf' isn't a valid dictionary,
+     *         Zstandard isn't built in, or memory couldn't be allocated
+     */
+    static DocDictionary* create(const char* buf, size_t size);
+
+    ~DocDictionary();
+
+    /** Returns the serialized form of the dictionary. */
+    const std::vector<char>& getData() const {
+        return data;
+    }
+
+    couchstore_error_t deflate(cb::const_char_buffer input,
+                               cb::compression::Buffer& output) const;
+
+    couchstore_error_t inflate(cb::const_char_buffer input,
+                               cb::compression::Buffer& output) const;
+
+private:
+    DocDictionary(std::vector<char> _data);
+
+    std::vector<char> data;
+    ZSTD_CDict_s* cdict;
+    ZSTD_DDict_s* ddict;
+};
+
+/** Returns true if 'codec' is built in. */
+bool codec_supported(couchstore_codec codec);
+
+/**
+ * Compresses 'input' with 'codec' into 'output'. 'dict' is the dictionary
+ * for COUCHSTORE_CODEC_ZSTD_DICT, and ignored by the other codecs.
+ */
+couchstore_error_t codec_deflate(couchstore_codec codec,
+                                 const DocDictionary* dict,
+                                 cb::const_char_buffer input,
+                                 cb::compression::Buffer& output);
+
+/**
+ * Decompresses 'input', compressed with 'codec' (and 'dict'), into
+ * 'output'.
+ */
+couchstore_error_t codec_inflate(couchstore_codec codec,
+                                 const DocDictionary* dict,
+                                 cb::const_char_buffer input,
+                                 cb::compression::Buffer& output);
+
+/** Returns the codec document bodies are compressed with in 'file'. */
+couchstore_codec tree_file_doc_codec(const tree_file* file);
+
+/**
+ * Returns the codec of a compressed document body with 'content_meta' in
+ * 'db'. Files older than COUCH_DISK_VERSION_17 only hold Snappy-compressed
+ * bodies, whatever the codec bits of their content_meta say.
+ */
+couchstore_codec db_body_codec(const Db* db,
+                               couchstore_content_meta_flags content_meta);
+
+/**
+ * Loads the database's document dictionary if it has one and it isn't
+ * loaded yet.
+ */
+couchstore_error_t db_load_doc_dictionary(Db* db);
+
+/**
+ * Sets 'codec' and 'dict' to what the database's document bodies are
+ * compressed with: its dictionary, if the document codec is
+ * COUCHSTORE_CODEC_ZSTD_DICT and the file has one, and otherwise no
+ * dictionary, and COUCHSTORE_CODEC_ZSTD in place of
+ * COUCHSTORE_CODEC_ZSTD_DICT.
+ */
+couchstore_error_t db_doc_codec(Db* db,
+                                couchstore_codec* codec,
+                                const DocDictionary** dict);
+
+/** Returns the codec of a compressed document body with 'content_meta'. */
+inline couchstore_codec doc_codec(couchstore_content_meta_flags content_meta)
+{
+    return couchstore_codec((content_meta & COUCH_DOC_CODEC_MASK) >> 4);
+}
+
+/** Returns 'content_meta' of a document body compressed with 'codec'. */
+inline couchstore_content_meta_flags set_doc_codec(
+        couchstore_content_meta_flags content_meta, couchstore_codec codec)
+{
+    return couchstore_content_meta_flags(
+            (content_meta & ~COUCH_DOC_CODEC_MASK) | (codec << 4));
+}
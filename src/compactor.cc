@@ -12,7 +12,7 @@ static void exit_error(couchstore_error_t errcode)
 }
 
 static void usage(const char* prog) {
-    fprintf(stderr, "Usage: %s [--purge-before <timestamp>] [--purge-only-upto-seq seq] [--dropdeletes] [--upgrade] <input file> <output file>\n", prog);
+    fprintf(stderr, "Usage: %s [--purge-before <timestamp>] [--purge-only-upto-seq seq] [--dropdeletes] [--upgrade] [--parallel] <input file> <output file>\n", prog);
     exit(-1);
 }
 
@@ -100,6 +100,14 @@ int main(int argc, char** argv)
             }
             flags |= COUCHSTORE_COMPACT_FLAG_UPGRADE_DB;
         }
+
+        if(!strcmp(argv[argp], "--parallel")) {
+            argp++;
+            if(argc + argp < 2) {
+                usage(argv[0]);
+            }
+            flags |= COUCHSTORE_COMPACT_WITH_PARALLEL_READS;
+        }
     }
 
     errcode = couchstore_open_db(argv[argp++], COUCHSTORE_OPEN_FLAG_RDONLY, &source);
@@ -123,6 +123,8 @@ extern "C" {
         int compacting;
         int kv_chunk_threshold;
         int kp_chunk_threshold;
+        /* If set, the tree's right edge is read from and kept in here */
+        RightSpine *spine;
     } couchfile_modify_request;
 
 #define KP_NODE 0
@@ -6,11 +6,18 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <vector>
 
 #include "internal.h"
 #include "node_types.h"
 #include "couch_btree.h"
 #include "bitfield.h"
+#include "bloom_filter.h"
+#include "codec.h"
+#include "node_cache.h"
 #include "reduces.h"
 #include "util.h"
 
@@ -37,11 +44,14 @@ cleanup:
 }
 
 // Attempts to initialize the database from a header at the given file position
-static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
+static couchstore_error_t read_header_at_pos(Db *db, cs_off_t pos)
 {
     int seqrootsize;
     int idrootsize;
     int localrootsize;
+    int chainsize = 0;
+    int codecssize = 0;
+    int bloomrootsize = 0;
     char *root_data;
     int header_len;
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
@@ -49,20 +59,6 @@ static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
         raw_file_header *raw;
         char *buf;
     } header_buf = { NULL };
-    uint8_t buf[2];
-    ssize_t readsize;
-    {
-        // Speculative read looking for header, mark as Empty.
-        ScopedFileTag tag(db->file.ops, db->file.handle, FileTag::Empty);
-        readsize = db->file.ops->pread(
-                &db->file.lastError, db->file.handle, buf, 2, pos);
-    }
-    error_unless(readsize == 2, COUCHSTORE_ERROR_READ);
-    if (buf[0] == 0) {
-        return COUCHSTORE_ERROR_NO_HEADER;
-    } else if (buf[0] != 1) {
-        return COUCHSTORE_ERROR_CORRUPT;
-    }
 
     header_len = pread_header(&db->file, pos, &header_buf.buf, MAX_DB_HEADER_SIZE);
     if (header_len < 0) {
@@ -72,10 +68,11 @@ static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
     db->header.position = pos;
     db->header.disk_version = decode_raw08(header_buf.raw->version);
 
-    // Only 12 and 11 are valid
-    error_unless(db->header.disk_version == COUCH_DISK_VERSION ||
-                 db->header.disk_version == COUCH_DISK_VERSION_11,
+    // Only 11 to 17 are valid
+    error_unless(db->header.disk_version >= COUCH_DISK_VERSION_11 &&
+                 db->header.disk_version <= COUCH_DISK_VERSION,
                  COUCHSTORE_ERROR_HEADER_VERSION);
+    tree_file_set_disk_version(&db->file, db->header.disk_version);
     db->header.update_seq = decode_raw48(header_buf.raw->update_seq);
     db->header.purge_seq = decode_raw48(header_buf.raw->purge_seq);
     db->header.purge_ptr = decode_raw48(header_buf.raw->purge_ptr);
@@ -83,7 +80,19 @@ static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
     seqrootsize = decode_raw16(header_buf.raw->seqrootsize);
     idrootsize = decode_raw16(header_buf.raw->idrootsize);
     localrootsize = decode_raw16(header_buf.raw->localrootsize);
-    error_unless(header_len == HEADER_BASE_SIZE + seqrootsize + idrootsize + localrootsize,
+    if (db->header.disk_version >= COUCH_DISK_VERSION_16) {
+        chainsize = sizeof(raw_header_chain);
+    }
+    if (db->header.disk_version >= COUCH_DISK_VERSION_17) {
+        codecssize = sizeof(raw_header_codecs);
+    }
+    if (db->header.disk_version >= COUCH_DISK_VERSION_15 &&
+        header_len == HEADER_BASE_SIZE + seqrootsize + idrootsize + localrootsize +
+                      chainsize + codecssize + int(sizeof(raw_bloom_filter_root))) {
+        bloomrootsize = sizeof(raw_bloom_filter_root);
+    }
+    error_unless(header_len == HEADER_BASE_SIZE + seqrootsize + idrootsize + localrootsize +
+                               chainsize + codecssize + bloomrootsize,
                  COUCHSTORE_ERROR_CORRUPT);
 
     root_data = (char*) (header_buf.raw + 1);  // i.e. just past *header_buf
@@ -92,39 +101,164 @@ static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
     error_pass(read_db_root(db, &db->header.by_id_root, root_data, idrootsize));
     root_data += idrootsize;
     error_pass(read_db_root(db, &db->header.local_docs_root, root_data, localrootsize));
+    root_data += localrootsize;
+    db->header.chain = {0, 0, 0};
+    db->header.chain_restart = false;
+    if (chainsize) {
+        const raw_header_chain *chain = (const raw_header_chain*)root_data;
+        db->header.chain.height = decode_raw48(chain->height);
+        db->header.chain.prev_pos = decode_raw48(chain->prev_pos);
+        db->header.chain.skip_pos = decode_raw48(chain->skip_pos);
+        error_unless(db->header.chain.height == 0 ||
+                     (db->header.chain.prev_pos < db->header.position &&
+                      db->header.chain.skip_pos <= db->header.chain.prev_pos),
+                     COUCHSTORE_ERROR_CORRUPT);
+        root_data += chainsize;
+    }
+    db->header.doc_codec = COUCHSTORE_CODEC_SNAPPY;
+    if (codecssize) {
+        const raw_header_codecs *codecs = (const raw_header_codecs*)root_data;
+        db->header.doc_codec = couchstore_codec(decode_raw08(codecs->doc_codec));
+        error_unless(db->header.doc_codec <= COUCHSTORE_CODEC_ZSTD_DICT,
+                     COUCHSTORE_ERROR_CORRUPT);
+        root_data += codecssize;
+    }
+    db->header.bloom_filter_pos = 0;
+    db->header.bloom_filter_seq = 0;
+    if (bloomrootsize) {
+        const raw_bloom_filter_root *bloom = (const raw_bloom_filter_root*)root_data;
+        db->header.bloom_filter_pos = decode_raw48(bloom->pointer);
+        db->header.bloom_filter_seq = decode_raw48(bloom->update_seq);
+        error_unless(db->header.bloom_filter_pos < db->header.position,
+                     COUCHSTORE_ERROR_CORRUPT);
+    }
 
 cleanup:
     cb_free(header_buf.raw);
     return errcode;
 }
 
-// Finds the database header by scanning back from the end of the file at 4k boundaries
+// Reads the prefix byte of the block at 'pos', which says whether a header
+// starts there.
+static couchstore_error_t read_block_prefix(Db *db, int64_t pos, char *prefix)
+{
+    // Speculative read looking for header, mark as Empty.
+    ScopedFileTag tag(db->file.ops, db->file.handle, FileTag::Empty);
+    ssize_t readsize = db->file.ops->pread(&db->file.lastError,
+                                           db->file.handle, prefix, 1, pos);
+    return readsize == 1 ? COUCHSTORE_SUCCESS : COUCHSTORE_ERROR_READ;
+}
+
+// Finds the database header by scanning back from the end of the file at 4k
+// boundaries. The file is read backwards a window at a time, and the block
+// prefix bytes are checked in memory, so that only blocks marked as holding
+// a header are read individually. The window starts at one block, as the
+// header is usually in the last one, and doubles up to HEADER_SEARCH_WINDOW
+// bytes. If a window can't be read, its blocks' prefixes are read one by
+// one, and a block that can't be read counts as an invalid header.
 static couchstore_error_t find_header(Db *db, int64_t start_pos)
 {
     couchstore_error_t last_header_errcode = COUCHSTORE_ERROR_NO_HEADER;
     int64_t pos = start_pos;
+    int64_t window_size = COUCH_BLOCK_SIZE;
+    int64_t window_capacity = 0;
+    char *window = NULL;
     pos -= pos % COUCH_BLOCK_SIZE;
-    for (; pos >= 0; pos -= COUCH_BLOCK_SIZE) {
-        couchstore_error_t errcode = find_header_at_pos(db, pos);
-        switch(errcode) {
-            case COUCHSTORE_SUCCESS:
-                // Found it!
-                return COUCHSTORE_SUCCESS;
-            case COUCHSTORE_ERROR_NO_HEADER:
-                // No header here, so keep going
-                break;
-            case COUCHSTORE_ERROR_ALLOC_FAIL:
-                // Fatal error
-                return errcode;
-            default:
-                // Invalid header; continue, but remember the last error
-                last_header_errcode = errcode;
-                break;
+
+    while (pos >= 0) {
+        const int64_t window_start =
+                std::max(int64_t(0), pos - window_size + COUCH_BLOCK_SIZE);
+        const ssize_t window_len = pos - window_start + 1;
+        if (window_len > window_capacity) {
+            char *grown = static_cast<char*>(cb_realloc(window, window_len));
+            if (!grown) {
+                cb_free(window);
+                return COUCHSTORE_ERROR_ALLOC_FAIL;
+            }
+            window = grown;
+            window_capacity = window_len;
         }
+        ssize_t readsize;
+        {
+            // Speculative read looking for headers, mark as Empty.
+            ScopedFileTag tag(db->file.ops, db->file.handle, FileTag::Empty);
+            readsize = db->file.ops->pread(&db->file.lastError, db->file.handle,
+                                           window, window_len, window_start);
+        }
+        const bool window_read = readsize == window_len;
+
+        for (; pos >= window_start; pos -= COUCH_BLOCK_SIZE) {
+            couchstore_error_t errcode;
+            char prefix;
+            if (window_read) {
+                prefix = window[pos - window_start];
+            } else {
+                errcode = read_block_prefix(db, pos, &prefix);
+                if (errcode != COUCHSTORE_SUCCESS) {
+                    last_header_errcode = errcode;
+                    continue;
+                }
+            }
+            switch (prefix) {
+                case 0:
+                    // No header here, so keep going
+                    continue;
+                case 1:
+                    errcode = read_header_at_pos(db, pos);
+                    break;
+                default:
+                    errcode = COUCHSTORE_ERROR_CORRUPT;
+                    break;
+            }
+            switch(errcode) {
+                case COUCHSTORE_SUCCESS:
+                    // Found it!
+                    cb_free(window);
+                    return COUCHSTORE_SUCCESS;
+                case COUCHSTORE_ERROR_ALLOC_FAIL:
+                    // Fatal error
+                    cb_free(window);
+                    return errcode;
+                default:
+                    // Invalid header; continue, but remember the last error
+                    last_header_errcode = errcode;
+                    break;
+            }
+        }
+        window_size = std::min(window_size * 2, int64_t(HEADER_SEARCH_WINDOW));
     }
+    cb_free(window);
     return last_header_errcode;
 }
 
+// Size of the header chain following the roots in the header, if any
+static size_t calculate_chain_size(Db *db)
+{
+    if (db->header.disk_version >= COUCH_DISK_VERSION_16) {
+        return sizeof(raw_header_chain);
+    }
+    return 0;
+}
+
+// Size of the codecs following the header chain, if any
+static size_t calculate_codecs_size(Db *db)
+{
+    if (db->header.disk_version >= COUCH_DISK_VERSION_17) {
+        return sizeof(raw_header_codecs);
+    }
+    return 0;
+}
+
+// Size of the Bloom filter pointer at the end of the header, if any
+static size_t calculate_bloom_root_size(Db *db)
+{
+    if (db->header.disk_version >= COUCH_DISK_VERSION_15 &&
+        db->header.bloom_filter_pos != 0) {
+        return sizeof(raw_bloom_filter_root);
+    }
+    return 0;
+}
+
 /**
  * Calculates how large in bytes the current header will be
  * when written to disk.
@@ -147,10 +281,81 @@ size_t calculate_header_size(Db *db, size_t& seqrootsize,
     if (db->header.local_docs_root) {
         localrootsize = ROOT_BASE_SIZE + db->header.local_docs_root->reduce_value.size;
     }
-    return sizeof(raw_file_header) + seqrootsize + idrootsize + localrootsize;
+    return sizeof(raw_file_header) + seqrootsize + idrootsize + localrootsize +
+           calculate_chain_size(db) + calculate_codecs_size(db) +
+           calculate_bloom_root_size(db);
 }
 
-couchstore_error_t db_write_header(Db *db)
+// A header in the header chain, as far as walking the chain is concerned
+typedef struct {
+    cs_off_t pos;
+    uint64_t update_seq;
+    header_chain chain;
+} chain_entry;
+
+// Reads the update_seq and chain of the header at 'pos', which is expected
+// to be at 'height' in the chain
+static couchstore_error_t read_chain_entry(Db *db, cs_off_t pos,
+                                           uint64_t height, chain_entry *entry)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const raw_header_chain *chain;
+    union {
+        raw_file_header *raw;
+        char *buf;
+    } header_buf = { NULL };
+    int header_len = pread_header(&db->file, pos, &header_buf.buf, MAX_DB_HEADER_SIZE);
+    if (header_len < 0) {
+        error_pass(static_cast<couchstore_error_t>(header_len));
+    }
+
+    {
+        const int chain_offset = HEADER_BASE_SIZE +
+                                 decode_raw16(header_buf.raw->seqrootsize) +
+                                 decode_raw16(header_buf.raw->idrootsize) +
+                                 decode_raw16(header_buf.raw->localrootsize);
+        error_unless(decode_raw08(header_buf.raw->version) >= COUCH_DISK_VERSION_16 &&
+                     header_len >= chain_offset + int(sizeof(raw_header_chain)),
+                     COUCHSTORE_ERROR_CORRUPT);
+        chain = (const raw_header_chain*)(header_buf.buf + chain_offset);
+    }
+    entry->pos = pos;
+    entry->update_seq = decode_raw48(header_buf.raw->update_seq);
+    entry->chain.height = decode_raw48(chain->height);
+    entry->chain.prev_pos = decode_raw48(chain->prev_pos);
+    entry->chain.skip_pos = decode_raw48(chain->skip_pos);
+    error_unless(entry->chain.height == height &&
+                 (height == 0 ||
+                  (entry->chain.prev_pos < uint64_t(pos) &&
+                   entry->chain.skip_pos <= entry->chain.prev_pos)),
+                 COUCHSTORE_ERROR_CORRUPT);
+
+cleanup:
+    cb_free(header_buf.raw);
+    return errcode;
+}
+
+// Follows the chain back from 'entry' to the header at 'height', which
+// replaces it
+static couchstore_error_t find_chain_ancestor(Db *db, chain_entry *entry,
+                                              uint64_t height)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    while (entry->chain.height > height) {
+        const uint64_t skip_height = entry->chain.height & (entry->chain.height - 1);
+        if (skip_height >= height) {
+            error_pass(read_chain_entry(db, entry->chain.skip_pos, skip_height, entry));
+        } else {
+            error_pass(read_chain_entry(db, entry->chain.prev_pos,
+                                        entry->chain.height - 1, entry));
+        }
+    }
+cleanup:
+    return errcode;
+}
+
+// Writes the header, linked into the header chain through 'chain'
+static couchstore_error_t write_db_header(Db *db, const header_chain *chain)
 {
     sized_buf writebuf;
     size_t seqrootsize, idrootsize, localrootsize;
@@ -171,15 +376,60 @@ couchstore_error_t db_write_header(Db *db)
     encode_root(root, db->header.by_id_root);
     root += idrootsize;
     encode_root(root, db->header.local_docs_root);
+    root += localrootsize;
+    if (calculate_chain_size(db)) {
+        raw_header_chain *raw_chain = (raw_header_chain*)root;
+        encode_raw48(chain->height, &raw_chain->height);
+        encode_raw48(chain->prev_pos, &raw_chain->prev_pos);
+        encode_raw48(chain->skip_pos, &raw_chain->skip_pos);
+        root += sizeof(raw_header_chain);
+    }
+    if (calculate_codecs_size(db)) {
+        raw_header_codecs *codecs = (raw_header_codecs*)root;
+        codecs->doc_codec = encode_raw08(db->header.doc_codec);
+        root += sizeof(raw_header_codecs);
+    }
+    if (calculate_bloom_root_size(db)) {
+        raw_bloom_filter_root *bloom = (raw_bloom_filter_root*)root;
+        encode_raw48(db->header.bloom_filter_pos, &bloom->pointer);
+        encode_raw48(db->header.bloom_filter_seq, &bloom->update_seq);
+    }
     cs_off_t pos;
     couchstore_error_t errcode = write_header(&db->file, &writebuf, &pos);
     if (errcode == COUCHSTORE_SUCCESS) {
         db->header.position = pos;
+        db->header.chain = *chain;
+        db->header.chain_restart = false;
     }
     cb_free(writebuf.buf);
     return errcode;
 }
 
+couchstore_error_t db_write_header(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    header_chain chain = {0, 0, 0};
+    if (calculate_chain_size(db) && !db->header.chain_restart) {
+        // Link the new header to the current one, and to the one at
+        // height & (height - 1), which is reached by following the skip
+        // links back from the current one. If that can't be read the chain
+        // is restarted here rather than failing the commit.
+        chain_entry entry = {cs_off_t(db->header.position),
+                             db->header.update_seq,
+                             db->header.chain};
+        if (find_chain_ancestor(db, &entry,
+                                (db->header.chain.height + 1) &
+                                db->header.chain.height) == COUCHSTORE_SUCCESS) {
+            chain.height = db->header.chain.height + 1;
+            chain.prev_pos = db->header.position;
+            chain.skip_pos = entry.pos;
+        }
+    }
+    error_pass(write_db_header(db, &chain));
+cleanup:
+    return errcode;
+}
+
 static couchstore_error_t create_header(Db *db)
 {
     // Select the version based upon selected CRC
@@ -190,6 +440,7 @@ static couchstore_error_t create_header(Db *db)
         // user is using latest
         db->header.disk_version = COUCH_DISK_VERSION;
     }
+    tree_file_set_disk_version(&db->file, db->header.disk_version);
     db->header.update_seq = 0;
     db->header.by_id_root = NULL;
     db->header.by_seq_root = NULL;
@@ -197,7 +448,12 @@ static couchstore_error_t create_header(Db *db)
     db->header.purge_seq = 0;
     db->header.purge_ptr = 0;
     db->header.position = 0;
-    return db_write_header(db);
+    db->header.bloom_filter_pos = 0;
+    db->header.bloom_filter_seq = 0;
+    db->header.doc_codec = db->file.options.doc_codec;
+    // The first header starts the chain
+    const header_chain chain = {0, 0, 0};
+    return write_db_header(db, &chain);
 }
 
 LIBCOUCHSTORE_API
@@ -247,7 +503,11 @@ couchstore_error_t couchstore_commit(Db *db)
 {
     COLLECT_LATENCY();
 
-    couchstore_error_t errcode = precommit(db);
+    couchstore_error_t errcode = db_write_bloom_filter(db, false);
+
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = precommit(db);
+    }
 
     if (errcode == COUCHSTORE_SUCCESS) {
         errcode = db_write_header(db);
@@ -285,6 +545,43 @@ static tree_file_options get_tree_file_options_from_flags(couchstore_open_flags
         }
     }
 
+    if (flags & COUCHSTORE_OPEN_WITH_CUSTOM_WRITE_BUFFER) {
+        // Write buffer capacity.
+        //  * 4 bits [35:32]: power-of-2 * 4KB
+        uint32_t write_flag = (flags >> 32) & 0xf;
+        options.buf_io_write_buffer_size = (4 * 1024) << (write_flag - 1);
+    }
+
+    if (flags & COUCHSTORE_OPEN_WITH_CUSTOM_DOC_BUFFER) {
+        // Document read buffer capacity.
+        //  * 4 bits [39:36]: power-of-2 * 4KB
+        uint32_t doc_flag = (flags >> 36) & 0xf;
+        options.buf_io_document_read_size = (4 * 1024) << (doc_flag - 1);
+    }
+
+    if (flags & COUCHSTORE_OPEN_WITH_SHARED_BLOCK_CACHE) {
+        options.buf_io_shared_cache = true;
+    }
+
+    if (flags & COUCHSTORE_OPEN_WITH_BACKGROUND_FLUSH) {
+        options.buf_io_write_buffers = BACKGROUND_FLUSH_WRITE_BUFFERS;
+    }
+
+    if (flags & COUCHSTORE_OPEN_FLAG_MMAP) {
+        options.mmap_enabled = true;
+    }
+
+    if (flags & COUCHSTORE_OPEN_WITH_PREFETCH) {
+        options.prefetch_children = PREFETCH_CHILDREN;
+    }
+
+    if (flags & COUCHSTORE_OPEN_WITH_NODE_CACHE) {
+        // Decoded node cache.
+        //  * 3 bits [7:5]: power-of-2 * 256KB
+        uint64_t cache_flag = (flags >> 5) & 0x7;
+        options.node_cache_capacity = uint64_t(256 * 1024) << (cache_flag - 1);
+    }
+
     // Set default value first.
     options.kp_nodesize = DB_KP_CHUNK_THRESHOLD;
     options.kv_nodesize = DB_KV_CHUNK_THRESHOLD;
@@ -309,9 +606,23 @@ static tree_file_options get_tree_file_options_from_flags(couchstore_open_flags
         options.periodic_sync_bytes = uint64_t(1024) << (sync_flag - 1);
     }
 
+    // Compression codecs.
+    //  * 2 bits [41:40]: B-tree nodes
+    //  * 2 bits [43:42]: document bodies
+    options.node_codec = couchstore_codec((flags >> 40) & 0x3);
+    options.doc_codec = couchstore_codec((flags >> 42) & 0x3);
+
     return options;
 }
 
+LIBCOUCHSTORE_API
+couchstore_open_flags couchstore_encode_codec_flags(couchstore_codec node_codec,
+                                                    couchstore_codec doc_codec)
+{
+    return (couchstore_open_flags(node_codec & 0x3) << 40) |
+           (couchstore_open_flags(doc_codec & 0x3) << 42);
+}
+
 LIBCOUCHSTORE_API
 couchstore_open_flags couchstore_encode_periodic_sync_flags(uint64_t bytes) {
     // Convert to encoding supported by couchstore_open_flags - KB power-of-2
@@ -353,6 +664,18 @@ couchstore_error_t couchstore_open_db_ex(const char *filename,
         (flags & COUCHSTORE_OPEN_FLAG_CREATE)) {
         return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
     }
+    if ((flags & COUCHSTORE_OPEN_FLAG_MMAP) &&
+        !(flags & COUCHSTORE_OPEN_FLAG_RDONLY)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    tree_file_options options = get_tree_file_options_from_flags(flags);
+    if (options.node_codec == COUCHSTORE_CODEC_ZSTD_DICT) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    if (!codec_supported(options.node_codec) ||
+        !codec_supported(options.doc_codec)) {
+        return COUCHSTORE_ERROR_NOT_SUPPORTED;
+    }
 
     if ((db = static_cast<Db*>(cb_calloc(1, sizeof(Db)))) == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -370,7 +693,7 @@ couchstore_error_t couchstore_open_db_ex(const char *filename,
 
     // open with CRC unknown, CRC will be selected when header is read/or not found.
     error_pass(tree_file_open(&db->file, filename, openflags, CRC_UNKNOWN, ops,
-                              get_tree_file_options_from_flags(flags)));
+                              options));
 
     pos = db->file.ops->goto_eof(&db->file.lastError, db->file.handle);
     db->file.pos = pos;
@@ -407,6 +730,14 @@ couchstore_error_t couchstore_open_db_ex(const char *filename,
             errcode = COUCHSTORE_ERROR_INVALID_ARGUMENTS;
             goto cleanup;
         }
+
+        // Compress document bodies with the codec the file records unless
+        // another is selected, which the file records from then on.
+        if (flags & COUCHSTORE_OPEN_WITH_DOC_CODEC) {
+            db->header.doc_codec = db->file.options.doc_codec;
+        } else if (codec_supported(db->header.doc_codec)) {
+            db->file.options.doc_codec = db->header.doc_codec;
+        }
     } else {
         error_pass(static_cast<couchstore_error_t>(db->file.pos));
     }
@@ -423,6 +754,35 @@ cleanup:
     return errcode;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_snapshot(Db *db, Db **pSnapshot)
+{
+    COLLECT_LATENCY();
+
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *snapshot = NULL;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+
+    if ((snapshot = static_cast<Db*>(cb_calloc(1, sizeof(Db)))) == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    snapshot->dropped = 1;
+
+    error_pass(tree_file_open_snapshot(&snapshot->file, &db->file));
+    snapshot->dropped = 0;
+    error_pass(read_header_at_pos(snapshot, db->header.position));
+    snapshot->userdata = db->userdata;
+
+    *pSnapshot = snapshot;
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS && snapshot != NULL) {
+        couchstore_close_file(snapshot);
+        couchstore_free_db(snapshot);
+    }
+    return errcode;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_close_file(Db* db)
 {
@@ -436,24 +796,44 @@ couchstore_error_t couchstore_close_file(Db* db)
     return error;
 }
 
+// Frees what the db holds for its current header, before reading another
+static void release_header(Db *db)
+{
+    cb_free(db->header.by_id_root);
+    cb_free(db->header.by_seq_root);
+    cb_free(db->header.local_docs_root);
+    db->header.by_id_root = NULL;
+    db->header.by_seq_root = NULL;
+    db->header.local_docs_root = NULL;
+    // May hold IDs saved after the header being rewound to
+    delete db->bloom_filter;
+    db->bloom_filter = NULL;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_rewind_db_header(Db *db)
 {
     COLLECT_LATENCY();
 
     couchstore_error_t errcode;
+    cs_off_t position = db->header.position;
+    header_chain chain = db->header.chain;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
     // free current header guts
-    cb_free(db->header.by_id_root);
-    cb_free(db->header.by_seq_root);
-    cb_free(db->header.local_docs_root);
-    db->header.by_id_root = NULL;
-    db->header.by_seq_root = NULL;
-    db->header.local_docs_root = NULL;
+    release_header(db);
 
-    error_unless(db->header.position != 0, COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    error_unless(position != 0, COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    if (chain.height > 0) {
+        // Follow the link to the previous header
+        errcode = read_header_at_pos(db, chain.prev_pos);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            goto cleanup;
+        }
+        // Fall back to scanning for it
+        release_header(db);
+    }
     // find older header
-    error_pass(find_header(db, db->header.position - 2));
+    error_pass(find_header(db, position - 2));
 
 cleanup:
     // if we failed, free the handle and return an error
@@ -465,6 +845,55 @@ cleanup:
     return errcode;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_rewind_to_seq(Db *db, uint64_t seq)
+{
+    COLLECT_LATENCY();
+
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    chain_entry entry = {cs_off_t(db->header.position),
+                         db->header.update_seq,
+                         db->header.chain};
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+
+    // Step back along the chain, skipping ahead whenever the header a skip
+    // link leads to is still after 'seq'.
+    while (entry.update_seq > seq && entry.chain.height > 0) {
+        const uint64_t skip_height = entry.chain.height & (entry.chain.height - 1);
+        if (skip_height < entry.chain.height - 1) {
+            chain_entry skip;
+            error_pass(read_chain_entry(db, entry.chain.skip_pos, skip_height, &skip));
+            if (skip.update_seq > seq) {
+                entry = skip;
+                continue;
+            }
+        }
+        error_pass(read_chain_entry(db, entry.chain.prev_pos,
+                                    entry.chain.height - 1, &entry));
+    }
+    if (uint64_t(entry.pos) != db->header.position) {
+        release_header(db);
+        error_pass(read_header_at_pos(db, entry.pos));
+    }
+
+    // Headers without links are found by scanning back through the file
+    while (db->header.update_seq > seq) {
+        errcode = couchstore_rewind_db_header(db);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            // db has already been freed
+            return errcode;
+        }
+    }
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS) {
+        couchstore_close_file(db);
+        couchstore_free_db(db);
+        errcode = COUCHSTORE_ERROR_DB_NO_LONGER_VALID;
+    }
+    return errcode;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_free_db(Db* db)
 {
@@ -484,6 +913,14 @@ couchstore_error_t couchstore_free_db(Db* db)
     db->header.by_id_root = NULL;
     db->header.by_seq_root = NULL;
     db->header.local_docs_root = NULL;
+    delete db->bloom_filter;
+    db->bloom_filter = NULL;
+    delete db->seq_spine;
+    db->seq_spine = NULL;
+    delete db->seq_count_cache;
+    db->seq_count_cache = NULL;
+    delete db->doc_dictionary;
+    db->doc_dictionary = NULL;
 
     memset(db, 0xa5, sizeof(*db));
     cb_free(db);
@@ -619,18 +1056,28 @@ static couchstore_error_t by_id_read_docinfo(DocInfo **pInfo,
 }
 
 //Fill in doc from reading file.
-static couchstore_error_t bp_to_doc(Doc **pDoc, Db *db, cs_off_t bp, couchstore_open_options options)
+static couchstore_error_t bp_to_doc(Doc **pDoc, Db *db, cs_off_t bp,
+                                    couchstore_codec codec,
+                                    couchstore_open_options options)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     int bodylen = 0;
     char *docbody = NULL;
     fatbuf *docbuf = NULL;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    if ((options & DECOMPRESS_DOC_BODIES) &&
+        codec == COUCHSTORE_CODEC_ZSTD_DICT) {
+        error_pass(db_load_doc_dictionary(db));
+    }
 
-    if (options & DECOMPRESS_DOC_BODIES) {
-        bodylen = pread_compressed(&db->file, bp, &docbody);
-    } else {
-        bodylen = pread_bin(&db->file, bp, &docbody);
+    {
+        ScopedFileTag tag(db->file.ops, db->file.handle, FileTag::Document);
+        if (options & DECOMPRESS_DOC_BODIES) {
+            bodylen = pread_compressed_doc(&db->file, bp, codec,
+                                           db->doc_dictionary, &docbody);
+        } else {
+            bodylen = pread_bin(&db->file, bp, &docbody);
+        }
     }
 
     error_unless(bodylen >= 0, static_cast<couchstore_error_t>(bodylen));    // if bodylen is negative it's an error code
@@ -701,6 +1148,10 @@ couchstore_error_t couchstore_docinfo_by_id(Db *db,
     key.buf = (char *) id;
     key.size = idlen;
 
+    if (!db_may_contain_id(db, &key)) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+
     rq.cmp.compare = ebin_cmp;
     rq.file = &db->file;
     rq.num_keys = 1;
@@ -779,7 +1230,8 @@ couchstore_error_t couchstore_open_doc_with_docinfo(Db *db,
         options &= ~DECOMPRESS_DOC_BODIES;
     }
 
-    errcode = bp_to_doc(pDoc, db, docinfo->bp, options);
+    errcode = bp_to_doc(pDoc, db, docinfo->bp,
+                        db_body_codec(db, docinfo->content_meta), options);
     if (errcode == COUCHSTORE_SUCCESS) {
         (*pDoc)->id.buf = docinfo->id.buf;
         (*pDoc)->id.size = docinfo->id.size;
@@ -1153,12 +1605,37 @@ couchstore_error_t couchstore_docinfos_by_id(Db *db,
 {
     COLLECT_LATENCY();
 
-    return iterate_docinfos(db, ids, numDocs,
-                            db->header.by_id_root, id_ptr_cmp, ebin_cmp,
-                            callback,
-                            (options & RANGES) != 0,
-                            (options & COUCHSTORE_TOLERATE_CORRUPTION) != 0,
-                            ctx);
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf *candidates = NULL;
+    unsigned numCandidates = 0;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+
+    db_load_bloom_filter(db);
+    if (db->bloom_filter && !(options & RANGES) && db->header.by_id_root) {
+        // Only look up the IDs which may be in the file.
+        candidates = static_cast<sized_buf*>(cb_malloc(numDocs * sizeof(sized_buf)));
+        error_unless(candidates, COUCHSTORE_ERROR_ALLOC_FAIL);
+        for (unsigned ii = 0; ii < numDocs; ++ii) {
+            if (db_may_contain_id(db, &ids[ii])) {
+                candidates[numCandidates++] = ids[ii];
+            }
+        }
+        if (numCandidates == 0) {
+            goto cleanup;
+        }
+        ids = candidates;
+        numDocs = numCandidates;
+    }
+
+    errcode = iterate_docinfos(db, ids, numDocs,
+                               db->header.by_id_root, id_ptr_cmp, ebin_cmp,
+                               callback,
+                               (options & RANGES) != 0,
+                               (options & COUCHSTORE_TOLERATE_CORRUPTION) != 0,
+                               ctx);
+cleanup:
+    cb_free(candidates);
+    return errcode;
 }
 
 LIBCOUCHSTORE_API
@@ -1226,6 +1703,19 @@ couchstore_error_t couchstore_db_info(Db *db, DbInfo* dbinfo) {
     return COUCHSTORE_SUCCESS;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_get_node_cache_stats(Db *db,
+                                                   couchstore_node_cache_stats *stats) {
+    if (db == NULL || stats == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    const NodeCache* cache = db->file.node_cache;
+    stats->hits = cache ? cache->getHits() : 0;
+    stats->misses = cache ? cache->getMisses() : 0;
+    stats->size = cache ? cache->getSize() : 0;
+    return COUCHSTORE_SUCCESS;
+}
+
 static couchstore_error_t local_doc_fetch(couchfile_lookup_request *rq,
                                           const sized_buf *k,
                                           const sized_buf *v)
@@ -1296,9 +1786,21 @@ cleanup:
 
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_save_local_document(Db *db, LocalDoc *lDoc)
+{
+    // The document dictionary is only ever written by compaction, which
+    // recompresses the bodies to match it.
+    if (lDoc->id.size == sizeof(DOC_DICTIONARY_ID) - 1 &&
+        memcmp(lDoc->id.buf, DOC_DICTIONARY_ID, lDoc->id.size) == 0) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    return db_save_local_document(db, lDoc);
+}
+
+couchstore_error_t db_save_local_document(Db *db, LocalDoc *lDoc)
 {
     couchstore_error_t errcode;
     couchfile_modify_action ldupdate;
+    couchfile_modify_request rq{};
     node_pointer *nroot = NULL;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
 
@@ -1311,7 +1813,6 @@ couchstore_error_t couchstore_save_local_document(Db *db, LocalDoc *lDoc)
     ldupdate.key = &lDoc->id;
     ldupdate.value.data = &lDoc->json;
 
-    couchfile_modify_request rq;
     rq.cmp.compare = ebin_cmp;
     rq.num_actions = 1;
     rq.actions = &ldupdate;
@@ -1325,6 +1826,7 @@ couchstore_error_t couchstore_save_local_document(Db *db, LocalDoc *lDoc)
     rq.compacting = 0;
     rq.kv_chunk_threshold = db->file.options.kv_nodesize;
     rq.kp_chunk_threshold = db->file.options.kp_nodesize;
+    rq.spine = NULL;
 
     nroot = modify_btree(&rq, db->header.local_docs_root, &errcode);
     if (errcode == COUCHSTORE_SUCCESS && nroot != db->header.local_docs_root) {
@@ -1382,57 +1884,150 @@ couchstore_error_t couchstore_last_os_error(const Db *db,
     return COUCHSTORE_SUCCESS;
 }
 
-static couchstore_error_t btree_eval_seq_reduce(Db *db,
-                                                uint64_t *accum,
-                                                sized_buf *left,
-                                                sized_buf *right,
-                                                bool past_left_edge,
-                                                uint64_t diskpos) {
-    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    int bufpos = 1, nodebuflen = 0;
-    int node_type;
-    char *nodebuf = NULL;
-    nodebuflen = pread_compressed(&db->file, diskpos, &nodebuf);
-    error_unless(nodebuflen >= 0, (static_cast<couchstore_error_t>(nodebuflen)));  // if negative, it's an error code
-
-    node_type = nodebuf[0];
-    while(bufpos < nodebuflen) {
+/**
+ * Reads the by-sequence node at 'pos' decoded for counting changes, from
+ * the db's count cache, its kept right edge or the file, in that order.
+ */
+static couchstore_error_t read_seq_count_node(Db *db,
+                                              uint64_t pos,
+                                              CachedNodePtr *entries) {
+    if (db->seq_count_cache) {
+        *entries = db->seq_count_cache->get(pos);
+        if (*entries) {
+            return COUCHSTORE_SUCCESS;
+        }
+    }
+
+    CachedNodePtr node = db->seq_spine ? db->seq_spine->get(pos)
+                                       : CachedNodePtr();
+    int nodebuflen;
+    if (node) {
+        nodebuflen = static_cast<int>(node->size);
+    } else {
+        nodebuflen = pread_node(&db->file, pos, &node);
+        if (nodebuflen < 0) {
+            return static_cast<couchstore_error_t>(nodebuflen);
+        }
+    }
+    const char *nodebuf = node->buf;
+    int node_type = nodebuf[0] & NODE_TYPE_MASK;
+    nodebuflen = node_entries_end(nodebuf, nodebuflen);
+    if (nodebuflen <= 0) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    std::vector<seq_count_entry> decoded;
+    for (int bufpos = 1; bufpos < nodebuflen;) {
         sized_buf k, v;
         bufpos += read_kv(nodebuf + bufpos, &k, &v);
-        int left_cmp = seq_cmp(&k, left);
-        int right_cmp = seq_cmp(&k, right);
-        if(left_cmp < 0) {
-            continue;
-        }
-        if(node_type == KP_NODE) {
-            // In-range Item in a KP Node
+        seq_count_entry entry = {decode_sequence_key(&k), 1, 0};
+        if (node_type == KP_NODE) {
             const raw_node_pointer *raw = (const raw_node_pointer*)v.buf;
             const raw_by_seq_reduce *rawreduce = (const raw_by_seq_reduce*) (v.buf + sizeof(raw_node_pointer));
-            uint64_t subcount = decode_raw40(rawreduce->count);
-            uint64_t pointer = decode_raw48(raw->pointer);
-            if((left_cmp >= 0 && !past_left_edge) || right_cmp >= 0) {
-                error_pass(btree_eval_seq_reduce(db, accum, left, right, past_left_edge, pointer));
-                if(right_cmp >= 0) {
-                    break;
-                } else {
-                    past_left_edge = true;
+            entry.count = decode_raw40(rawreduce->count);
+            entry.pointer = decode_raw48(raw->pointer);
+        }
+        decoded.push_back(entry);
+    }
+
+    size_t size = decoded.size() * sizeof(seq_count_entry);
+    char *buf = static_cast<char*>(cb_malloc(size));
+    if (!buf) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memcpy(buf, decoded.data(), size);
+    *entries = std::make_shared<CachedNode>(buf, size);
+    if (db->seq_count_cache) {
+        db->seq_count_cache->put(pos, *entries);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+/**
+ * Adds to counts[r], for each range r in 'ranges', the number of changes in
+ * the range in the subtree at 'pos', whose sequence numbers are all at
+ * least 'lower'. Each node is visited once, for all the ranges it matters
+ * to: a child entirely within a range adds its count without being read.
+ */
+static couchstore_error_t count_changes(Db *db,
+                                        uint64_t pos,
+                                        uint64_t lower,
+                                        const uint64_t *min_seqs,
+                                        const uint64_t *max_seqs,
+                                        uint64_t *counts,
+                                        const std::vector<size_t>& ranges) {
+    CachedNodePtr node;
+    couchstore_error_t errcode = read_seq_count_node(db, pos, &node);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+
+    uint64_t upper = 0;
+    for (size_t r : ranges) {
+        upper = std::max(upper, max_seqs[r]);
+    }
+
+    const seq_count_entry *entries = (const seq_count_entry*)node->buf;
+    size_t num_entries = node->size / sizeof(seq_count_entry);
+    std::vector<size_t> partial;
+    for (size_t ii = 0; ii < num_entries && lower <= upper; ++ii) {
+        const seq_count_entry& entry = entries[ii];
+        if (entry.pointer == 0) {
+            for (size_t r : ranges) {
+                if (min_seqs[r] <= entry.seq && entry.seq <= max_seqs[r]) {
+                    ++counts[r];
                 }
-            } else {
-                *accum += subcount;
             }
         } else {
-            if(right_cmp > 0) {
-                break;
+            // The child holds the sequence numbers [lower, entry.seq]
+            partial.clear();
+            for (size_t r : ranges) {
+                if (min_seqs[r] <= lower && entry.seq <= max_seqs[r]) {
+                    counts[r] += entry.count;
+                } else if (min_seqs[r] <= entry.seq && lower <= max_seqs[r]) {
+                    partial.push_back(r);
+                }
+            }
+            if (!partial.empty()) {
+                errcode = count_changes(db, entry.pointer, lower, min_seqs,
+                                        max_seqs, counts, partial);
+                if (errcode != COUCHSTORE_SUCCESS) {
+                    return errcode;
+                }
             }
-            // In-range Item in a KV Node
-            *accum += 1;
         }
+        lower = entry.seq + 1;
     }
-cleanup:
-    if (nodebuf) {
-        cb_free(nodebuf);
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t changes_counts(Db* db,
+                                         const uint64_t *min_seqs,
+                                         const uint64_t *max_seqs,
+                                         size_t num_ranges,
+                                         uint64_t *counts) {
+    if (db->dropped) {
+        return COUCHSTORE_ERROR_FILE_CLOSED;
+    }
+    std::fill(counts, counts + num_ranges, 0);
+    if (!db->header.by_seq_root || num_ranges == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    if (!db->seq_count_cache) {
+        // Without it, every count reads the nodes it needs.
+        db->seq_count_cache = new (std::nothrow) NodeCache(SEQ_COUNT_CACHE_SIZE);
+    }
+
+    try {
+        std::vector<size_t> ranges(num_ranges);
+        for (size_t r = 0; r < num_ranges; ++r) {
+            ranges[r] = r;
+        }
+        return count_changes(db, db->header.by_seq_root->pointer, 0,
+                             min_seqs, max_seqs, counts, ranges);
+    } catch (const std::bad_alloc&) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
-    return errcode;
 }
 
 LIBCOUCHSTORE_API
@@ -1442,21 +2037,16 @@ couchstore_error_t couchstore_changes_count(Db* db,
                                             uint64_t *count) {
     COLLECT_LATENCY();
 
-    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    raw_48 leftkr, rightkr;
-    sized_buf leftk, rightk;
-    leftk.buf = (char*) &leftkr;
-    rightk.buf = (char*) &rightkr;
-    leftk.size = 6;
-    rightk.size = 6;
-    encode_raw48(min_seq, &leftkr);
-    encode_raw48(max_seq, &rightkr);
-
-    *count = 0;
-    if(db->header.by_seq_root) {
-        error_pass(btree_eval_seq_reduce(db, count, &leftk, &rightk, false,
-                                         db->header.by_seq_root->pointer));
-    }
-cleanup:
-    return errcode;
+    return changes_counts(db, &min_seq, &max_seq, 1, count);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_changes_counts(Db* db,
+                                             const uint64_t *min_seqs,
+                                             const uint64_t *max_seqs,
+                                             size_t num_ranges,
+                                             uint64_t *counts) {
+    COLLECT_LATENCY();
+
+    return changes_counts(db, min_seqs, max_seqs, num_ranges, counts);
 }
@@ -1,6 +1,8 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
 
+#include <algorithm>
+#include <vector>
 #include <fcntl.h>
 #include <platform/cb_malloc.h>
 #include <stdio.h>
@@ -11,6 +13,8 @@
 #include "internal.h"
 #include "iobuffer.h"
 #include "bitfield.h"
+#include "codec.h"
+#include "node_cache.h"
 #include "crc32.h"
 #include "util.h"
 
@@ -37,10 +41,22 @@ couchstore_error_t tree_file_open(tree_file* file,
     file->path = (const char *) cb_strdup(filename);
     error_unless(file->path, COUCHSTORE_ERROR_ALLOC_FAIL);
 
-    if (file_options.buf_io_enabled) {
+    if (file_options.mmap_enabled && openflags == O_RDONLY &&
+        ops == couchstore_get_default_file_ops()) {
+        file->ops = couch_get_mmap_file_ops();
+    }
+
+    if (file->ops) {
+        file->handle = file->ops->constructor(&file->lastError);
+    } else if (file_options.buf_io_enabled) {
         buffered_file_ops_params params((openflags == O_RDONLY),
                                         file_options.buf_io_read_unit_size,
                                         file_options.buf_io_read_buffers);
+        params.shared_block_cache = file_options.buf_io_shared_cache;
+        params.write_buffers = file_options.buf_io_write_buffers;
+        params.write_buffer_capacity = file_options.buf_io_write_buffer_size;
+        params.document_read_capacity =
+                file_options.buf_io_document_read_size;
 
         file->ops = couch_get_buffered_file_ops(&file->lastError, ops,
                                                 &file->handle, params);
@@ -59,6 +75,12 @@ couchstore_error_t tree_file_open(tree_file* file,
                 file->handle, file->options.periodic_sync_bytes));
     }
 
+    if (file->options.node_cache_capacity != 0) {
+        file->node_cache = new (std::nothrow) NodeCache(
+                file->options.node_cache_capacity);
+        error_unless(file->node_cache, COUCHSTORE_ERROR_ALLOC_FAIL);
+    }
+
 cleanup:
     if (errcode != COUCHSTORE_SUCCESS) {
         cb_free((char *) file->path);
@@ -72,6 +94,41 @@ cleanup:
     return errcode;
 }
 
+couchstore_error_t tree_file_open_snapshot(tree_file* file,
+                                           tree_file* source)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+
+    *file = tree_file();
+
+    file->pos = source->pos;
+    file->crc_mode = source->crc_mode;
+    file->options = source->options;
+    file->node_cache = source->node_cache;
+    file->snapshot = true;
+
+    file->path = (const char *) cb_strdup(source->path);
+    error_unless(file->path, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    file->ops = couch_get_snapshot_file_ops(&source->lastError, source->ops,
+                                            source->handle, &file->handle);
+    error_unless(file->ops, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS) {
+        cb_free((char *) file->path);
+        file->path = NULL;
+    }
+    return errcode;
+}
+
+void tree_file_set_disk_version(tree_file* file, uint64_t disk_version)
+{
+    file->node_directory = disk_version >= COUCH_DISK_VERSION_13;
+    file->node_prefix = disk_version >= COUCH_DISK_VERSION_14;
+    file->codec_ids = disk_version >= COUCH_DISK_VERSION_17;
+}
+
 couchstore_error_t tree_file_close(tree_file* file)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
@@ -79,61 +136,107 @@ couchstore_error_t tree_file_close(tree_file* file)
         errcode = file->ops->close(&file->lastError, file->handle);
         file->ops->destructor(file->handle);
     }
+    if (!file->snapshot) {
+        delete file->node_cache;
+    }
+    file->node_cache = NULL;
     cb_free((char*)file->path);
     return errcode;
 }
 
-/** Read bytes from the database file, skipping over the header-detection bytes at every block
-    boundary. */
-static couchstore_error_t read_skipping_prefixes(tree_file *file,
-                                                 cs_off_t *pos,
-                                                 ssize_t len,
-                                                 void *dst) {
-    if (*pos % COUCH_BLOCK_SIZE == 0) {
-        ++*pos;
+/** Returns the number of block-prefix bytes interleaved with 'len' bytes of
+    data stored starting at 'pos', which must not be on a block boundary. */
+static size_t count_prefixes(cs_off_t pos, size_t len)
+{
+    size_t in_first_block = COUCH_BLOCK_SIZE - (pos % COUCH_BLOCK_SIZE);
+    if (len <= in_first_block) {
+        return 0;
     }
-    while (len > 0) {
-        ssize_t read_size = COUCH_BLOCK_SIZE - (*pos % COUCH_BLOCK_SIZE);
-        if (read_size > len) {
-            read_size = len;
-        }
+    return 1 + (len - in_first_block - 1) / (COUCH_BLOCK_SIZE - 1);
+}
+
+/** Removes the header-detection bytes from 'nbytes' bytes read from the file
+    at 'pos' (which must not be on a block boundary), compacting the data in
+    place. Returns the number of data bytes left. */
+static size_t strip_prefixes(uint8_t *buf, cs_off_t pos, size_t nbytes)
+{
+    size_t in = std::min(nbytes,
+                         size_t(COUCH_BLOCK_SIZE - (pos % COUCH_BLOCK_SIZE)));
+    size_t out = in;
+    while (in < nbytes) {
+        ++in;  // skip the prefix byte
+        size_t segment = std::min(nbytes - in, size_t(COUCH_BLOCK_SIZE - 1));
+        memmove(buf + out, buf + in, segment);
+        in += segment;
+        out += segment;
+    }
+    return out;
+}
+
+/** Reads exactly 'nbytes' bytes from the file at 'pos'. */
+static couchstore_error_t pread_fully(tree_file *file,
+                                      cs_off_t pos,
+                                      size_t nbytes,
+                                      void *dst) {
+    while (nbytes > 0) {
         ssize_t got_bytes = file->ops->pread(&file->lastError, file->handle,
-                                             dst, read_size, *pos);
+                                             dst, nbytes, pos);
         if (got_bytes < 0) {
             return (couchstore_error_t) got_bytes;
         } else if (got_bytes == 0) {
             return COUCHSTORE_ERROR_READ;
         }
-        *pos += got_bytes;
-        len -= got_bytes;
+        pos += got_bytes;
+        nbytes -= got_bytes;
         dst = (char*)dst + got_bytes;
-        if (*pos % COUCH_BLOCK_SIZE == 0) {
-            ++*pos;
-        }
     }
     return COUCHSTORE_SUCCESS;
 }
 
 /*
- * Common subroutine of pread_bin, pread_compressed and pread_header.
- * Parameters and return value are the same as for pread_bin,
- * except the 'max_header_size' parameter which is greater than 0 if
- * reading a header, 0 otherwise.
+ * Returns how many bytes to read at 'pos' (which must not be on a block
+ * boundary) to get the header of the chunk there, and as much of its body
+ * as is cheap to fetch along with it: up to the end of the current block,
+ * or of the next one if the chunk header straddles the boundary. Doesn't
+ * go past the known end of the file though, as that would defeat the read
+ * buffers.
  */
-static int pread_bin_internal(tree_file *file,
-                              cs_off_t pos,
-                              char **ret_ptr,
-                              uint32_t max_header_size)
+static size_t chunk_head_extent(tree_file *file, cs_off_t pos)
+{
+    const size_t info_size = 2 * sizeof(uint32_t);
+    size_t head_extent = COUCH_BLOCK_SIZE - (pos % COUCH_BLOCK_SIZE);
+    if (head_extent < info_size) {
+        head_extent += COUCH_BLOCK_SIZE;
+    }
+    if (file->pos > (uint64_t)pos && file->pos - pos < head_extent) {
+        head_extent = std::max(size_t(file->pos - pos), info_size);
+    }
+    return head_extent;
+}
+
+/*
+ * Completes the read of the chunk at 'pos' (which must not be on a block
+ * boundary), given the 'got_bytes' bytes at the start of its extent already
+ * read into 'head' (see chunk_head_extent). 'head' is modified.
+ * Parameters and return value are otherwise as for pread_bin_internal.
+ */
+static int pread_bin_from_head(tree_file *file,
+                               cs_off_t pos,
+                               uint8_t *head,
+                               size_t got_bytes,
+                               char **ret_ptr,
+                               uint32_t max_header_size)
 {
     struct {
         uint32_t chunk_len;
         uint32_t crc32;
     } info;
 
-    couchstore_error_t err = read_skipping_prefixes(file, &pos, sizeof(info), &info);
-    if (err < 0) {
-        return err;
+    size_t head_len = strip_prefixes(head, pos, got_bytes);
+    if (head_len < sizeof(info)) {
+        return COUCHSTORE_ERROR_READ;
     }
+    memcpy(&info, head, sizeof(info));
 
     info.chunk_len = ntohl(info.chunk_len) & ~0x80000000;
     if (max_header_size) {
@@ -143,11 +246,29 @@ static int pread_bin_internal(tree_file *file,
     }
     info.crc32 = ntohl(info.crc32);
 
-    uint8_t* buf = static_cast<uint8_t*>(cb_malloc(info.chunk_len));
-    if (!buf) {
+    // Body bytes already read, and the file position following them.
+    size_t have = std::min(head_len - sizeof(info), size_t(info.chunk_len));
+    cs_off_t next_pos = pos + got_bytes;
+    size_t remaining = info.chunk_len - have;
+    if (remaining > 0 && next_pos % COUCH_BLOCK_SIZE == 0) {
+        ++next_pos;
+    }
+    size_t remaining_extent = remaining + count_prefixes(next_pos, remaining);
+
+    // Allocate room for the rest of the extent, so it can be read in place.
+    uint8_t* buf = static_cast<uint8_t*>(cb_malloc(have + remaining_extent));
+    if (!buf && (have + remaining_extent) > 0) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
-    err = read_skipping_prefixes(file, &pos, info.chunk_len, buf);
+    memcpy(buf, head + sizeof(info), have);
+
+    couchstore_error_t err = COUCHSTORE_SUCCESS;
+    if (remaining > 0) {
+        err = pread_fully(file, next_pos, remaining_extent, buf + have);
+        if (!err) {
+            strip_prefixes(buf + have, next_pos, remaining_extent);
+        }
+    }
 
     if (!err && !perform_integrity_check(buf, info.chunk_len, info.crc32, file->crc_mode)) {
         err = COUCHSTORE_ERROR_CHECKSUM_FAIL;
@@ -162,6 +283,86 @@ static int pread_bin_internal(tree_file *file,
     return info.chunk_len;
 }
 
+/*
+ * Common subroutine of pread_bin, pread_compressed(_doc) and pread_header.
+ * Parameters and return value are the same as for pread_bin,
+ * except the 'max_header_size' parameter which is greater than 0 if
+ * reading a header, 0 otherwise.
+ *
+ * The chunk is read with as few preads as possible: the first one fetches
+ * the rest of the block holding the chunk header (which for small chunks
+ * covers the whole chunk), and if needed a second one fetches the rest of
+ * the chunk's on-disk extent. Block prefixes are then stripped in memory.
+ */
+static int pread_bin_internal(tree_file *file,
+                              cs_off_t pos,
+                              char **ret_ptr,
+                              uint32_t max_header_size)
+{
+    if (pos % COUCH_BLOCK_SIZE == 0) {
+        ++pos;
+    }
+
+    uint8_t head[2 * COUCH_BLOCK_SIZE];
+    ssize_t got_bytes = file->ops->pread(&file->lastError, file->handle,
+                                         head, chunk_head_extent(file, pos),
+                                         pos);
+    if (got_bytes < 0) {
+        return got_bytes;
+    }
+    return pread_bin_from_head(file, pos, head, got_bytes, ret_ptr,
+                               max_header_size);
+}
+
+/*
+ * Zero-copy alternative to pread_bin_internal, for file ops that can lend
+ * out their data (see FileOpsInterface::borrow()). Only chunks lying within
+ * a single block are contiguous in the file and hence can be borrowed.
+ * On success sets *ret_ptr to the checksummed chunk data, which must not be
+ * freed, and returns its length. Returns COUCHSTORE_ERROR_NOT_SUPPORTED if
+ * the chunk has to be read with pread_bin_internal instead.
+ */
+static int borrow_bin(tree_file *file, cs_off_t pos, const char **ret_ptr)
+{
+    uint32_t chunk_len;
+    uint32_t crc32;
+
+    if (pos % COUCH_BLOCK_SIZE == 0) {
+        ++pos;
+    }
+    size_t in_block = COUCH_BLOCK_SIZE - (pos % COUCH_BLOCK_SIZE);
+    if (in_block < sizeof(chunk_len) + sizeof(crc32)) {
+        return COUCHSTORE_ERROR_NOT_SUPPORTED;
+    }
+    const char* head = file->ops->borrow(file->handle,
+                                         sizeof(chunk_len) + sizeof(crc32),
+                                         pos);
+    if (!head) {
+        return COUCHSTORE_ERROR_NOT_SUPPORTED;
+    }
+    memcpy(&chunk_len, head, sizeof(chunk_len));
+    memcpy(&crc32, head + sizeof(chunk_len), sizeof(crc32));
+    chunk_len = ntohl(chunk_len) & ~0x80000000;
+    crc32 = ntohl(crc32);
+
+    in_block -= sizeof(chunk_len) + sizeof(crc32);
+    if (chunk_len > in_block) {
+        return COUCHSTORE_ERROR_NOT_SUPPORTED;
+    }
+    const char* data = file->ops->borrow(
+            file->handle, chunk_len, pos + sizeof(chunk_len) + sizeof(crc32));
+    if (!data) {
+        return COUCHSTORE_ERROR_NOT_SUPPORTED;
+    }
+    if (!perform_integrity_check(reinterpret_cast<const uint8_t*>(data),
+                                 chunk_len, crc32, file->crc_mode)) {
+        return COUCHSTORE_ERROR_CHECKSUM_FAIL;
+    }
+
+    *ret_ptr = data;
+    return chunk_len;
+}
+
 int pread_header(tree_file *file,
                  cs_off_t pos,
                  char **ret_ptr,
@@ -175,39 +376,162 @@ int pread_header(tree_file *file,
     return pread_bin_internal(file, pos + 1, ret_ptr, max_header_size);
 }
 
-int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
+// Decompresses a chunk read by pread_bin_internal or borrow_bin.
+static int inflate_chunk(couchstore_codec codec,
+                         const DocDictionary *dict,
+                         const char *compressed,
+                         int len,
+                         char **ret_ptr)
 {
-    char *compressed_buf;
-    int len = pread_bin_internal(file, pos, &compressed_buf, 0);
-    if (len < 0) {
-        return len;
-    }
-
     auto allocator = cb::compression::Allocator{
         cb::compression::Allocator::Mode::Malloc};
 
     cb::compression::Buffer buffer(allocator);
-    try {
-        using cb::compression::Algorithm;
+    couchstore_error_t errcode = codec_inflate(codec, dict,
+                                               {compressed, size_t(len)},
+                                               buffer);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+
+    len = gsl::narrow_cast<int>(buffer.size());
+    *ret_ptr = buffer.release();
+    return len;
+}
 
-        if (!cb::compression::inflate(Algorithm::Snappy,
-                                      {compressed_buf, size_t(len)},
-                                      buffer)) {
-            cb_free(compressed_buf);
+// Decompresses a B-tree node, which starts with its codec if the file
+// records codecs.
+static int inflate_node(tree_file *file,
+                        const char *compressed,
+                        int len,
+                        char **ret_ptr)
+{
+    couchstore_codec codec = COUCHSTORE_CODEC_SNAPPY;
+    if (file->codec_ids) {
+        if (len < 1) {
             return COUCHSTORE_ERROR_CORRUPT;
         }
-    } catch (const std::bad_alloc&) {
-        cb_free(compressed_buf);
-        return COUCHSTORE_ERROR_ALLOC_FAIL;
+        codec = couchstore_codec(compressed[0]);
+        ++compressed;
+        --len;
+    }
+    return inflate_chunk(codec, NULL, compressed, len, ret_ptr);
+}
+
+// Reads the compressed chunk at 'pos', borrowing it if possible. Sets
+// '*to_free' to the buffer to free once done with the chunk, if any.
+static int pread_compressed_chunk(tree_file *file,
+                                  cs_off_t pos,
+                                  const char **ret_ptr,
+                                  char **to_free)
+{
+    int len = borrow_bin(file, pos, ret_ptr);
+    if (len == COUCHSTORE_ERROR_NOT_SUPPORTED) {
+        len = pread_bin_internal(file, pos, to_free, 0);
+        *ret_ptr = *to_free;
     }
+    return len;
+}
 
+int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
+{
+    char *compressed_buf = nullptr;
+    const char *compressed = nullptr;
+    int len = pread_compressed_chunk(file, pos, &compressed, &compressed_buf);
+    if (len >= 0) {
+        len = inflate_node(file, compressed, len, ret_ptr);
+    }
     cb_free(compressed_buf);
+    return len;
+}
 
-    len = gsl::narrow_cast<int>(buffer.size());
-    *ret_ptr = buffer.release();
+int pread_compressed_doc(tree_file *file,
+                         cs_off_t pos,
+                         couchstore_codec codec,
+                         const DocDictionary *dict,
+                         char **ret_ptr)
+{
+    char *compressed_buf = nullptr;
+    const char *compressed = nullptr;
+    int len = pread_compressed_chunk(file, pos, &compressed, &compressed_buf);
+    if (len >= 0) {
+        len = inflate_chunk(codec, dict, compressed, len, ret_ptr);
+    }
+    cb_free(compressed_buf);
     return len;
 }
 
+void pread_compressed_batch(tree_file *file,
+                            size_t count,
+                            const cs_off_t *pos,
+                            char **ret_ptrs,
+                            int *ret_lens)
+{
+    // Chunks which can be borrowed need no I/O; the first read of each of
+    // the others (see pread_bin_internal) is issued as one batch.
+    std::vector<couch_read_request> reqs;
+    std::vector<size_t> index;
+    std::vector<uint8_t> heads;
+    try {
+        reqs.reserve(count);
+        index.reserve(count);
+        size_t heads_size = 0;
+        for (size_t ii = 0; ii < count; ++ii) {
+            const char *borrowed = nullptr;
+            int len = borrow_bin(file, pos[ii], &borrowed);
+            if (len != COUCHSTORE_ERROR_NOT_SUPPORTED) {
+                ret_lens[ii] = len < 0 ? len : inflate_node(file, borrowed, len,
+                                                            &ret_ptrs[ii]);
+                continue;
+            }
+            cs_off_t head_pos = pos[ii];
+            if (head_pos % COUCH_BLOCK_SIZE == 0) {
+                ++head_pos;
+            }
+            size_t extent = chunk_head_extent(file, head_pos);
+            reqs.push_back({nullptr, extent, head_pos, 0});
+            index.push_back(ii);
+            heads_size += extent;
+        }
+        heads.resize(heads_size);
+    } catch (const std::bad_alloc&) {
+        for (size_t ii = 0; ii < count; ++ii) {
+            ret_lens[ii] = COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        return;
+    }
+    if (reqs.empty()) {
+        return;
+    }
+
+    size_t head_offset = 0;
+    for (auto& req : reqs) {
+        req.buf = heads.data() + head_offset;
+        head_offset += req.nbytes;
+    }
+    file->ops->pread_batch(&file->lastError, file->handle, reqs.data(),
+                           reqs.size());
+
+    for (size_t ii = 0; ii < reqs.size(); ++ii) {
+        const couch_read_request& req = reqs[ii];
+        int& ret_len = ret_lens[index[ii]];
+        if (req.result < 0) {
+            ret_len = int(req.result);
+            continue;
+        }
+        char *compressed = nullptr;
+        int len = pread_bin_from_head(file, req.offset,
+                                      static_cast<uint8_t*>(req.buf),
+                                      req.result, &compressed, 0);
+        if (len < 0) {
+            ret_len = len;
+            continue;
+        }
+        ret_len = inflate_node(file, compressed, len, &ret_ptrs[index[ii]]);
+        cb_free(compressed);
+    }
+}
+
 int pread_bin(tree_file *file, cs_off_t pos, char **ret_ptr)
 {
     return pread_bin_internal(file, pos, ret_ptr, 0);
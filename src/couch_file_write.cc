@@ -8,41 +8,82 @@
 #include <sys/types.h>
 #include <libcouchstore/couch_db.h>
 #include <platform/compress.h>
+#include <algorithm>
+#include <climits>
+#include <vector>
 
 #include "internal.h"
+#include "codec.h"
 #include "crc32.h"
 #include "util.h"
 
-static ssize_t raw_write(tree_file *file, const sized_buf *buf, cs_off_t pos)
+static const char blockprefix = 0;
+
+/**
+ * Appends to `iov` the pieces needed to write `size` bytes from `buf` at
+ * file offset `pos`: the data itself, split wherever it crosses a block
+ * boundary so that a zero prefix byte can be inserted.
+ * Returns the file offset following the last byte written.
+ */
+static cs_off_t add_iov(std::vector<couch_iovec>& iov,
+                        const char* buf, size_t size, cs_off_t pos)
 {
-    cs_off_t write_pos = pos;
     size_t buf_pos = 0;
-    char blockprefix = 0;
-    ssize_t written;
-    size_t block_remain;
-    while (buf_pos < buf->size) {
-        block_remain = COUCH_BLOCK_SIZE - (write_pos % COUCH_BLOCK_SIZE);
-        if (block_remain > (buf->size - buf_pos)) {
-            block_remain = buf->size - buf_pos;
+    while (buf_pos < size) {
+        if (pos % COUCH_BLOCK_SIZE == 0) {
+            iov.push_back({&blockprefix, 1});
+            pos += 1;
         }
-
-        if (write_pos % COUCH_BLOCK_SIZE == 0) {
-            written = file->ops->pwrite(&file->lastError, file->handle,
-                                        &blockprefix, 1, write_pos);
-            if (written < 0) {
-                return written;
-            }
-            write_pos += 1;
-            continue;
+        size_t block_remain = COUCH_BLOCK_SIZE - (pos % COUCH_BLOCK_SIZE);
+        if (block_remain > (size - buf_pos)) {
+            block_remain = size - buf_pos;
         }
+        iov.push_back({buf + buf_pos, block_remain});
+        buf_pos += block_remain;
+        pos += block_remain;
+    }
+    return pos;
+}
 
-        written = file->ops->pwrite(&file->lastError, file->handle,
-                                    buf->buf + buf_pos, block_remain, write_pos);
+// Upper bound of the iov entries add_iov() needs for `size` bytes.
+static size_t max_iov_entries(size_t size)
+{
+    return 2 * (size / (COUCH_BLOCK_SIZE - 1) + 2);
+}
+
+/**
+ * Writes out the pieces in `iov` starting at file offset `pos`, using as
+ * few pwritev() calls as the file ops allow.
+ * Returns the number of bytes written, or a negative error code.
+ */
+static ssize_t raw_writev(tree_file *file, std::vector<couch_iovec>& iov,
+                          cs_off_t pos)
+{
+    cs_off_t write_pos = pos;
+    size_t first = 0;
+    while (first < iov.size()) {
+        int iovcnt = int(std::min(iov.size() - first, size_t(INT_MAX)));
+        ssize_t written = file->ops->pwritev(&file->lastError, file->handle,
+                                             &iov[first], iovcnt, write_pos);
         if (written < 0) {
             return written;
         }
-        buf_pos += written;
+        if (written == 0) {
+            return COUCHSTORE_ERROR_WRITE;
+        }
         write_pos += written;
+
+        // Skip past whatever was written; a partially written piece is
+        // trimmed so the next call resumes from where this one stopped.
+        size_t remain = size_t(written);
+        while (first < iov.size() && remain >= iov[first].len) {
+            remain -= iov[first].len;
+            ++first;
+        }
+        if (remain > 0) {
+            iov[first].base = static_cast<const char*>(iov[first].base) + remain;
+            iov[first].len -= remain;
+        }
     }
 
     return (ssize_t)(write_pos - pos);
@@ -65,15 +106,17 @@ couchstore_error_t write_header(tree_file *file, sized_buf *buf, cs_off_t *pos)
     memcpy(&headerbuf[1], &size, 4);
     memcpy(&headerbuf[5], &crc32, 4);
 
-    written = file->ops->pwrite(&file->lastError, file->handle,
-                                &headerbuf, sizeof(headerbuf), write_pos);
-    if (written < 0) {
-        return (couchstore_error_t)written;
+    // ...followed by the actual header, in a single write
+    std::vector<couch_iovec> iov;
+    try {
+        iov.reserve(1 + max_iov_entries(buf->size));
+    } catch (const std::bad_alloc&) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
-    write_pos += written;
+    iov.push_back({headerbuf, sizeof(headerbuf)});
+    add_iov(iov, buf->buf, buf->size, write_pos + sizeof(headerbuf));
 
-    //Write actual header
-    written = raw_write(file, buf, write_pos);
+    written = raw_writev(file, iov, write_pos);
     if (written < 0) {
         return (couchstore_error_t)written;
     }
@@ -83,30 +126,47 @@ couchstore_error_t write_header(tree_file *file, sized_buf *buf, cs_off_t *pos)
     return COUCHSTORE_SUCCESS;
 }
 
-int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
+/**
+ * Writes the `count` pieces in `bufs` as a single chunk, as though they
+ * had been copied into one buffer and written with db_write_buf().
+ */
+static int db_write_bufs(tree_file *file, const sized_buf *bufs, size_t count,
+                         cs_off_t *pos, size_t *disk_size)
 {
     cs_off_t write_pos = file->pos;
     cs_off_t end_pos = write_pos;
     ssize_t written;
-    uint32_t size = htonl(buf->size | 0x80000000);
-    uint32_t crc32 = htonl(get_checksum(reinterpret_cast<uint8_t*>(buf->buf),
-                                        buf->size,
-                                        file->crc_mode));
+    size_t total = 0;
+    uint32_t crc32 = 0;
+    for (size_t ii = 0; ii < count; ++ii) {
+        crc32 = update_checksum(crc32, reinterpret_cast<uint8_t*>(bufs[ii].buf),
+                                bufs[ii].size, file->crc_mode);
+        total += bufs[ii].size;
+    }
+    uint32_t size = htonl(total | 0x80000000);
+    crc32 = htonl(crc32);
     char headerbuf[4 + 4];
 
-    // Write the buffer's header:
+    // Write the buffer's header, followed by the actual buffer:
     memcpy(&headerbuf[0], &size, 4);
     memcpy(&headerbuf[4], &crc32, 4);
 
-    sized_buf sized_headerbuf = { headerbuf, 8 };
-    written = raw_write(file, &sized_headerbuf, end_pos);
-    if (written < 0) {
-        return (int)written;
+    std::vector<couch_iovec> iov;
+    try {
+        size_t entries = max_iov_entries(sizeof(headerbuf));
+        for (size_t ii = 0; ii < count; ++ii) {
+            entries += max_iov_entries(bufs[ii].size);
+        }
+        iov.reserve(entries);
+    } catch (const std::bad_alloc&) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    cs_off_t body_pos = add_iov(iov, headerbuf, sizeof(headerbuf), end_pos);
+    for (size_t ii = 0; ii < count; ++ii) {
+        body_pos = add_iov(iov, bufs[ii].buf, bufs[ii].size, body_pos);
     }
-    end_pos += written;
 
-    // Write actual buffer:
-    written = raw_write(file, buf, end_pos);
+    written = raw_writev(file, iov, end_pos);
     if (written < 0) {
         return (int)written;
     }
@@ -124,26 +184,38 @@ int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *d
     return 0;
 }
 
+int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
+{
+    return db_write_bufs(file, buf, 1, pos, disk_size);
+}
+
 couchstore_error_t db_write_buf_compressed(tree_file *file,
                                            const sized_buf *buf,
                                            cs_off_t *pos,
                                            size_t *disk_size)
 {
+    couchstore_codec codec = COUCHSTORE_CODEC_SNAPPY;
+    if (file->codec_ids) {
+        codec = file->options.node_codec;
+    }
+
     cb::compression::Buffer buffer;
-    try {
-        using cb::compression::Algorithm;
-        if (!cb::compression::deflate(Algorithm::Snappy,
-                                      {buf->buf, buf->size},
-                                      buffer)) {
-            return COUCHSTORE_ERROR_CORRUPT;
-        }
-    } catch (const std::bad_alloc&) {
-        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    couchstore_error_t errcode = codec_deflate(codec, NULL,
+                                               {buf->buf, buf->size}, buffer);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
     }
 
     sized_buf to_write{};
     to_write.buf = buffer.data();
     to_write.size = buffer.size();
+    if (!file->codec_ids) {
+        return static_cast<couchstore_error_t>(db_write_buf(file, &to_write, pos, disk_size));
+    }
 
-    return static_cast<couchstore_error_t>(db_write_buf(file, &to_write, pos, disk_size));
+    // Prefix the node with its codec.
+    char codec_id = char(codec);
+    const sized_buf pieces[] = {{&codec_id, 1}, to_write};
+    return static_cast<couchstore_error_t>(
+            db_write_bufs(file, pieces, 2, pos, disk_size));
 }
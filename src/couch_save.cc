@@ -2,15 +2,33 @@
 #include "config.h"
 
 #include <platform/cb_malloc.h>
+#include <platform/compress.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 #include "internal.h"
+#include "arena.h"
+#include "bloom_filter.h"
+#include "codec.h"
 #include "node_types.h"
 #include "util.h"
 #include "reduces.h"
 #include "couch_btree.h"
+#include "node_cache.h"
+#include "tree_writer.h"
 
 #include "couch_latency_internal.h"
 
@@ -57,12 +75,23 @@ static size_t assemble_id_index_value(DocInfo *docinfo, char *dst)
     return dst - start;
 }
 
-static couchstore_error_t write_doc(Db *db, const Doc *doc, uint64_t *bp,
+static couchstore_error_t write_doc(Db *db, const Doc *doc,
+                                    const sized_buf *compressed,
+                                    couchstore_codec codec,
+                                    const DocDictionary *dict, uint64_t *bp,
                                     size_t* disk_size, couchstore_save_options writeopts)
 {
     couchstore_error_t errcode;
-    if (writeopts & COMPRESS_DOC_BODIES) {
-        errcode = db_write_buf_compressed(&db->file, &doc->data, (cs_off_t *) bp, disk_size);
+    if (compressed) {
+        errcode = static_cast<couchstore_error_t>(db_write_buf(&db->file, compressed, (cs_off_t *) bp, disk_size));
+    } else if (writeopts & COMPRESS_DOC_BODIES) {
+        cb::compression::Buffer buffer;
+        errcode = codec_deflate(codec, dict,
+                                {doc->data.buf, doc->data.size}, buffer);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            sized_buf to_write{buffer.data(), buffer.size()};
+            errcode = static_cast<couchstore_error_t>(db_write_buf(&db->file, &to_write, (cs_off_t *) bp, disk_size));
+        }
     } else {
         errcode = static_cast<couchstore_error_t>(db_write_buf(&db->file, &doc->data, (cs_off_t *) bp, disk_size));
     }
@@ -70,6 +99,184 @@ static couchstore_error_t write_doc(Db *db, const Doc *doc, uint64_t *bp,
     return errcode;
 }
 
+namespace {
+
+/**
+ * Process-wide pool of threads that compress document bodies alongside the
+ * saving thread (see compress_docs()). The threads are started on first
+ * use and kept until exit, so a save doesn't pay for starting them.
+ */
+class CompressionPool {
+public:
+    static CompressionPool& get() {
+        static CompressionPool instance;
+        return instance;
+    }
+
+    /**
+     * Runs 'work' on the calling thread and on up to 'helpers' of the
+     * pool's, returning once each has returned. 'work' should take items
+     * from a shared counter, so that helpers which only start once the
+     * caller is done (the pool being busy with other saves) find nothing
+     * left; those still queued by then are withdrawn.
+     */
+    void run(const std::function<void()>& work, size_t helpers) {
+        Job job{&work, 0, 0};
+        {
+            std::lock_guard<std::mutex> lh(mutex);
+            start();
+            job.wanted = std::min(helpers, threads.size());
+            if (job.wanted) {
+                try {
+                    queue.push_back(&job);
+                } catch (const std::bad_alloc&) {
+                    job.wanted = 0;
+                }
+            }
+        }
+        if (job.wanted) {
+            work_cond.notify_all();
+        }
+        work();
+
+        std::unique_lock<std::mutex> lh(mutex);
+        if (job.wanted) {
+            queue.erase(std::remove(queue.begin(), queue.end(), &job),
+                        queue.end());
+        }
+        done_cond.wait(lh, [&job]() { return job.running == 0; });
+    }
+
+private:
+    struct Job {
+        const std::function<void()>* work;
+        // Number of the pool's threads still to pick it up
+        size_t wanted;
+        // Number of the pool's threads running it
+        size_t running;
+    };
+
+    CompressionPool() : started(false), stopping(false) {
+    }
+
+    ~CompressionPool() {
+        {
+            std::lock_guard<std::mutex> lh(mutex);
+            stopping = true;
+        }
+        work_cond.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Starts the threads, if not started yet. Called with the mutex held.
+    void start() {
+        if (started) {
+            return;
+        }
+        started = true;
+        try {
+            for (size_t ii = 1; ii < MAX_COMPRESSION_THREADS; ++ii) {
+                threads.emplace_back(&CompressionPool::loop, this);
+            }
+        } catch (const std::bad_alloc&) {
+            // Carry on with the threads we have.
+        } catch (const std::system_error&) {
+            // Likewise.
+        }
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lh(mutex);
+        while (true) {
+            work_cond.wait(lh, [this]() { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            Job* job = queue.front();
+            if (--job->wanted == 0) {
+                queue.pop_front();
+            }
+            ++job->running;
+            lh.unlock();
+            (*job->work)();
+            lh.lock();
+            if (--job->running == 0) {
+                done_cond.notify_all();
+            }
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable work_cond;
+    std::condition_variable done_cond;
+    std::deque<Job*> queue;
+    std::vector<std::thread> threads;
+    bool started;
+    bool stopping;
+};
+
+} // anonymous namespace
+
+/**
+ * Compresses the bodies of the documents flagged as compressed with the
+ * database's document codec into 'compressed', on up to
+ * MAX_COMPRESSION_THREADS threads including the caller's (see
+ * CompressionPool). Other documents get an empty buffer.
+ */
+static couchstore_error_t compress_docs(Db *db,
+                                        Doc* const docs[],
+                                        DocInfo *infos[],
+                                        unsigned numdocs,
+                                        std::unique_ptr<cb::compression::Buffer[]>& compressed)
+{
+    couchstore_codec codec;
+    const DocDictionary *dict;
+    couchstore_error_t codec_err = db_doc_codec(db, &codec, &dict);
+    if (codec_err != COUCHSTORE_SUCCESS) {
+        return codec_err;
+    }
+
+    std::atomic<unsigned> next(0);
+    std::atomic<int> errcode(COUCHSTORE_SUCCESS);
+
+    auto worker = [&]() {
+        unsigned ii;
+        while ((ii = next++) < numdocs && errcode == COUCHSTORE_SUCCESS) {
+            if (!docs[ii] ||
+                !(infos[ii]->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+                continue;
+            }
+            const sized_buf& data = docs[ii]->data;
+            couchstore_error_t err = codec_deflate(codec, dict,
+                                                   {data.buf, data.size},
+                                                   compressed[ii]);
+            if (err != COUCHSTORE_SUCCESS) {
+                errcode = err;
+            }
+        }
+    };
+
+    size_t nthreads = std::min<size_t>({std::thread::hardware_concurrency(),
+                                        MAX_COMPRESSION_THREADS,
+                                        numdocs / MIN_DOCS_PER_COMPRESSION_THREAD});
+    compressed.reset(new (std::nothrow) cb::compression::Buffer[numdocs]);
+    if (!compressed) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    if (nthreads > 1) {
+        try {
+            CompressionPool::get().run(worker, nthreads - 1);
+        } catch (const std::bad_alloc&) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    } else {
+        worker();
+    }
+    return static_cast<couchstore_error_t>(errcode.load());
+}
+
 static int ebin_ptr_compare(const void *a, const void *b)
 {
     const sized_buf* const* buf1 = static_cast<const sized_buf* const *>(a);
@@ -163,7 +370,7 @@ static couchstore_error_t update_indexes(Db *db,
     node_pointer *new_seq_root;
     couchstore_error_t errcode;
     couchstore_error_t err;
-    couchfile_modify_request seqrq, idrq;
+    couchfile_modify_request seqrq{}, idrq{};
     int ii;
     index_update_ctx fetcharg;
 
@@ -223,6 +430,7 @@ static couchstore_error_t update_indexes(Db *db,
     idrq.purge_kv = NULL;
     idrq.kv_chunk_threshold = db->file.options.kv_nodesize;
     idrq.kp_chunk_threshold = db->file.options.kp_nodesize;
+    idrq.spine = NULL;
 
     new_id_root = modify_btree(&idrq, db->header.by_id_root, &err);
     error_pass(err);
@@ -251,6 +459,7 @@ static couchstore_error_t update_indexes(Db *db,
     seqrq.purge_kv = NULL;
     seqrq.kv_chunk_threshold = db->file.options.kv_nodesize;
     seqrq.kp_chunk_threshold = db->file.options.kp_nodesize;
+    seqrq.spine = db->seq_spine;
 
     new_seq_root = modify_btree(&seqrq, db->header.by_seq_root, &errcode);
     if (errcode != COUCHSTORE_SUCCESS) {
@@ -283,6 +492,7 @@ static couchstore_error_t add_doc_to_update_list(Db *db,
                                                  sized_buf *seqval,
                                                  sized_buf *idval,
                                                  uint64_t seq,
+                                                 const sized_buf *compressed,
                                                  couchstore_save_options options)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
@@ -301,7 +511,20 @@ static couchstore_error_t add_doc_to_update_list(Db *db,
         if (!(info->content_meta & COUCH_DOC_IS_COMPRESSED)) {
             options &= ~COMPRESS_DOC_BODIES;
         }
-        errcode = write_doc(db, doc, &updated.bp, &disk_size, options);
+        couchstore_codec codec = COUCHSTORE_CODEC_SNAPPY;
+        const DocDictionary *dict = NULL;
+        if (options & COMPRESS_DOC_BODIES) {
+            errcode = db_doc_codec(db, &codec, &dict);
+            if (errcode != COUCHSTORE_SUCCESS) {
+                return errcode;
+            }
+            if (db->file.codec_ids) {
+                updated.content_meta = set_doc_codec(updated.content_meta,
+                                                     codec);
+            }
+        }
+        errcode = write_doc(db, doc, compressed, codec, dict, &updated.bp,
+                            &disk_size, options);
 
         if (errcode != COUCHSTORE_SUCCESS) {
             return errcode;
@@ -343,10 +566,18 @@ couchstore_error_t couchstore_save_documents(Db *db,
     size_t term_meta_size = 0;
     const Doc *curdoc;
     uint64_t seq = db->header.update_seq;
+    // Bodies compressed ahead of the appends, if compressing in parallel.
+    std::unique_ptr<cb::compression::Buffer[]> compressed;
 
     fatbuf *fb;
 
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    // The saved IDs must make it into the Bloom filter, if there is one.
+    db_load_bloom_filter(db);
+    if (!db->seq_spine) {
+        // Without it, the by-sequence tree's right edge is just read back.
+        db->seq_spine = new (std::nothrow) RightSpine();
+    }
 
     for (ii = 0; ii < numdocs; ii++) {
         // Get additional size for terms to be inserted into indexes
@@ -369,7 +600,19 @@ couchstore_error_t couchstore_save_documents(Db *db,
     seqvlist = static_cast<sized_buf*>(fatbuf_get(fb, numdocs * sizeof(sized_buf)));
     idvlist = static_cast<sized_buf*>(fatbuf_get(fb, numdocs * sizeof(sized_buf)));
 
+    if (docs && (options & COMPRESS_DOC_BODIES_IN_PARALLEL)) {
+        options |= COMPRESS_DOC_BODIES;
+        errcode = compress_docs(db, docs, infos, numdocs, compressed);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            fatbuf_free(fb);
+            return errcode;
+        }
+    }
+
     for (ii = 0; ii < numdocs; ii++) {
+        const sized_buf *precompressed = NULL;
+        sized_buf compressed_buf;
+
         if(options & COUCHSTORE_SEQUENCE_AS_IS) {
             seq = infos[ii]->db_seq;
         } else {
@@ -382,10 +625,17 @@ couchstore_error_t couchstore_save_documents(Db *db,
             curdoc = NULL;
         }
 
+        if (curdoc && compressed &&
+            (infos[ii]->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+            compressed_buf.buf = compressed[ii].data();
+            compressed_buf.size = compressed[ii].size();
+            precompressed = &compressed_buf;
+        }
+
         errcode = add_doc_to_update_list(db, curdoc, infos[ii], fb,
                                          &seqklist[ii], &idklist[ii],
                                          &seqvlist[ii], &idvlist[ii],
-                                         seq, options);
+                                         seq, precompressed, options);
         if (errcode != COUCHSTORE_SUCCESS) {
             break;
         }
@@ -398,6 +648,11 @@ couchstore_error_t couchstore_save_documents(Db *db,
 
     fatbuf_free(fb);
     if (errcode == COUCHSTORE_SUCCESS) {
+        for (ii = 0; ii < numdocs; ii++) {
+            db_add_to_bloom_filter(db, &infos[ii]->id,
+                                   (options & COUCHSTORE_SEQUENCE_AS_IS) ?
+                                   infos[ii]->db_seq : db->header.update_seq + ii + 1);
+        }
         if(options & COUCHSTORE_SEQUENCE_AS_IS) {
             // Sequences are passed as-is, make sure update_seq is >= the highest.
             seq = db->header.update_seq;
@@ -426,3 +681,262 @@ couchstore_error_t couchstore_save_document(Db *db, const Doc *doc,
 {
     return couchstore_save_documents(db, (Doc**)&doc, (DocInfo**)&info, 1, options);
 }
+
+struct _bulk_load {
+    Db *db;
+    // Holds the by-sequence items until the node they go in is written
+    arena *transient_arena;
+    // Holds the pointers to the by-sequence nodes written
+    arena *persistent_arena;
+    couchfile_modify_result *seq_mr;
+    // Collects (and if need be sorts) the by-ID items
+    TreeWriter *id_writer;
+    char tmp_path[PATH_MAX];
+    // Whether the IDs loaded so far are in ascending order
+    bool ids_sorted;
+    std::string last_id;
+    uint64_t loaded;
+    // The db's update_seq before the load
+    uint64_t start_seq;
+    // Set once finishing is attempted, or after an error loading documents
+    bool closed;
+    // Set once the loaded documents are committed
+    bool finished;
+};
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_bulk_load(Db *db, BulkLoad **pLoad)
+{
+    COLLECT_LATENCY();
+
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    compare_info seqcmp;
+    seqcmp.compare = seq_cmp;
+    BulkLoad *load = NULL;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(!db->header.by_id_root && !db->header.by_seq_root,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    error_unless(strlen(db->file.path) + sizeof(".bulk-tmp_0") <= PATH_MAX,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+    load = new (std::nothrow) BulkLoad();
+    error_unless(load, COUCHSTORE_ERROR_ALLOC_FAIL);
+    load->db = db;
+    load->ids_sorted = true;
+    load->loaded = 0;
+    load->start_seq = db->header.update_seq;
+    load->closed = false;
+    load->finished = false;
+    load->transient_arena = new_arena(0);
+    load->persistent_arena = new_arena(0);
+    error_unless(load->transient_arena && load->persistent_arena,
+                 COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    load->seq_mr = new_btree_modres(load->persistent_arena,
+                                    load->transient_arena,
+                                    &db->file,
+                                    &seqcmp,
+                                    by_seq_reduce,
+                                    by_seq_rereduce,
+                                    NULL,
+                                    db->file.options.kv_nodesize,
+                                    db->file.options.kp_nodesize);
+    error_unless(load->seq_mr, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    strcpy(load->tmp_path, db->file.path);
+    strcat(load->tmp_path, ".bulk-tmp_0");
+    error_pass(TreeWriterOpen(load->tmp_path, ebin_cmp, by_id_reduce,
+                              by_id_rereduce, NULL, &load->id_writer));
+    TreeWriterRequireUniqueKeys(load->id_writer);
+
+    // The loaded IDs must make it into the Bloom filter, if there is one.
+    db_load_bloom_filter(db);
+    *pLoad = load;
+    load = NULL;
+cleanup:
+    couchstore_free_bulk_load(load);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_bulk_load_documents(BulkLoad *load,
+                                                  Doc* const docs[],
+                                                  DocInfo *infos[],
+                                                  unsigned numdocs,
+                                                  couchstore_save_options options)
+{
+    COLLECT_LATENCY();
+
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = load->db;
+    uint64_t seq = db->header.update_seq;
+    size_t term_meta_size = 0;
+    unsigned ii;
+    fatbuf *fb = NULL;
+    std::unique_ptr<cb::compression::Buffer[]> compressed;
+    bool ids_sorted = load->ids_sorted;
+    sized_buf last_id = {const_cast<char*>(load->last_id.data()),
+                         load->last_id.size()};
+
+    if (db->dropped) {
+        return COUCHSTORE_ERROR_FILE_CLOSED;
+    }
+    if (load->closed) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    for (ii = 0; ii < numdocs; ii++) {
+        // An ID loaded again shows up here while the IDs are in ascending
+        // order, and otherwise once they are sorted (see
+        // TreeWriterRequireUniqueKeys()).
+        if (ids_sorted) {
+            if (last_id.size) {
+                int cmp = ebin_cmp(&last_id, &infos[ii]->id);
+                if (cmp == 0) {
+                    return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+                }
+                ids_sorted = cmp < 0;
+            }
+            last_id = infos[ii]->id;
+        }
+        if (options & COUCHSTORE_SEQUENCE_AS_IS) {
+            // The by-sequence index is built in order.
+            if (infos[ii]->db_seq <= seq) {
+                return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+            }
+            seq = infos[ii]->db_seq;
+        }
+        // IMPORTANT: This must match the sizes of the fatbuf_get calls in add_doc_to_update_list!
+        term_meta_size += RAW_SEQ_SIZE;
+        term_meta_size += SEQ_INDEX_RAW_VALUE_SIZE(*infos[ii]);
+        term_meta_size += ID_INDEX_RAW_VALUE_SIZE(*infos[ii]);
+    }
+    seq = db->header.update_seq;
+
+    fb = fatbuf_alloc(term_meta_size);
+    error_unless(fb, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    if (docs && (options & COMPRESS_DOC_BODIES_IN_PARALLEL)) {
+        options |= COMPRESS_DOC_BODIES;
+        error_pass(compress_docs(db, docs, infos, numdocs, compressed));
+    }
+
+    for (ii = 0; ii < numdocs; ii++) {
+        const Doc *curdoc = docs ? docs[ii] : NULL;
+        const sized_buf *precompressed = NULL;
+        sized_buf compressed_buf;
+        sized_buf seqterm, idterm, seqval, idval;
+
+        if (options & COUCHSTORE_SEQUENCE_AS_IS) {
+            seq = infos[ii]->db_seq;
+        } else {
+            seq++;
+        }
+
+        if (curdoc && compressed &&
+            (infos[ii]->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+            compressed_buf.buf = compressed[ii].data();
+            compressed_buf.size = compressed[ii].size();
+            precompressed = &compressed_buf;
+        }
+
+        error_pass(add_doc_to_update_list(db, curdoc, infos[ii], fb,
+                                          &seqterm, &idterm, &seqval, &idval,
+                                          seq, precompressed, options));
+
+        // The by-sequence items must outlive this batch, until their node
+        // is written.
+        sized_buf *seqterm_c = arena_copy_buf(load->transient_arena, &seqterm);
+        sized_buf *seqval_c = arena_copy_buf(load->transient_arena, &seqval);
+        error_unless(seqterm_c && seqval_c, COUCHSTORE_ERROR_ALLOC_FAIL);
+        error_pass(mr_push_item(seqterm_c, seqval_c, load->seq_mr));
+        if (load->seq_mr->count == 0) {
+            /* No items queued, we must have just flushed. We can safely rewind the transient arena. */
+            arena_free_all(load->transient_arena);
+        }
+
+        error_pass(TreeWriterAddItem(load->id_writer, idterm, idval));
+        if (load->ids_sorted) {
+            sized_buf last = {const_cast<char*>(load->last_id.data()),
+                              load->last_id.size()};
+            if (!load->last_id.empty() && ebin_cmp(&last, &idterm) >= 0) {
+                load->ids_sorted = false;
+            } else {
+                try {
+                    load->last_id.assign(idterm.buf, idterm.size);
+                } catch (const std::bad_alloc&) {
+                    load->ids_sorted = false;
+                }
+            }
+        }
+        db_add_to_bloom_filter(db, &idterm, seq);
+
+        infos[ii]->db_seq = seq;
+        db->header.update_seq = seq;
+        load->loaded++;
+    }
+
+cleanup:
+    fatbuf_free(fb);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        // The indexes are incomplete now.
+        load->closed = true;
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_finish_bulk_load(BulkLoad *load)
+{
+    COLLECT_LATENCY();
+
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = load->db;
+    node_pointer *seq_root;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(!load->closed, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    load->closed = true;
+
+    if (load->loaded == 0) {
+        // Nothing was loaded.
+        error_pass(couchstore_commit(db));
+        load->finished = true;
+        goto cleanup;
+    }
+
+    seq_root = complete_new_btree(load->seq_mr, &errcode);
+    error_pass(errcode);
+    db->header.by_seq_root = seq_root;
+
+    if (!load->ids_sorted) {
+        error_pass(TreeWriterSort(load->id_writer));
+    }
+    error_pass(TreeWriterWrite(load->id_writer, &db->file,
+                               &db->header.by_id_root));
+    error_pass(couchstore_commit(db));
+    load->finished = true;
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_free_bulk_load(BulkLoad *load)
+{
+    if (load) {
+        if (!load->finished && load->db) {
+            // Forget the documents loaded.
+            Db *db = load->db;
+            cb_free(db->header.by_id_root);
+            cb_free(db->header.by_seq_root);
+            db->header.by_id_root = NULL;
+            db->header.by_seq_root = NULL;
+            db->header.update_seq = load->start_seq;
+        }
+        TreeWriterFree(load->id_writer);
+        delete_arena(load->transient_arena);
+        delete_arena(load->persistent_arena);
+        delete load;
+    }
+    return COUCHSTORE_SUCCESS;
+}
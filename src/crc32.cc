@@ -78,9 +78,9 @@ static const uint32_t crc32tab[256] = {
     0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
 };
 
-static uint32_t _hash_crc32(const uint8_t* key, size_t key_length) {
+static uint32_t _hash_crc32(const uint8_t* key, size_t key_length,
+                            uint32_t crc = std::numeric_limits<uint32_t>::max()) {
     uint64_t x;
-    uint32_t crc = std::numeric_limits<uint32_t>::max();
 
     for (x = 0; x < key_length; x++) {
         crc = (crc >> 8) ^ crc32tab[(crc ^ (uint64_t)key[x]) & 0xff];
@@ -133,6 +133,22 @@ uint32_t get_checksum(const uint8_t* buf,
     }
 }
 
+/*
+ * Get the checksum of the data 'checksum' was calculated over followed by
+ * buf for buf_len bytes.
+ */
+uint32_t update_checksum(uint32_t checksum,
+                         const uint8_t* buf,
+                         size_t buf_len,
+                         crc_mode_e mode) {
+    if (mode == CRC32C) {
+        return crc32c(buf, buf_len, checksum);
+    } else {
+        cb_assert(mode == CRC32);
+        return _hash_crc32(buf, buf_len, checksum ^ 0xFFFFFFFF) ^ 0xFFFFFFFF;
+    }
+}
+
 uint32_t client_hash_crc32(const uint8_t* key, size_t key_length) {
     return ((~_hash_crc32(key, key_length)) >> 16) &
            0x7fff; // moxi/lcb etc... do this
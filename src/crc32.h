@@ -42,6 +42,17 @@ uint32_t get_checksum(const uint8_t* buf,
                       size_t buf_len,
                       crc_mode_e mode);
 
+/*
+ * Get the checksum of the data 'checksum' was calculated over (by
+ * get_checksum() or update_checksum()) followed by buf for buf_len bytes.
+ *
+ * mode = UNKNOWN is an invalid input (triggers assert).
+ */
+uint32_t update_checksum(uint32_t checksum,
+                         const uint8_t* buf,
+                         size_t buf_len,
+                         crc_mode_e mode);
+
 /*
  * Perform an integrity check of buf for buf_len bytes.
  *
@@ -5,15 +5,28 @@
 #include "reduces.h"
 #include "bitfield.h"
 #include "arena.h"
+#include "bloom_filter.h"
+#include "codec.h"
 #include "tree_writer.h"
 #include "node_types.h"
 #include "util.h"
 #include "couch_latency_internal.h"
 
 #include <platform/cb_malloc.h>
+#include <new>
 #include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+struct compact_pipeline;
 
 typedef struct compact_ctx {
     TreeWriter* tree_writer;
@@ -28,10 +41,18 @@ typedef struct compact_ctx {
     couchstore_docinfo_hook dhook;
     void* hook_ctx;
     couchstore_compact_flags flags;
+    Db* source;
+    /* Whether the target's document dictionary was trained by this
+     * compaction, replacing the source's one */
+    bool new_dictionary;
+    /* Set while copying the by-sequence index with
+     * COUCHSTORE_COMPACT_WITH_PARALLEL_READS */
+    compact_pipeline* pipeline;
 } compact_ctx;
 
 static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *ctx);
 static couchstore_error_t compact_localdocs_tree(Db* source, Db* target, compact_ctx *ctx);
+static couchstore_error_t train_doc_dictionary(Db* source, Db* target);
 
 couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filename,
                                             couchstore_compact_flags flags,
@@ -49,6 +70,9 @@ couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filen
     couchstore_error_t scan_err = COUCHSTORE_SUCCESS;
     compact_ctx ctx = {NULL, new_arena(0), new_arena(0), NULL, NULL, hook, dhook, hook_ctx, 0};
     ctx.flags = flags;
+    ctx.source = source;
+    ctx.new_dictionary = false;
+    ctx.pipeline = NULL;
     couchstore_open_flags open_flags = COUCHSTORE_OPEN_FLAG_CREATE;
     error_unless(!source->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
     error_unless(ctx.transient_arena && ctx.persistent_arena, COUCHSTORE_ERROR_ALLOC_FAIL);
@@ -65,6 +89,10 @@ couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filen
         open_flags |= COUCHSTORE_OPEN_FLAG_UNBUFFERED;
     }
 
+    if (flags & COUCHSTORE_COMPACT_WITH_BACKGROUND_FLUSH) {
+        open_flags |= COUCHSTORE_OPEN_WITH_BACKGROUND_FLUSH;
+    }
+
     if (flags & COUCHSTORE_COMPACT_WITH_PERIODIC_SYNC) {
         static_assert(uint64_t(COUCHSTORE_OPEN_WITH_PERIODIC_SYNC) ==
                       uint64_t(COUCHSTORE_COMPACT_WITH_PERIODIC_SYNC),
@@ -75,6 +103,31 @@ couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filen
         open_flags |= (flags & COUCHSTORE_OPEN_WITH_PERIODIC_SYNC);
     }
 
+    static_assert(uint64_t(COUCHSTORE_OPEN_WITH_NODE_CODEC) ==
+                  uint64_t(COUCHSTORE_COMPACT_WITH_NODE_CODEC) &&
+                  uint64_t(COUCHSTORE_OPEN_WITH_DOC_CODEC) ==
+                  uint64_t(COUCHSTORE_COMPACT_WITH_DOC_CODEC),
+                  "COUCHSTORE_OPEN_WITH_*_CODEC and "
+                  "COUCHSTORE_COMPACT_WITH_*_CODEC should have the same "
+                  "encoding");
+
+    // Transfer the codecs to the new file, or the source's if not given.
+    if (flags & COUCHSTORE_COMPACT_WITH_NODE_CODEC) {
+        open_flags |= (flags & COUCHSTORE_OPEN_WITH_NODE_CODEC);
+    } else {
+        open_flags |= couchstore_encode_codec_flags(
+                source->file.options.node_codec, COUCHSTORE_CODEC_SNAPPY);
+    }
+    if (flags & COUCHSTORE_COMPACT_TRAIN_DICTIONARY) {
+        open_flags |= couchstore_encode_codec_flags(
+                COUCHSTORE_CODEC_SNAPPY, COUCHSTORE_CODEC_ZSTD_DICT);
+    } else if (flags & COUCHSTORE_COMPACT_WITH_DOC_CODEC) {
+        open_flags |= (flags & COUCHSTORE_OPEN_WITH_DOC_CODEC);
+    } else {
+        open_flags |= couchstore_encode_codec_flags(
+                COUCHSTORE_CODEC_SNAPPY, source->file.options.doc_codec);
+    }
+
     // Transfer current B+tree node settings to new file.
     if (source->file.options.kp_nodesize) {
         uint32_t kp_flag = source->file.options.kp_nodesize / 1024;
@@ -87,8 +140,62 @@ couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filen
 
     error_pass(couchstore_open_db_ex(target_filename, open_flags, ops, &target));
 
+    // Likewise a version 12 or later file keeps its B-tree node format
+    // unless upgrade is requested.
+    if (source->header.disk_version >= COUCH_DISK_VERSION_12 &&
+        source->header.disk_version < COUCH_DISK_VERSION &&
+        !(flags & COUCHSTORE_COMPACT_FLAG_UPGRADE_DB)) {
+        target->header.disk_version = source->header.disk_version;
+        tree_file_set_disk_version(&target->file, target->header.disk_version);
+    }
+
+    // Build a Bloom filter for the new file if asked to, or to replace the
+    // old file's one.
+    if (((flags & COUCHSTORE_COMPACT_WITH_BLOOM_FILTER) ||
+         source->header.bloom_filter_pos || source->bloom_filter) &&
+        target->header.disk_version >= COUCH_DISK_VERSION_15) {
+        DbInfo info;
+        error_pass(couchstore_db_info(source, &info));
+        uint64_t entries = info.doc_count + info.deleted_count;
+        // Leave room for the file to grow before the next compaction.
+        entries += entries / 4;
+        if (entries < BLOOM_FILTER_MIN_ENTRIES) {
+            entries = BLOOM_FILTER_MIN_ENTRIES;
+        }
+        try {
+            target->bloom_filter = new BloomFilter(entries);
+        } catch (const std::bad_alloc&) {
+            error_pass(COUCHSTORE_ERROR_ALLOC_FAIL);
+        }
+    }
+
+    // Compress the document bodies with a dictionary trained from the
+    // source's if asked to, or else with the source's dictionary, which is
+    // copied along with the other local documents.
+    if (tree_file_doc_codec(&target->file) == COUCHSTORE_CODEC_ZSTD_DICT) {
+        if (flags & COUCHSTORE_COMPACT_TRAIN_DICTIONARY) {
+            error_pass(train_doc_dictionary(source, target));
+            ctx.new_dictionary = target->doc_dictionary != NULL;
+        }
+        if (!ctx.new_dictionary) {
+            error_pass(db_load_doc_dictionary(source));
+            if (source->doc_dictionary) {
+                const std::vector<char>& data =
+                        source->doc_dictionary->getData();
+                target->doc_dictionary =
+                        DocDictionary::create(data.data(), data.size());
+                error_unless(target->doc_dictionary,
+                             COUCHSTORE_ERROR_ALLOC_FAIL);
+            }
+        }
+        target->doc_dictionary_loaded = true;
+    }
+
     ctx.target = target;
+    // Overwrites the target's initial header, so the header chain starts
+    // again from the first one committed.
     target->file.pos = 1;
+    target->header.chain_restart = true;
     target->header.update_seq = source->header.update_seq;
     if (flags & COUCHSTORE_COMPACT_FLAG_DROP_DELETES) {
         //Count the number of times purge has happened
@@ -123,6 +230,16 @@ couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filen
                                                      {},
                                                      ctx.hook_ctx)));
     }
+    if (ctx.new_dictionary) {
+        const std::vector<char>& data = target->doc_dictionary->getData();
+        LocalDoc ldoc;
+        ldoc.id = {const_cast<char*>(DOC_DICTIONARY_ID),
+                   sizeof(DOC_DICTIONARY_ID) - 1};
+        ldoc.json = {const_cast<char*>(data.data()), data.size()};
+        ldoc.deleted = 0;
+        error_pass(db_save_local_document(target, &ldoc));
+    }
+    error_pass(db_write_bloom_filter(target, true));
     error_pass(couchstore_commit(target));
 cleanup:
     TreeWriterFree(ctx.tree_writer);
@@ -200,6 +317,9 @@ static couchstore_error_t output_seqtree_item(const sized_buf *k,
     memcpy(raw + 1, (uint8_t*)(rawSeq + 1) + idsize, revMetaSize); //Copy rev_meta
 
     error_pass(TreeWriterAddItem(ctx->tree_writer, id_k, id_v));
+    if (ctx->target->bloom_filter) {
+        ctx->target->bloom_filter->add(&id_k);
+    }
 
     if (ctx->target_mr->count == 0) {
         /* No items queued, we must have just flushed. We can safely rewind the transient arena. */
@@ -210,28 +330,356 @@ cleanup:
     return errcode;
 }
 
-static couchstore_error_t compact_seq_fetchcb(couchfile_lookup_request *rq,
-                                              const sized_buf *k,
-                                              const sized_buf *v)
+struct dictionary_samples {
+    std::vector<char> samples;
+    std::vector<size_t> sizes;
+    // Sample every stride'th compressed document body
+    uint64_t stride;
+    uint64_t skipped;
+};
+
+static int sample_doc_body(Db *db, DocInfo *info, void *ctx)
+{
+    dictionary_samples* samples = static_cast<dictionary_samples*>(ctx);
+    if (!(info->content_meta & COUCH_DOC_IS_COMPRESSED) ||
+        ++samples->skipped < samples->stride) {
+        return 0;
+    }
+    samples->skipped = 0;
+
+    Doc* doc = NULL;
+    couchstore_error_t errcode = couchstore_open_doc_with_docinfo(
+            db, info, &doc, DECOMPRESS_DOC_BODIES);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    try {
+        samples->samples.insert(samples->samples.end(), doc->data.buf,
+                                doc->data.buf + doc->data.size);
+        samples->sizes.push_back(doc->data.size);
+    } catch (const std::bad_alloc&) {
+        errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    couchstore_free_document(doc);
+    if (errcode == COUCHSTORE_SUCCESS &&
+        samples->samples.size() >= DOC_DICTIONARY_MAX_SAMPLE_BYTES) {
+        errcode = COUCHSTORE_ERROR_CANCEL;
+    }
+    return errcode;
+}
+
+/**
+ * Trains the target's document dictionary from a sample of the source's
+ * compressed document bodies, spread over the whole file. The target is
+ * left without one if it can't be trained, e.g. if there are too few.
+ */
+static couchstore_error_t train_doc_dictionary(Db* source, Db* target)
+{
+    couchstore_error_t errcode;
+    DbInfo info;
+    dictionary_samples samples;
+    error_pass(couchstore_db_info(source, &info));
+    samples.stride = info.doc_count / DOC_DICTIONARY_MAX_SAMPLES + 1;
+    samples.skipped = samples.stride - 1;
+
+    errcode = couchstore_changes_since(source, 0, COUCHSTORE_NO_DELETES,
+                                       sample_doc_body, &samples);
+    if (errcode == COUCHSTORE_ERROR_CANCEL) {
+        errcode = COUCHSTORE_SUCCESS;
+    }
+    error_pass(errcode);
+    target->doc_dictionary = DocDictionary::train(samples.samples,
+                                                  samples.sizes,
+                                                  DOC_DICTIONARY_SIZE);
+cleanup:
+    return errcode;
+}
+
+/**
+ * Recompresses a compressed document body into the target's document
+ * codec, if it was compressed with another (or with the dictionary this
+ * compaction replaces), updating the codec and size in its by-sequence
+ * index value (once written, see compact_seq_item()). 'body' is
+ * replaced by a malloced buffer.
+ */
+static couchstore_error_t convert_doc_body(compact_ctx *ctx,
+                                           raw_seq_index_value *rawSeq,
+                                           sized_buf *body,
+                                           bool *converted)
+{
+    couchstore_content_meta_flags content_meta =
+            decode_raw08(rawSeq->content_meta);
+    couchstore_codec from = db_body_codec(ctx->source, content_meta);
+    couchstore_codec to;
+    const DocDictionary* to_dict;
+    *converted = false;
+    couchstore_error_t errcode = db_doc_codec(ctx->target, &to, &to_dict);
+    if (errcode != COUCHSTORE_SUCCESS ||
+        !(content_meta & COUCH_DOC_IS_COMPRESSED) ||
+        (from == to && !(from == COUCHSTORE_CODEC_ZSTD_DICT &&
+                         ctx->new_dictionary))) {
+        return errcode;
+    }
+    if (from == COUCHSTORE_CODEC_ZSTD_DICT) {
+        errcode = db_load_doc_dictionary(ctx->source);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+    }
+
+    cb::compression::Buffer inflated;
+    cb::compression::Buffer deflated(cb::compression::Allocator{
+            cb::compression::Allocator::Mode::Malloc});
+    errcode = codec_inflate(from, ctx->source->doc_dictionary,
+                            {body->buf, body->size}, inflated);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = codec_deflate(to, to_dict,
+                                {inflated.data(), inflated.size()}, deflated);
+    }
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+
+    cb_free(body->buf);
+    body->size = deflated.size();
+    body->buf = deflated.release();
+    rawSeq->content_meta = encode_raw08(set_doc_codec(content_meta, to));
+    *converted = true;
+    return COUCHSTORE_SUCCESS;
+}
+
+namespace {
+
+/**
+ * A run of consecutive items of the source's by-sequence index, copied out
+ * of its nodes so that their document bodies can be read (see BodyReaders)
+ * ahead of copying the items to the target.
+ */
+struct compact_batch {
+    struct item {
+        size_t ksize;
+        size_t vsize;
+        // Position of the item's body, or 0 if it has none
+        cs_off_t bp;
+        // The body once read, and its length or a read error
+        char* body;
+        int body_len;
+    };
+
+    ~compact_batch() {
+        for (auto& it : items) {
+            cb_free(it.body);
+        }
+    }
+
+    // The items' keys and values, back to back
+    std::vector<char> kvs;
+    std::vector<item> items;
+    size_t body_bytes = 0;
+    enum class State { Queued, Reading, Read } state = State::Queued;
+};
+
+/**
+ * Reads the document bodies of the batches submitted to it on worker
+ * threads, each through its own snapshot of the source file (see
+ * tree_file_open_snapshot()), while the compacting thread copies earlier
+ * batches to the target in sequence order.
+ */
+class BodyReaders {
+public:
+    BodyReaders(tree_file* _source)
+        : source(_source), stopping(false), nfiles(0) {
+    }
+
+    ~BodyReaders() {
+        {
+            std::lock_guard<std::mutex> lh(mutex);
+            stopping = true;
+        }
+        work_cond.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (size_t ii = 0; ii < nfiles; ++ii) {
+            tree_file_close(&files[ii]);
+        }
+    }
+
+    /**
+     * Starts up to 'nthreads' workers, carrying on with fewer (even none,
+     * when wait() reads every batch itself) if threads can't be created.
+     */
+    couchstore_error_t start(size_t nthreads) {
+        files.reset(new (std::nothrow) tree_file[nthreads]());
+        if (!files) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        for (; nfiles < nthreads; ++nfiles) {
+            couchstore_error_t errcode =
+                    tree_file_open_snapshot(&files[nfiles], source);
+            if (errcode != COUCHSTORE_SUCCESS) {
+                return errcode;
+            }
+        }
+        try {
+            for (size_t ii = 0; ii < nfiles; ++ii) {
+                threads.emplace_back(&BodyReaders::run, this, &files[ii]);
+            }
+        } catch (const std::bad_alloc&) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        } catch (const std::system_error&) {
+            // Carry on with the threads we have.
+        }
+        return COUCHSTORE_SUCCESS;
+    }
+
+    void submit(compact_batch* batch) {
+        {
+            std::lock_guard<std::mutex> lh(mutex);
+            queue.push_back(batch);
+        }
+        work_cond.notify_one();
+    }
+
+    /**
+     * Waits for a submitted batch's bodies to be read, reading them on the
+     * calling thread if no worker has started to.
+     */
+    void wait(compact_batch* batch) {
+        std::unique_lock<std::mutex> lh(mutex);
+        if (batch->state == compact_batch::State::Queued) {
+            queue.erase(std::find(queue.begin(), queue.end(), batch));
+            batch->state = compact_batch::State::Reading;
+            lh.unlock();
+            read(source, batch);
+            batch->state = compact_batch::State::Read;
+            return;
+        }
+        done_cond.wait(lh, [batch]() {
+            return batch->state == compact_batch::State::Read;
+        });
+    }
+
+private:
+    void run(tree_file* file) {
+        std::unique_lock<std::mutex> lh(mutex);
+        for (;;) {
+            work_cond.wait(lh, [this]() {
+                return stopping || !queue.empty();
+            });
+            if (stopping) {
+                return;
+            }
+            compact_batch* batch = queue.front();
+            queue.pop_front();
+            batch->state = compact_batch::State::Reading;
+            lh.unlock();
+            read(file, batch);
+            lh.lock();
+            batch->state = compact_batch::State::Read;
+            done_cond.notify_all();
+        }
+    }
+
+    // Reads (and checks the checksums of) the batch's bodies.
+    static void read(tree_file* file, compact_batch* batch) {
+        ScopedFileTag tag(file->ops, file->handle, FileTag::Document);
+        for (auto& it : batch->items) {
+            if (it.bp != 0) {
+                it.body_len = pread_bin(file, it.bp, &it.body);
+            }
+        }
+    }
+
+    tree_file* source;
+    std::mutex mutex;
+    std::condition_variable work_cond;
+    std::condition_variable done_cond;
+    std::deque<compact_batch*> queue;
+    bool stopping;
+    std::unique_ptr<tree_file[]> files;
+    size_t nfiles;
+    std::vector<std::thread> threads;
+};
+
+} // anonymous namespace
+
+/**
+ * State of a compaction with COUCHSTORE_COMPACT_WITH_PARALLEL_READS. The
+ * readers are declared last so that they stop before the batches they may
+ * be reading are freed.
+ */
+struct compact_pipeline {
+    compact_pipeline(tree_file* source) : readers(source) {
+    }
+
+    // The batch the by-sequence index is being copied into
+    std::unique_ptr<compact_batch> filling;
+    // Batches submitted to the readers, in sequence order
+    std::deque<std::unique_ptr<compact_batch>> in_flight;
+    BodyReaders readers;
+};
+
+/**
+ * Copies an item of the source's by-sequence index, and its document body,
+ * to the target. The body is read from 'file' when needed, unless it was
+ * read ahead into 'prefetched'. 'v' is updated with the body's position in
+ * the target, so must be a copy of the source's value.
+ */
+/**
+ * Clears the codec bits of a compressed item's content_meta when upgrading
+ * a file older than COUCH_DISK_VERSION_17: its bodies are all compressed
+ * with Snappy, and the bits, which it leaves to the client, would be taken
+ * for another codec in the target.
+ */
+static void upgrade_content_meta(const compact_ctx *ctx,
+                                 raw_seq_index_value *rawSeq)
+{
+    couchstore_content_meta_flags content_meta =
+            decode_raw08(rawSeq->content_meta);
+    if (!ctx->source->file.codec_ids && ctx->target->file.codec_ids &&
+        (content_meta & COUCH_DOC_IS_COMPRESSED)) {
+        rawSeq->content_meta = encode_raw08(
+                set_doc_codec(content_meta, COUCHSTORE_CODEC_SNAPPY));
+    }
+}
+
+static couchstore_error_t compact_seq_item(compact_ctx *ctx,
+                                           tree_file *file,
+                                           const sized_buf *k,
+                                           sized_buf *v,
+                                           compact_batch::item *prefetched)
 {
     DocInfo* info = NULL;
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    compact_ctx *ctx = (compact_ctx *) rq->callback_ctx;
     raw_seq_index_value* rawSeq = (raw_seq_index_value*)v->buf;
     uint64_t bpWithDeleted = decode_raw48(rawSeq->bp);
     uint64_t bp = bpWithDeleted & ~BP_DELETED_FLAG;
     int ret_val = 0;
 
-    if ((bpWithDeleted & BP_DELETED_FLAG) &&
-       (ctx->hook == NULL) &&
-       (ctx->flags & COUCHSTORE_COMPACT_FLAG_DROP_DELETES)) {
-        return COUCHSTORE_SUCCESS;
-    }
-
     sized_buf item;
     item.buf = nullptr;
     item.size = 0xffffff;
 
+    // The by-id value is made from this too (see output_seqtree_item()).
+    upgrade_content_meta(ctx, rawSeq);
+
+    auto read_body = [file, bp, prefetched, &item]() {
+        int size;
+        if (prefetched) {
+            size = prefetched->body_len;
+            item.buf = prefetched->body;
+            prefetched->body = nullptr;
+        } else {
+            ScopedFileTag tag(file->ops, file->handle, FileTag::Document);
+            size = pread_bin(file, bp, &item.buf);
+        }
+        if (size >= 0) {
+            item.size = size_t(size);
+        }
+        return size;
+    };
+
     if (ctx->hook) {
         error_pass(by_seq_read_docinfo(&info, k, v));
         /* If the hook returns with the client requiring the whole body,
@@ -240,12 +688,11 @@ static couchstore_error_t compact_seq_fetchcb(couchfile_lookup_request *rq,
          */
         int hook_action = ctx->hook(ctx->target, info, item, ctx->hook_ctx);
         if (hook_action == COUCHSTORE_COMPACT_NEED_BODY) {
-            int size = pread_bin(rq->file, bp, &item.buf);
+            int size = read_body();
             if (size < 0) {
                 couchstore_free_docinfo(info);
                 return static_cast<couchstore_error_t>(size);
             }
-            item.size = size_t(size);
             hook_action = ctx->hook(ctx->target, info, item, ctx->hook_ctx);
         }
 
@@ -269,23 +716,32 @@ static couchstore_error_t compact_seq_fetchcb(couchfile_lookup_request *rq,
         size_t new_size = 0;
 
         if (item.buf == nullptr) {
-            int size = pread_bin(rq->file, bp, &item.buf);
+            int size = read_body();
             if (size < 0) {
                 couchstore_free_docinfo(info);
                 return static_cast<couchstore_error_t>(size);
             }
-            item.size = size_t(size);
         }
 
         if (ctx->dhook) {
             ret_val = ctx->dhook(&info, &item);
         }
+        bool converted = false;
+        if (ctx->flags & (COUCHSTORE_COMPACT_CONVERT_DOC_BODIES |
+                          COUCHSTORE_COMPACT_TRAIN_DICTIONARY)) {
+            error_pass(convert_doc_body(ctx, rawSeq, &item, &converted));
+        }
         int err = db_write_buf(ctx->target_mr->rq->file, &item, &new_bp,
                                &new_size);
 
         bpWithDeleted = (bpWithDeleted & BP_DELETED_FLAG) | new_bp;  //Preserve high bit
         encode_raw48(bpWithDeleted, &rawSeq->bp);
         error_pass(static_cast<couchstore_error_t>(err));
+        if (converted) {
+            uint32_t idsize, datasize;
+            decode_kv_length(&rawSeq->sizes, &idsize, &datasize);
+            rawSeq->sizes = encode_kv_length(idsize, new_size);
+        }
     }
 
     if (ret_val) {
@@ -300,6 +756,114 @@ cleanup:
     return errcode;
 }
 
+// Whether an item is left out of the target without calling the hook
+static bool drop_seq_item(const compact_ctx *ctx, const sized_buf *v)
+{
+    const raw_seq_index_value* rawSeq = (const raw_seq_index_value*)v->buf;
+    return (decode_raw48(rawSeq->bp) & BP_DELETED_FLAG) &&
+           (ctx->hook == NULL) &&
+           (ctx->flags & COUCHSTORE_COMPACT_FLAG_DROP_DELETES);
+}
+
+static couchstore_error_t compact_seq_fetchcb(couchfile_lookup_request *rq,
+                                              const sized_buf *k,
+                                              const sized_buf *v)
+{
+    compact_ctx *ctx = (compact_ctx *) rq->callback_ctx;
+    if (drop_seq_item(ctx, v)) {
+        return COUCHSTORE_SUCCESS;
+    }
+    // The value is updated for the target, so copy it out of the node,
+    // which may be shared with the source's node cache.
+    sized_buf *v_copy = arena_copy_buf(ctx->transient_arena, v);
+    if (v_copy == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    return compact_seq_item(ctx, rq->file, k, v_copy, NULL);
+}
+
+// Copies the oldest batch in flight to the target, once its bodies are read.
+static couchstore_error_t write_oldest_batch(compact_ctx *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    compact_pipeline* pipeline = ctx->pipeline;
+    std::unique_ptr<compact_batch> batch =
+            std::move(pipeline->in_flight.front());
+    pipeline->in_flight.pop_front();
+    pipeline->readers.wait(batch.get());
+
+    size_t pos = 0;
+    for (auto& it : batch->items) {
+        sized_buf k = {&batch->kvs[pos], it.ksize};
+        sized_buf v = {&batch->kvs[pos + it.ksize], it.vsize};
+        pos += it.ksize + it.vsize;
+        error_pass(compact_seq_item(ctx, NULL, &k, &v, &it));
+    }
+cleanup:
+    return errcode;
+}
+
+/**
+ * Submits the batch being filled to the readers, then copies the oldest
+ * batches to the target while more than COMPACT_BATCHES_AHEAD are in
+ * flight, or all of them if 'drain'.
+ */
+static couchstore_error_t submit_batch(compact_ctx *ctx, bool drain)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    compact_pipeline* pipeline = ctx->pipeline;
+    if (pipeline->filling) {
+        try {
+            pipeline->in_flight.push_back(std::move(pipeline->filling));
+        } catch (const std::bad_alloc&) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        pipeline->readers.submit(pipeline->in_flight.back().get());
+    }
+    while (!pipeline->in_flight.empty() &&
+           (drain || pipeline->in_flight.size() > COMPACT_BATCHES_AHEAD)) {
+        error_pass(write_oldest_batch(ctx));
+    }
+cleanup:
+    return errcode;
+}
+
+static couchstore_error_t compact_seq_fetchcb_parallel(
+        couchfile_lookup_request *rq, const sized_buf *k, const sized_buf *v)
+{
+    compact_ctx *ctx = (compact_ctx *) rq->callback_ctx;
+    if (drop_seq_item(ctx, v)) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    const raw_seq_index_value* rawSeq = (const raw_seq_index_value*)v->buf;
+    uint32_t idsize, datasize;
+    decode_kv_length(&rawSeq->sizes, &idsize, &datasize);
+    compact_pipeline* pipeline = ctx->pipeline;
+    try {
+        if (!pipeline->filling) {
+            pipeline->filling.reset(new compact_batch);
+        }
+        compact_batch* batch = pipeline->filling.get();
+        // The batch's own copy of the item is what compact_seq_item() is
+        // given, so 'v' (which may be a cached node's) is left as it is.
+        batch->kvs.insert(batch->kvs.end(), k->buf, k->buf + k->size);
+        batch->kvs.insert(batch->kvs.end(), v->buf, v->buf + v->size);
+        batch->items.push_back({k->size, v->size,
+                                cs_off_t(decode_raw48(rawSeq->bp) &
+                                         ~BP_DELETED_FLAG),
+                                nullptr, 0});
+        batch->body_bytes += datasize;
+        if (batch->items.size() < COMPACT_BATCH_ITEMS &&
+            batch->body_bytes < COMPACT_BATCH_BYTES) {
+            return COUCHSTORE_SUCCESS;
+        }
+    } catch (const std::bad_alloc&) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    return submit_batch(ctx, false);
+}
+
 static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *ctx)
 {
     couchstore_error_t errcode;
@@ -325,6 +889,12 @@ static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *
         error_pass(COUCHSTORE_ERROR_ALLOC_FAIL);
     }
 
+    if (ctx->flags & COUCHSTORE_COMPACT_WITH_PARALLEL_READS) {
+        ctx->pipeline = new (std::nothrow) compact_pipeline(&source->file);
+        error_unless(ctx->pipeline, COUCHSTORE_ERROR_ALLOC_FAIL);
+        error_pass(ctx->pipeline->readers.start(COMPACT_READ_THREADS));
+    }
+
     srcfold.cmp = seqcmp;
     srcfold.file = &source->file;
     srcfold.num_keys = 1;
@@ -334,11 +904,18 @@ static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *
     srcfold.tolerate_corruption =
             (ctx->flags & COUCHSTORE_COMPACT_RECOVERY_MODE) != 0;
     srcfold.callback_ctx = ctx;
-    srcfold.fetch_callback = compact_seq_fetchcb;
+    srcfold.fetch_callback = ctx->pipeline ? compact_seq_fetchcb_parallel
+                                           : compact_seq_fetchcb;
     srcfold.node_callback = NULL;
 
     errcode = btree_lookup(&srcfold, source->header.by_seq_root->pointer);
     if (errcode == COUCHSTORE_SUCCESS || srcfold.tolerate_corruption) {
+        if (ctx->pipeline) {
+            // Copy the batches still in flight, keeping any error the scan
+            // tolerated.
+            couchstore_error_t copy_err = submit_batch(ctx, true);
+            error_unless(copy_err == COUCHSTORE_SUCCESS, copy_err);
+        }
         if(target->header.by_seq_root != nullptr) {
             cb_free(target->header.by_seq_root);
         }
@@ -348,6 +925,8 @@ static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *
         error_tolerate(errcode_local);
     }
 cleanup:
+    delete ctx->pipeline;
+    ctx->pipeline = NULL;
     arena_free_all(ctx->persistent_arena);
     arena_free_all(ctx->transient_arena);
     return errcode;
@@ -248,7 +248,8 @@ static void rewind_and_get_stale_data(rewind_request& rq) {
     Db *db = nullptr;
 
     errcode = couchstore_open_db_ex(rq.options->src_filename.c_str(),
-                                    COUCHSTORE_OPEN_FLAG_RDONLY,
+                                    COUCHSTORE_OPEN_FLAG_RDONLY |
+                                    COUCHSTORE_OPEN_FLAG_MMAP,
                                     couchstore_get_default_file_ops(),
                                     &db);
 
@@ -317,14 +318,16 @@ static int recover_file(recovery_options& options) {
 
     // Open source file.
     errcode = couchstore_open_db_ex(options.src_filename.c_str(),
-                                    COUCHSTORE_OPEN_FLAG_RDONLY,
+                                    COUCHSTORE_OPEN_FLAG_RDONLY |
+                                    COUCHSTORE_OPEN_FLAG_MMAP,
                                     couchstore_get_default_file_ops(),
                                     &db_src);
     error_pass(errcode);
 
     // Open source file for rewind.
     errcode = couchstore_open_db_ex(options.src_filename.c_str(),
-                                    COUCHSTORE_OPEN_FLAG_RDONLY,
+                                    COUCHSTORE_OPEN_FLAG_RDONLY |
+                                    COUCHSTORE_OPEN_FLAG_MMAP,
                                     couchstore_get_default_file_ops(),
                                     &db_src_alt);
     error_pass(errcode);
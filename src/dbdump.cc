@@ -527,6 +527,7 @@ static int process_vbucket_file(const char *file, int *total)
         trackingFileOps = new TrackingFileOps();
         errcode = couchstore_open_db_ex(file, flags, trackingFileOps, &db);
     } else {
+        flags |= COUCHSTORE_OPEN_FLAG_MMAP;
         errcode = couchstore_open_db(file, flags, &db);
     }
     if (errcode != COUCHSTORE_SUCCESS) {
@@ -44,7 +44,10 @@ static int process_file(const char *file, int iterate_headers)
                                   "CRC-32",
                                   "CRC-32C"};
 
-    errcode = couchstore_open_db(file, COUCHSTORE_OPEN_FLAG_RDONLY, &db);
+    errcode = couchstore_open_db(file,
+                                 COUCHSTORE_OPEN_FLAG_RDONLY |
+                                 COUCHSTORE_OPEN_FLAG_MMAP,
+                                 &db);
     if (errcode != COUCHSTORE_SUCCESS) {
         fprintf(stderr, "Failed to open \"%s\": %s\n",
                 file, couchstore_strerror(errcode));
@@ -0,0 +1,207 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+#include "internal.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "couch_latency_internal.h"
+
+namespace {
+
+// A batch of documents submitted by one caller, waiting to be committed.
+struct group_commit_batch {
+    Doc* const* docs;
+    DocInfo** infos;
+    unsigned numDocs;
+    couchstore_save_options options;
+    couchstore_error_t result;
+    bool done;
+};
+
+} // anonymous namespace
+
+struct _group_commit {
+    _group_commit(Db* _db) : db(_db), committing(false) {
+    }
+
+    Db* db;
+    std::mutex mutex;
+    std::condition_variable cond;
+    // Batches submitted since the current (or last) commit started.
+    std::vector<group_commit_batch*> pending;
+    // Whether a caller is saving and committing a group of batches.
+    bool committing;
+};
+
+// Returns true if the batch saves any document ID in 'ids'.
+static bool saves_any_id(const std::unordered_set<std::string>& ids,
+                         const group_commit_batch* batch) {
+    for (unsigned ii = 0; ii < batch->numDocs; ++ii) {
+        const sized_buf& id = batch->infos[ii]->id;
+        if (ids.count(std::string(id.buf, id.size))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void add_ids(std::unordered_set<std::string>& ids,
+                    const group_commit_batch* batch) {
+    for (unsigned ii = 0; ii < batch->numDocs; ++ii) {
+        const sized_buf& id = batch->infos[ii]->id;
+        ids.emplace(id.buf, id.size);
+    }
+}
+
+// Saves batches [first, last) in one call, setting their results.
+static void save_batches(Db* db,
+                         std::vector<group_commit_batch*>& batches,
+                         size_t first,
+                         size_t last,
+                         std::vector<Doc*>& docs,
+                         std::vector<DocInfo*>& infos) {
+    couchstore_error_t err = COUCHSTORE_SUCCESS;
+    if (!infos.empty()) {
+        err = couchstore_save_documents(db, docs.data(), infos.data(),
+                                        infos.size(),
+                                        batches[first]->options);
+    }
+    for (size_t ii = first; ii < last; ++ii) {
+        batches[ii]->result = err;
+    }
+    docs.clear();
+    infos.clear();
+}
+
+/**
+ * Saves the batches with as few couchstore_save_documents() calls as
+ * possible, then commits once, setting each batch's result.
+ * A new call is started when the save options change, or when a batch
+ * saves an ID already saved by the current call, so that the later save
+ * of the ID wins as it would if the batches were saved one by one.
+ */
+static void save_and_commit(Db* db, std::vector<group_commit_batch*>& batches)
+{
+    try {
+        std::vector<Doc*> docs;
+        std::vector<DocInfo*> infos;
+        std::unordered_set<std::string> ids;
+        size_t first = 0;
+        for (size_t ii = 0; ii < batches.size(); ++ii) {
+            const group_commit_batch* batch = batches[ii];
+            if (ii > first && (batch->options != batches[first]->options ||
+                               saves_any_id(ids, batch))) {
+                save_batches(db, batches, first, ii, docs, infos);
+                ids.clear();
+                first = ii;
+            }
+            add_ids(ids, batch);
+            for (unsigned jj = 0; jj < batch->numDocs; ++jj) {
+                // A batch without docs deletes its infos' documents, as
+                // couchstore_save_documents() does when given NULL docs.
+                docs.push_back(batch->docs ? batch->docs[jj] : NULL);
+                infos.push_back(batch->infos[jj]);
+            }
+        }
+        save_batches(db, batches, first, batches.size(), docs, infos);
+    } catch (const std::bad_alloc&) {
+        for (auto* batch : batches) {
+            if (batch->result == COUCHSTORE_SUCCESS) {
+                batch->result = COUCHSTORE_ERROR_ALLOC_FAIL;
+            }
+        }
+        return;
+    }
+
+    couchstore_error_t err = couchstore_commit(db);
+    for (auto* batch : batches) {
+        if (batch->result == COUCHSTORE_SUCCESS) {
+            batch->result = err;
+        }
+    }
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_group_commit(Db* db, GroupCommit** pGroup)
+{
+    if (db->dropped) {
+        return COUCHSTORE_ERROR_FILE_CLOSED;
+    }
+    GroupCommit* group = new (std::nothrow) GroupCommit(db);
+    if (!group) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    *pGroup = group;
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_group_commit_save_documents(
+        GroupCommit* group,
+        Doc* const docs[],
+        DocInfo* infos[],
+        unsigned numDocs,
+        couchstore_save_options options)
+{
+    COLLECT_LATENCY();
+
+    group_commit_batch batch = {docs, infos, numDocs, options,
+                                COUCHSTORE_SUCCESS, false};
+
+    std::unique_lock<std::mutex> lh(group->mutex);
+    try {
+        group->pending.push_back(&batch);
+    } catch (const std::bad_alloc&) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    // Wait for the batch to be committed by whoever is committing, unless
+    // nobody is: then commit it, along with everything else pending.
+    group->cond.wait(lh, [group, &batch]() {
+        return batch.done || !group->committing;
+    });
+    if (!batch.done) {
+        std::vector<group_commit_batch*> batches;
+        batches.swap(group->pending);
+        group->committing = true;
+        lh.unlock();
+
+        save_and_commit(group->db, batches);
+
+        lh.lock();
+        for (auto* committed : batches) {
+            committed->done = true;
+        }
+        group->committing = false;
+        group->cond.notify_all();
+    }
+    return batch.result;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_free_group_commit(GroupCommit* group)
+{
+    delete group;
+    return COUCHSTORE_SUCCESS;
+}
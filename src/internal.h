@@ -16,14 +16,65 @@
 #define COUCH_BLOCK_SIZE 4096
 #define COUCH_DISK_VERSION_11 11
 #define COUCH_DISK_VERSION_12 12
-#define COUCH_DISK_VERSION COUCH_DISK_VERSION_12
+#define COUCH_DISK_VERSION_13 13
+#define COUCH_DISK_VERSION_14 14
+#define COUCH_DISK_VERSION_15 15
+#define COUCH_DISK_VERSION_16 16
+#define COUCH_DISK_VERSION_17 17
+#define COUCH_DISK_VERSION COUCH_DISK_VERSION_17
 #define COUCH_SNAPPY_THRESHOLD 64
 #define MAX_DB_HEADER_SIZE 1024    /* Conservative estimate; just for sanity check */
+// Largest window the file is read backwards in, looking for a header
+#define HEADER_SEARCH_WINDOW (1024*1024)
 
 // Default values for buffered IO
 #define MAX_READ_BUFFERS 16
 #define WRITE_BUFFER_CAPACITY (128*1024)
+#define BACKGROUND_FLUSH_WRITE_BUFFERS 2
 #define READ_BUFFER_CAPACITY (4*1024)
+#define DOCUMENT_READ_BUFFER_CAPACITY (64*1024)
+#define MAX_READAHEAD (1024*1024)
+#define READAHEAD_MIN_READS 4
+
+// Read-ahead during B-tree scans, if enabled: number of upcoming child
+// nodes to advise, and the extent advised for each.
+#define PREFETCH_CHILDREN 8
+#define PREFETCH_NODE_EXTENT (2*COUCH_BLOCK_SIZE)
+
+// Compression of document bodies on worker threads, if enabled: most
+// threads used by one save, including the caller's and those of the
+// process-wide pool, and fewest documents worth a thread.
+#define MAX_COMPRESSION_THREADS 8
+#define MIN_DOCS_PER_COMPRESSION_THREAD 16
+
+// Compaction with COUCHSTORE_COMPACT_WITH_PARALLEL_READS: threads reading
+// document bodies, most items (and bytes of bodies) in a batch read by one
+// thread, and most batches read ahead of the one being copied.
+#define COMPACT_READ_THREADS 4
+#define COMPACT_BATCH_ITEMS 256
+#define COMPACT_BATCH_BYTES (1024*1024)
+#define COMPACT_BATCHES_AHEAD 16
+
+// Address space reserved past the end of a memory-mapped file for it to
+// grow into (see os_mmap.cc): as much as the file's size, within these
+// bounds.
+#define MMAP_MIN_HEADROOM (1024*1024)
+#define MMAP_MAX_HEADROOM (sizeof(void*) >= 8 ? (size_t(1) << 30) \
+                                              : (size_t(1) << 26))
+
+// Size of each Db's cache of by-sequence nodes decoded for counting changes
+#define SEQ_COUNT_CACHE_SIZE (16*1024)
+
+// Compression level of COUCHSTORE_CODEC_ZSTD(_DICT)
+#define ZSTD_COMPRESSION_LEVEL 3
+
+// Dictionaries trained for document bodies: local document they're kept
+// in, most bytes of a dictionary, and most document bodies (and bytes of
+// them) sampled to train one.
+#define DOC_DICTIONARY_ID "_local/_couchstore_doc_dictionary"
+#define DOC_DICTIONARY_SIZE (32*1024)
+#define DOC_DICTIONARY_MAX_SAMPLES 4096
+#define DOC_DICTIONARY_MAX_SAMPLE_BYTES (4*1024*1024)
 
 #ifdef WIN32
 #define PATH_MAX MAX_PATH
@@ -33,6 +84,11 @@
 #define PATH_MAX 1024
 #endif
 
+class BloomFilter;
+class DocDictionary;
+class NodeCache;
+class RightSpine;
+
 typedef struct {
     uint64_t purge_before_ts;
     uint64_t purge_before_seq;
@@ -49,9 +105,18 @@ extern "C" {
             buf_io_enabled(true),
             buf_io_read_unit_size(READ_BUFFER_CAPACITY),
             buf_io_read_buffers(MAX_READ_BUFFERS),
+            buf_io_shared_cache(false),
+            buf_io_write_buffers(1),
+            buf_io_write_buffer_size(WRITE_BUFFER_CAPACITY),
+            buf_io_document_read_size(DOCUMENT_READ_BUFFER_CAPACITY),
             kp_nodesize(0),
             kv_nodesize(0),
-            periodic_sync_bytes(0)
+            periodic_sync_bytes(0),
+            node_cache_capacity(0),
+            mmap_enabled(false),
+            prefetch_children(0),
+            node_codec(COUCHSTORE_CODEC_SNAPPY),
+            doc_codec(COUCHSTORE_CODEC_SNAPPY)
             { }
 
         // Flag indicating whether or not buffered IO is enabled.
@@ -62,6 +127,17 @@ extern "C" {
         // Max count of read buffers, if buffered IO is enabled.
         // Set to zero for the default value.
         uint32_t buf_io_read_buffers;
+        // Flag indicating whether or not reads go through the process-wide
+        // shared block cache, if buffered IO is enabled.
+        bool buf_io_shared_cache;
+        // Number of write buffers, if buffered IO is enabled. With more than
+        // one, full buffers are written out on a background thread.
+        uint32_t buf_io_write_buffers;
+        // Capacity of each write buffer, if buffered IO is enabled.
+        uint32_t buf_io_write_buffer_size;
+        // Capacity of the buffer for reads of document bodies, if buffered
+        // IO is enabled.
+        uint32_t buf_io_document_read_size;
         // Threshold of key-pointer (intermediate) node size.
         uint32_t kp_nodesize;
         // Threshold of key-value (leaf) node size.
@@ -69,6 +145,20 @@ extern "C" {
         // Automatically issue an sync() operation after every N bytes written.
         // 0 means don't automatically sync.
         uint64_t periodic_sync_bytes;
+        // Memory budget for decoded B+tree nodes, in bytes.
+        // 0 means no node cache.
+        uint64_t node_cache_capacity;
+        // Flag indicating whether or not a read-only file opened with the
+        // default file ops is read through a memory mapping instead.
+        bool mmap_enabled;
+        // Number of upcoming child nodes to advise the file ops of while
+        // scanning a B-tree. 0 means no read-ahead.
+        uint32_t prefetch_children;
+        // Codec B-tree nodes are compressed with, if the file records
+        // codecs (see tree_file::codec_ids).
+        couchstore_codec node_codec;
+        // Codec document bodies are compressed with, likewise.
+        couchstore_codec doc_codec;
     };
 
      /* Structure representing an open file; "superclass" of Db */
@@ -79,7 +169,19 @@ extern "C" {
         const char* path;
         couchstore_error_info_t lastError;
         crc_mode_e crc_mode;
+        /* Write B-tree nodes with an offset directory (disk version 13+) */
+        bool node_directory;
+        /* Write B-tree nodes with prefix-compressed keys (disk version 14+) */
+        bool node_prefix;
+        /* Record the codec of each compressed B-tree node and document
+         * body, and compress with the codecs in 'options' (disk
+         * version 17+) */
+        bool codec_ids;
         tree_file_options options;
+        NodeCache* node_cache;
+        /* Opened by tree_file_open_snapshot(): the node cache belongs to
+         * the source file */
+        bool snapshot;
     } tree_file;
 
     typedef struct _nodepointer {
@@ -89,6 +191,19 @@ extern "C" {
         uint64_t subtreesize;
     } node_pointer;
 
+    /*
+     * Links from a header to earlier ones (disk version 16+). 'height' is the
+     * number of headers before this one in the chain; 'prev_pos' is the
+     * position of the header at height - 1 and 'skip_pos' that of the one at
+     * height & (height - 1), so that any earlier header can be reached in a
+     * logarithmic number of steps. Both are unset when height is 0.
+     */
+    typedef struct {
+        uint64_t height;
+        uint64_t prev_pos;
+        uint64_t skip_pos;
+    } header_chain;
+
     typedef struct _db_header {
         uint64_t disk_version;
         uint64_t update_seq;
@@ -98,6 +213,17 @@ extern "C" {
         uint64_t purge_seq;
         uint64_t purge_ptr;
         uint64_t position;
+        /* Bloom filter chunk (disk version 15+), 0 if there is none */
+        uint64_t bloom_filter_pos;
+        /* update_seq the Bloom filter chunk is complete up to */
+        uint64_t bloom_filter_seq;
+        header_chain chain;
+        /* Codec document bodies are compressed with (disk version 17+),
+         * which opening the file defaults to */
+        couchstore_codec doc_codec;
+        /* Set when the next header can't link to the current one, which
+         * isn't in the file (see compaction) */
+        bool chain_restart;
     } db_header;
 
     struct _db {
@@ -105,6 +231,17 @@ extern "C" {
         db_header header;
         int dropped;
         void *userdata;
+        /* Loaded on first use, see bloom_filter.h */
+        BloomFilter *bloom_filter;
+        /* IDs added to the Bloom filter since it was last written */
+        uint64_t bloom_filter_pending;
+        /* Right edge of the by-sequence tree, kept between saves */
+        RightSpine *seq_spine;
+        /* By-sequence nodes decoded by couchstore_changes_count() */
+        NodeCache *seq_count_cache;
+        /* Loaded on first use, see codec.h; NULL if the file has none */
+        DocDictionary *doc_dictionary;
+        bool doc_dictionary_loaded;
     };
 
     /**
@@ -117,6 +254,13 @@ extern "C" {
     LIBCOUCHSTORE_API
     FileOpsInterface* create_default_file_ops(void);
 
+    /**
+     * Returns the FileOpsInterface implementation which serves reads of
+     * a read-only file from a memory mapping of it, or NULL if memory
+     * mapped files aren't supported on this platform.
+     */
+    FileOpsInterface* couch_get_mmap_file_ops(void);
+
     /** Opens or creates a tree_file.
         @param file  Pointer to tree_file struct to initialize.
         @param filename  Path to the file
@@ -131,6 +275,18 @@ extern "C" {
                                       crc_mode_e crc_mode,
                                       FileOpsInterface* ops,
                                       tree_file_options options);
+    /** Opens a read-only tree_file on the same open file as another, which
+        may be used from another thread than the source (see
+        couch_get_snapshot_file_ops()), and shares its node cache.
+        @param file  Pointer to tree_file struct to initialize.
+        @param source  Open tree_file, which must stay open for as long as
+               'file' is */
+    couchstore_error_t tree_file_open_snapshot(tree_file* file,
+                                               tree_file* source);
+    /** Selects the B-tree node format written to a tree_file.
+        @param file  Pointer to open tree_file
+        @param disk_version  Disk version of the file */
+    void tree_file_set_disk_version(tree_file* file, uint64_t disk_version);
     /** Closes a tree_file.
         @param file  Pointer to open tree_file. Does not free this pointer! */
     couchstore_error_t tree_file_close(tree_file* file);
@@ -144,10 +300,35 @@ extern "C" {
         @return The length of the chunk (zero is a valid length!), or a negative error code */
     int pread_bin(tree_file *file, cs_off_t pos, char **ret_ptr);
 
-    /** Reads a compressed chunk from the file at a given position.
+    /** Reads a compressed chunk (a B-tree node) from the file at a given
+        position.
         Parameters and return value are the same as for pread_bin. */
     int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr);
 
+    /** Reads a compressed document body from the file at a given position.
+        @param codec The codec the body was compressed with, from its
+               content_meta
+        @param dict The file's document dictionary, if it has one
+        Other parameters and return value are the same as for pread_bin. */
+    int pread_compressed_doc(tree_file *file,
+                             cs_off_t pos,
+                             couchstore_codec codec,
+                             const DocDictionary *dict,
+                             char **ret_ptr);
+
+    /** Reads several compressed chunks at once, letting the file ops
+        issue the reads concurrently (see FileOpsInterface::pread_batch).
+        @param count Number of chunks to read
+        @param pos The byte positions to read from
+        @param ret_ptrs Set as by pread_compressed, for each chunk
+        @param ret_lens Set to what pread_compressed would return, for each
+                chunk */
+    void pread_compressed_batch(tree_file *file,
+                                size_t count,
+                                const cs_off_t *pos,
+                                char **ret_ptrs,
+                                int *ret_lens);
+
     /** Reads a file header from the file at a given position.
         Parameters and return value are the same as for pread_bin. */
     int pread_header(tree_file *file,
@@ -165,6 +346,9 @@ extern "C" {
 
     couchstore_error_t precommit(Db *db);
     couchstore_error_t db_write_header(Db *db);
+    /** Saves a local document, like couchstore_save_local_document(),
+        but also under the identifiers reserved for couchstore itself. */
+    couchstore_error_t db_save_local_document(Db *db, LocalDoc *lDoc);
 
 #ifdef __cplusplus
 }
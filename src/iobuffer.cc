@@ -21,8 +21,16 @@
 
 #include <algorithm>
 #include <boost/intrusive/list.hpp>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <new>
+#include <system_error>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
@@ -30,6 +38,7 @@
 #include <platform/make_unique.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 // Uncomment to enable debug logging of buffer operations.
 // #define LOG_BUFFER 1
@@ -82,6 +91,8 @@ using FileBufferList = boost::intrusive::list<file_buffer, ListMember>;
 using FileBufferMap = std::unordered_map<size_t, UniqueFileBufferPtr>;
 
 class ReadBufferManager;
+class BackgroundFlusher;
+struct shared_cache_file;
 
 // How I interpret a couch_file_handle:
 struct buffered_file_handle {
@@ -90,16 +101,37 @@ struct buffered_file_handle {
     unsigned nbuffers;
     UniqueFileBufferPtr write_buffer;
     ReadBufferManager *read_buffer_mgr;
+    // Buffer for reads of document bodies, allocated on first use.
+    UniqueFileBufferPtr document_buffer;
+    // What subsequent reads are for, as set by tag().
+    FileTag tag;
+    // Entry of this file in the shared block cache, or NULL if the handle
+    // uses its own read buffers.
+    shared_cache_file *shared_file;
+    // Writes out full write buffers in the background, or NULL if they are
+    // written out synchronously.
+    std::unique_ptr<BackgroundFlusher> flusher;
     buffered_file_ops_params params;
 };
 
 /**
  * Class for management of LRU list and hash index for read buffers.
  * All buffer instances are tracked by using shared pointers.
+ *
+ * It also detects reads streaming forward through the file (e.g. scanning
+ * a B-tree that was written in one go), which are then served by reading
+ * ahead into a separate, growing buffer rather than one read buffer at a
+ * time.
  */
 class ReadBufferManager {
 public:
-    ReadBufferManager() : nBuffers(0) {
+    ReadBufferManager()
+        : nBuffers(0),
+          streamOffset(0),
+          streamEnd(0),
+          streamReads(0),
+          outsideReads(0),
+          readaheadSize(0) {
     }
 
     ~ReadBufferManager() {
@@ -157,6 +189,19 @@ public:
         return buffer;
     }
 
+    // Returns the buffer for this offset if there is one, without
+    // creating or recycling any.
+    file_buffer* lookupBuffer(buffered_file_handle* h, cs_off_t offset) {
+        offset = offset - offset % h->params.read_buffer_capacity;
+        auto itr_map = readMap.find(offset);
+        if (itr_map == readMap.end()) {
+            return nullptr;
+        }
+        file_buffer* buffer = itr_map->second.get();
+        readLRU.splice(readLRU.begin(), readLRU, readLRU.iterator_to(*buffer));
+        return buffer;
+    }
+
     void relocateBuffer(cs_off_t old_offset, cs_off_t new_offset) {
         auto itr = readMap.find(old_offset);
         if (itr == readMap.end()) {
@@ -170,6 +215,69 @@ public:
         readMap.insert( std::make_pair(new_offset, std::move(tmp)) );
     }
 
+    /**
+     * Records a read of 'nbyte' bytes at 'offset', returning true if it
+     * should be served by reading ahead.
+     * Reads form a stream once READAHEAD_MIN_READS of them in a row each
+     * start within the current readahead size of the previous one (or in
+     * data already read ahead). That allows for short jumps back, as a
+     * B-tree scan makes from a parent node to its children, written out
+     * just before it. Once a stream is established, fewer than
+     * READAHEAD_MIN_READS reads in a row elsewhere (e.g. of the parent
+     * nodes themselves) don't end it; any more do, and the readahead size
+     * drops back to the read buffer capacity.
+     */
+    bool trackRead(buffered_file_handle* h, cs_off_t offset, size_t nbyte) {
+        const size_t unit = h->params.read_buffer_capacity;
+        const cs_off_t gap = std::max(readaheadSize, unit);
+        const bool in_readahead = readahead &&
+                offset >= readahead->offset &&
+                offset < readahead->offset + (cs_off_t)readahead->length;
+        if (in_readahead || (streamEnd != 0 && offset >= streamOffset - gap &&
+                             offset <= streamEnd + gap)) {
+            ++streamReads;
+            outsideReads = 0;
+        } else if (streamReads < READAHEAD_MIN_READS ||
+                   ++outsideReads >= READAHEAD_MIN_READS) {
+            // Start looking for a stream from here.
+            streamReads = 0;
+            outsideReads = 0;
+            readaheadSize = unit;
+        } else {
+            return false;
+        }
+        streamOffset = offset;
+        streamEnd = offset + nbyte;
+        return streamReads >= READAHEAD_MIN_READS &&
+               unit * 2 <= MAX_READAHEAD;
+    }
+
+    // Returns the readahead buffer, or NULL if nothing has been read ahead.
+    file_buffer* readaheadBuffer() {
+        return readahead.get();
+    }
+
+    /**
+     * Doubles the readahead size (up to MAX_READAHEAD) and returns the
+     * readahead buffer, sized to match, or NULL if it can't be allocated.
+     */
+    file_buffer* growReadahead(buffered_file_handle* h) {
+        const size_t unit = h->params.read_buffer_capacity;
+        readaheadSize = std::min(std::max(readaheadSize, unit) * 2,
+                                 size_t(MAX_READAHEAD));
+        try {
+            if (!readahead) {
+                readahead = std::make_unique<file_buffer>(h, readaheadSize);
+            } else if (readahead->bytes.size() < readaheadSize) {
+                readahead->bytes.resize(readaheadSize);
+            }
+        } catch (const std::bad_alloc&) {
+            return nullptr;
+        }
+        readahead->capacity = readaheadSize;
+        return readahead.get();
+    }
+
 private:
     // LRU list for buffers.
     FileBufferList readLRU;
@@ -177,6 +285,261 @@ private:
     FileBufferMap readMap;
     // Number of buffers allocated.
     size_t nBuffers;
+    // Offset and end of the last read in the current stream.
+    cs_off_t streamOffset;
+    cs_off_t streamEnd;
+    // Number of reads in the current stream.
+    size_t streamReads;
+    // Number of reads in a row outside the current stream.
+    size_t outsideReads;
+    // Number of bytes to read ahead next time.
+    size_t readaheadSize;
+    // Buffer for reading ahead, allocated on first use.
+    UniqueFileBufferPtr readahead;
+};
+
+// Identifies a file in the shared block cache: device and inode number, so
+// that every handle on the same file shares blocks. 'unique' is non-zero
+// for files which could not be reliably identified; those get an entry of
+// their own which is never shared.
+using FileIdentity = std::tuple<uint64_t, uint64_t, uint64_t>;
+
+struct shared_block {
+    shared_block(shared_cache_file* _file, cs_off_t _offset, size_t _capacity)
+        : file(_file),
+          offset(_offset),
+          length(0) {
+        bytes.resize(_capacity);
+    }
+
+    // Hook for intrusive list.
+    boost::intrusive::list_member_hook<> _lru_hook;
+    // File this block belongs to.
+    shared_cache_file* file;
+    // Starting (aligned) offset of block.
+    cs_off_t offset;
+    // Length of valid data; less than capacity at the end of the file.
+    size_t length;
+    // Data array.
+    std::vector<uint8_t> bytes;
+};
+
+struct shared_cache_file {
+    FileIdentity id;
+    // Number of open handles on this file.
+    size_t refcount;
+    // Map from aligned offset to cached block.
+    std::unordered_map<cs_off_t, std::unique_ptr<shared_block>> blocks;
+};
+
+using SharedBlockList = boost::intrusive::list<
+        shared_block,
+        boost::intrusive::member_hook<shared_block,
+                                      boost::intrusive::list_member_hook<>,
+                                      &shared_block::_lru_hook>>;
+
+/**
+ * Process-wide cache of file blocks, shared by all buffered handles opened
+ * with COUCHSTORE_OPEN_WITH_SHARED_BLOCK_CACHE.
+ *
+ * Blocks are keyed by (file identity, aligned offset) and are evicted in
+ * LRU order across all files once the total size reaches the configured
+ * budget, so memory naturally moves to the busiest files. A file's blocks
+ * are dropped when its last handle is closed, which also guarantees a
+ * recycled inode number never sees stale data.
+ */
+class SharedBlockCache {
+public:
+    static SharedBlockCache& get() {
+        static SharedBlockCache instance;
+        return instance;
+    }
+
+    size_t getBlockSize() const {
+        return READ_BUFFER_CAPACITY;
+    }
+
+    void setCapacity(size_t bytes) {
+        std::lock_guard<std::mutex> lh(mutex);
+        capacity = bytes;
+        evictUntil(capacity);
+    }
+
+    /**
+     * Registers a newly opened handle on the file at 'path'. 'before' is
+     * the identity of the path just before it was opened, if known; the
+     * file is only shared with other handles if the path still has the
+     * same identity afterwards (i.e. it was not replaced in between).
+     *
+     * @return the cache entry for the file, or NULL if the cache is disabled.
+     */
+    shared_cache_file* registerFile(const char* path,
+                                    bool have_before,
+                                    const FileIdentity& before) {
+        FileIdentity id;
+        if (!have_before || !getFileIdentity(path, id) || id != before) {
+            id = FileIdentity(0, 0, 0);
+        }
+
+        std::lock_guard<std::mutex> lh(mutex);
+        if (capacity == 0) {
+            return NULL;
+        }
+        if (id == FileIdentity(0, 0, 0)) {
+            id = FileIdentity(0, 0, ++nextUnique);
+        }
+        std::unique_ptr<shared_cache_file>& file = files[id];
+        if (!file) {
+            file = std::make_unique<shared_cache_file>();
+            file->id = id;
+            file->refcount = 0;
+        }
+        ++file->refcount;
+        return file.get();
+    }
+
+    // Adds another handle on an already registered file.
+    void retainFile(shared_cache_file* file) {
+        std::lock_guard<std::mutex> lh(mutex);
+        ++file->refcount;
+    }
+
+    void unregisterFile(shared_cache_file* file) {
+        std::lock_guard<std::mutex> lh(mutex);
+        if (--file->refcount > 0) {
+            return;
+        }
+        for (auto& entry : file->blocks) {
+            lru.erase(lru.iterator_to(*entry.second));
+            used -= entry.second->bytes.size();
+        }
+        files.erase(file->id);
+    }
+
+    /**
+     * Copies as many bytes as possible starting at 'offset' out of the
+     * cached block containing it.
+     *
+     * @return the number of bytes copied; 0 if the block isn't cached or
+     *         doesn't yet extend as far as 'offset'.
+     */
+    size_t read(shared_cache_file* file,
+                void* bytes,
+                size_t nbyte,
+                cs_off_t offset) {
+        const cs_off_t block_start = offset - (offset % getBlockSize());
+        std::lock_guard<std::mutex> lh(mutex);
+        auto itr = file->blocks.find(block_start);
+        if (itr == file->blocks.end()) {
+            return 0;
+        }
+        shared_block* block = itr->second.get();
+        size_t offset_in_block = (size_t)(offset - block_start);
+        if (offset_in_block >= block->length) {
+            return 0;
+        }
+        lru.splice(lru.begin(), lru, lru.iterator_to(*block));
+        size_t block_nbyte = std::min(block->length - offset_in_block, nbyte);
+        memcpy(bytes, block->bytes.data() + offset_in_block, block_nbyte);
+        return block_nbyte;
+    }
+
+    // Stores (or replaces) the contents of the block at 'block_start'.
+    void insert(shared_cache_file* file,
+                cs_off_t block_start,
+                const uint8_t* bytes,
+                size_t length) {
+        std::lock_guard<std::mutex> lh(mutex);
+        auto itr = file->blocks.find(block_start);
+        shared_block* block;
+        if (itr != file->blocks.end()) {
+            block = itr->second.get();
+            lru.splice(lru.begin(), lru, lru.iterator_to(*block));
+        } else {
+            if (capacity < getBlockSize()) {
+                return;
+            }
+            evictUntil(capacity - getBlockSize());
+            std::unique_ptr<shared_block> block_unique;
+            block_unique = std::make_unique<shared_block>(
+                    file, block_start, getBlockSize());
+            block = block_unique.get();
+            file->blocks.insert(
+                    std::make_pair(block_start, std::move(block_unique)));
+            lru.push_front(*block);
+            used += block->bytes.size();
+        }
+        memcpy(block->bytes.data(), bytes, length);
+        block->length = length;
+    }
+
+    // Drops any cached blocks overlapping [offset, offset + nbyte).
+    void invalidate(shared_cache_file* file, cs_off_t offset, size_t nbyte) {
+        if (nbyte == 0) {
+            return;
+        }
+        cs_off_t block_start = offset - (offset % getBlockSize());
+        std::lock_guard<std::mutex> lh(mutex);
+        for (; block_start < offset + (cs_off_t)nbyte;
+             block_start += getBlockSize()) {
+            auto itr = file->blocks.find(block_start);
+            if (itr != file->blocks.end()) {
+                lru.erase(lru.iterator_to(*itr->second));
+                used -= itr->second->bytes.size();
+                file->blocks.erase(itr);
+            }
+        }
+    }
+
+    static bool getFileIdentity(const char* path, FileIdentity& id) {
+#ifdef WIN32
+        // Inode numbers aren't meaningful here; never share between handles.
+        (void)path;
+        (void)id;
+        return false;
+#else
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            return false;
+        }
+        id = FileIdentity(st.st_dev, st.st_ino, 0);
+        return true;
+#endif
+    }
+
+private:
+    SharedBlockCache() : capacity(0), used(0), nextUnique(0) {
+    }
+
+    ~SharedBlockCache() {
+        auto itr = lru.begin();
+        while (itr != lru.end()) {
+            itr = lru.erase(itr);
+        }
+    }
+
+    // Evicts least recently used blocks until at most 'limit' bytes are used.
+    void evictUntil(size_t limit) {
+        while (used > limit && !lru.empty()) {
+            shared_block& block = lru.back();
+            const cs_off_t offset = block.offset;
+            lru.pop_back();
+            used -= block.bytes.size();
+            block.file->blocks.erase(offset);
+        }
+    }
+
+    std::mutex mutex;
+    // Budget for cached block data, in bytes. Zero disables the cache.
+    size_t capacity;
+    // Bytes currently held by cached blocks.
+    size_t used;
+    // Source of identities for files which can't be shared.
+    uint64_t nextUnique;
+    // LRU list for blocks of all files.
+    SharedBlockList lru;
+    // Map from file identity to its cached blocks.
+    std::map<FileIdentity, std::unique_ptr<shared_cache_file>> files;
 };
 
 
@@ -224,6 +587,10 @@ static couchstore_error_t flush_buffer(couchstore_error_info_t *errinfo,
 #endif
         if (raw_written <= 0)
             return (couchstore_error_t) raw_written;
+        if (buf->owner->shared_file) {
+            SharedBlockCache::get().invalidate(buf->owner->shared_file,
+                                               buf->offset, raw_written);
+        }
         buf->length -= raw_written;
         buf->offset += raw_written;
         memmove(buf->getRawPtr(), buf->getRawPtr() + raw_written, buf->length);
@@ -286,19 +653,477 @@ static couchstore_error_t load_buffer_from(couchstore_error_info_t *errinfo,
     return COUCHSTORE_SUCCESS;
 }
 
+// Read path for handles using the shared block cache.
+static ssize_t shared_cache_pread(couchstore_error_info_t *errinfo,
+                                  FileOpsInterface* raw_ops,
+                                  couch_file_handle raw_ops_handle,
+                                  shared_cache_file* shared_file,
+                                  void *buf,
+                                  size_t nbyte,
+                                  cs_off_t offset) {
+    SharedBlockCache& cache = SharedBlockCache::get();
+    const size_t block_size = cache.getBlockSize();
+    std::vector<uint8_t> block;
+
+    ssize_t total_read = 0;
+    while (nbyte > 0) {
+        size_t nbyte_read = cache.read(shared_file, buf, nbyte, offset);
+        if (nbyte_read == 0) {
+            // Not cached (or cached before the file grew this far):
+            // load the whole block and publish it for other handles.
+            cs_off_t block_start = offset - (offset % block_size);
+            block.resize(block_size);
+            ssize_t bytes_read = raw_ops->pread(errinfo,
+                                                raw_ops_handle,
+                                                block.data(),
+                                                block_size,
+                                                block_start);
+            if (bytes_read < 0) {
+                return bytes_read;
+            }
+            cache.insert(shared_file, block_start, block.data(),
+                         bytes_read);
+
+            if (offset >= block_start + bytes_read) {
+                break;  // must be at EOF
+            }
+            size_t offset_in_block = (size_t)(offset - block_start);
+            nbyte_read = std::min((size_t)bytes_read - offset_in_block, nbyte);
+            memcpy(buf, block.data() + offset_in_block, nbyte_read);
+        }
+        buf = (char*)buf + nbyte_read;
+        nbyte -= nbyte_read;
+        offset += nbyte_read;
+        total_read += nbyte_read;
+    }
+    return total_read;
+}
+
+// Copies as much of the given range as is already in memory (in the read
+// buffers or the shared block cache), without doing any I/O.
+static size_t read_from_memory(buffered_file_handle* h,
+                               void *buf,
+                               size_t nbyte,
+                               cs_off_t offset) {
+    size_t total_read = 0;
+    while (nbyte > 0) {
+        size_t nbyte_read;
+        if (h->shared_file) {
+            nbyte_read = SharedBlockCache::get().read(h->shared_file, buf,
+                                                      nbyte, offset);
+        } else {
+            file_buffer* buffer = h->read_buffer_mgr->lookupBuffer(h, offset);
+            nbyte_read = buffer ? read_from_buffer(buffer, buf, nbyte, offset)
+                                : 0;
+            buffer = h->read_buffer_mgr->readaheadBuffer();
+            if (nbyte_read == 0 && buffer) {
+                nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
+            }
+        }
+        if (nbyte_read == 0) {
+            break;
+        }
+        buf = (char*)buf + nbyte_read;
+        nbyte -= nbyte_read;
+        offset += nbyte_read;
+        total_read += nbyte_read;
+    }
+    return total_read;
+}
+
+
+// Reads document data through a buffer of its own, so that (typically
+// larger, and less often reread) document bodies don't evict B-tree nodes
+// from the read buffers. Reads of consecutive documents, e.g. while
+// compacting, are served from a single load of the buffer.
+static ssize_t read_document(couchstore_error_info_t *errinfo,
+                             buffered_file_handle* h,
+                             void *buf,
+                             size_t nbyte,
+                             cs_off_t offset) {
+    if (!h->document_buffer) {
+        try {
+            h->document_buffer = std::make_unique<file_buffer>(
+                    h, h->params.document_read_capacity);
+        } catch (const std::bad_alloc&) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    }
+    file_buffer* buffer = h->document_buffer.get();
+
+    size_t nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
+    if (nbyte_read == nbyte) {
+        return nbyte_read;
+    }
+    buf = (char*)buf + nbyte_read;
+    nbyte -= nbyte_read;
+    offset += nbyte_read;
+    if (nbyte > buffer->capacity) {
+        // Too large to be worth buffering.
+        ssize_t bytes_read = h->raw_ops->pread(errinfo, h->raw_ops_handle,
+                                               buf, nbyte, offset);
+        if (bytes_read < 0) {
+            return bytes_read;
+        }
+        return nbyte_read + bytes_read;
+    }
+
+    // Start the buffer at this read, so that it also covers what follows.
+    buffer->offset = offset;
+    buffer->length = 0;
+    couchstore_error_t err = load_buffer_from(errinfo, buffer, offset, nbyte);
+    if (err < 0) {
+        return err;
+    }
+    return nbyte_read + read_from_buffer(buffer, buf, nbyte, offset);
+}
+
+// Serves a read that is part of a stream from the readahead buffer,
+// reloading it (with more data each time) from where the read continues.
+// Returns 0 if it can't, so that the read buffers are used instead.
+static ssize_t read_ahead(couchstore_error_info_t *errinfo,
+                          buffered_file_handle* h,
+                          void *buf,
+                          size_t nbyte,
+                          cs_off_t offset) {
+    ReadBufferManager* mgr = h->read_buffer_mgr;
+    file_buffer* buffer = mgr->readaheadBuffer();
+    size_t total_read = buffer ? read_from_buffer(buffer, buf, nbyte, offset)
+                               : 0;
+    while (total_read < nbyte) {
+        buffer = mgr->growReadahead(h);
+        if (!buffer) {
+            break;
+        }
+        cs_off_t start = offset + total_read;
+        start -= start % h->params.read_buffer_capacity;
+        buffer->offset = start;
+        buffer->length = 0;
+        couchstore_error_t err = load_buffer_from(errinfo, buffer, start, 0);
+        if (err < 0) {
+            return err;
+        }
+        size_t nbyte_read = read_from_buffer(buffer,
+                                             (char*)buf + total_read,
+                                             nbyte - total_read,
+                                             offset + total_read);
+        if (nbyte_read == 0) {
+            break;  // must be at EOF
+        }
+        total_read += nbyte_read;
+    }
+    return total_read;
+}
+
+// Reads the given range from disk through the handle's read buffers, or
+// the shared block cache if the handle uses one, as suits the current tag.
+static ssize_t read_from_disk(couchstore_error_info_t *errinfo,
+                              buffered_file_handle* h,
+                              void *buf,
+                              size_t nbyte,
+                              cs_off_t offset) {
+    if (h->tag == FileTag::Empty) {
+        // Speculative reads (e.g. searching for a header) are unlikely to
+        // be repeated, so they aren't cached.
+        return h->raw_ops->pread(errinfo, h->raw_ops_handle, buf, nbyte,
+                                 offset);
+    }
+
+    if (h->shared_file) {
+        return shared_cache_pread(errinfo, h->raw_ops, h->raw_ops_handle,
+                                  h->shared_file, buf, nbyte, offset);
+    }
+
+    if (h->tag == FileTag::Document) {
+        return read_document(errinfo, h, buf, nbyte, offset);
+    }
+
+    if (h->read_buffer_mgr->trackRead(h, offset, nbyte)) {
+        ssize_t nbyte_read = read_ahead(errinfo, h, buf, nbyte, offset);
+        if (nbyte_read != 0) {
+            return nbyte_read;
+        }
+    }
+
+    ssize_t total_read = 0;
+    while (nbyte > 0) {
+        file_buffer* buffer = h->read_buffer_mgr->findBuffer(h, offset);
+
+        // Read as much as we can from the current buffer:
+        ssize_t nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
+        if (nbyte_read == 0) {
+            // 'nbyte_read==0' means that the returned buffer contains
+            // data for other offset and needs to be recycled.
+
+            // Move the buffer to cover the remainder of the data to be read.
+            cs_off_t block_start = offset -
+                                   (offset % h->params.read_buffer_capacity);
+            h->read_buffer_mgr->relocateBuffer(buffer->offset, block_start);
+            couchstore_error_t err =
+                    load_buffer_from(errinfo, buffer, block_start,
+                                     (size_t)(offset + nbyte - block_start));
+            if (err < 0) {
+                return err;
+            }
+
+            nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
+            if (nbyte_read == 0)
+                break;  // must be at EOF
+        }
+        buf = (char*)buf + nbyte_read;
+        nbyte -= nbyte_read;
+        offset += nbyte_read;
+        total_read += nbyte_read;
+    }
+    return total_read;
+}
+
+
+//////// BACKGROUND FLUSHING:
+
+
+/**
+ * Writes out the full write buffers of a handle on a background thread,
+ * so that its owner can carry on filling another buffer in the meantime.
+ * Buffers are written in the order they were submitted. Until a buffer
+ * has been written it stays readable through read().
+ *
+ * Only the background thread writes to the underlying file while any
+ * buffer is pending; the owner drains the flusher before writing or
+ * syncing the file itself, and retags the file through tag() so as not to
+ * do so in the middle of a background write.
+ *
+ * Once writing out a buffer has failed, the buffers queued behind it are
+ * dropped rather than written after the gap, and the error is returned to
+ * every later submit() and drain() until the handle is closed: saves that
+ * were only queued may already be referenced from the in-memory header,
+ * which must not be committed.
+ */
+class BackgroundFlusher {
+public:
+    BackgroundFlusher(buffered_file_handle* _owner,
+                      size_t nbuffers,
+                      size_t capacity)
+        : owner(_owner),
+          stopping(false),
+          error(COUCHSTORE_SUCCESS),
+          errorInfo() {
+        for (size_t ii = 0; ii < nbuffers; ++ii) {
+            freeBuffers.push_back(
+                    std::make_unique<file_buffer>(owner, capacity));
+        }
+        thread = std::thread(&BackgroundFlusher::run, this);
+    }
+
+    ~BackgroundFlusher() {
+        {
+            std::lock_guard<std::mutex> lh(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+
+    /**
+     * Queues 'buffer' to be written out and replaces it by an empty one,
+     * waiting for one to become free if they are all queued.
+     * Returns the first error hit writing out any buffer so far, if any,
+     * in which case 'buffer' is dropped.
+     */
+    couchstore_error_t submit(couchstore_error_info_t* errinfo,
+                              UniqueFileBufferPtr& buffer) {
+        std::unique_lock<std::mutex> lh(mutex);
+        cond.wait(lh, [this]() { return !freeBuffers.empty(); });
+        pending.push_back(std::move(buffer));
+        buffer = std::move(freeBuffers.back());
+        freeBuffers.pop_back();
+        cond.notify_all();
+        return getError(errinfo);
+    }
+
+    /**
+     * Waits for all queued buffers to be written out.
+     * Returns the first error hit writing out any buffer so far, if any.
+     */
+    couchstore_error_t drain(couchstore_error_info_t* errinfo) {
+        std::unique_lock<std::mutex> lh(mutex);
+        cond.wait(lh, [this]() { return pending.empty(); });
+        return getError(errinfo);
+    }
+
+    // Retags the underlying file, once any write in progress is done.
+    void tag(FileTag tag) {
+        std::lock_guard<std::mutex> lh(writeMutex);
+        owner->raw_ops->tag(owner->raw_ops_handle, tag);
+    }
+
+    /**
+     * Copies data at 'offset' from the most recently queued buffer holding
+     * it, returning the byte count (0 if no queued buffer holds it).
+     * 'limit' is at most 'nbyte' on input; on output it is reduced so that
+     * [offset, offset + limit) doesn't reach into any queued buffer.
+     */
+    size_t read(void* buf, size_t nbyte, cs_off_t offset, size_t& limit) {
+        std::lock_guard<std::mutex> lh(mutex);
+        for (auto it = pending.rbegin(); it != pending.rend(); ++it) {
+            file_buffer* buffer = it->get();
+            if (offset >= buffer->offset &&
+                offset < buffer->offset + (cs_off_t)buffer->length) {
+                return read_from_buffer(buffer, buf, limit, offset);
+            }
+            if (buffer->offset > offset) {
+                limit = std::min(limit, (size_t)(buffer->offset - offset));
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Returns the lowest offset of any queued data, or 'max' if there is
+     * none.
+     */
+    cs_off_t lowestOffset(cs_off_t max) {
+        std::lock_guard<std::mutex> lh(mutex);
+        for (const auto& buffer : pending) {
+            max = std::min(max, buffer->offset);
+        }
+        return max;
+    }
+
+private:
+    // Returns the recorded error, if any, along with its OS error.
+    // Called with 'mutex' held.
+    couchstore_error_t getError(couchstore_error_info_t* errinfo) {
+        if (error != COUCHSTORE_SUCCESS) {
+            *errinfo = errorInfo;
+        }
+        return error;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lh(mutex);
+        while (true) {
+            cond.wait(lh, [this]() { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            // The buffer isn't modified until it is retired below, so it can
+            // be written out without holding the lock.
+            file_buffer* buffer = pending.front().get();
+            const bool failed = error != COUCHSTORE_SUCCESS;
+            lh.unlock();
+            couchstore_error_info_t errinfo;
+            couchstore_error_t err = COUCHSTORE_SUCCESS;
+            if (!failed) {
+                err = write(&errinfo, buffer);
+            }
+            lh.lock();
+
+            if (err < 0 && error == COUCHSTORE_SUCCESS) {
+                error = err;
+                errorInfo = errinfo;
+            }
+            buffer->length = 0;
+            buffer->offset = static_cast<cs_off_t>(-1);
+            buffer->dirty = 0;
+            freeBuffers.push_back(std::move(pending.front()));
+            pending.pop_front();
+            cond.notify_all();
+        }
+    }
+
+    couchstore_error_t write(couchstore_error_info_t* errinfo,
+                             file_buffer* buffer) {
+        std::lock_guard<std::mutex> lh(writeMutex);
+        size_t written = 0;
+        couchstore_error_t err = COUCHSTORE_SUCCESS;
+        while (written < buffer->length) {
+            ssize_t raw_written = owner->raw_ops->pwrite(
+                    errinfo, owner->raw_ops_handle,
+                    buffer->getRawPtr() + written,
+                    buffer->length - written,
+                    buffer->offset + written);
+#if defined(LOG_BUFFER)
+            fprintf(stderr, "BUFFER: %p background flush %zd bytes at %zd --> %zd\n",
+                    buffer, buffer->length - written,
+                    buffer->offset + written, raw_written);
+#endif
+            if (raw_written <= 0) {
+                err = raw_written < 0 ? (couchstore_error_t)raw_written
+                                      : COUCHSTORE_ERROR_WRITE;
+                break;
+            }
+            written += raw_written;
+        }
+        if (owner->shared_file && written > 0) {
+            SharedBlockCache::get().invalidate(owner->shared_file,
+                                               buffer->offset, written);
+        }
+        return err;
+    }
+
+    buffered_file_handle* owner;
+    std::mutex mutex;
+    std::condition_variable cond;
+    // Buffers waiting to be written out, oldest first. The first one is
+    // being written out.
+    std::deque<UniqueFileBufferPtr> pending;
+    std::vector<UniqueFileBufferPtr> freeBuffers;
+    bool stopping;
+    // First error hit writing out a buffer, and the OS error that came
+    // with it.
+    couchstore_error_t error;
+    couchstore_error_info_t errorInfo;
+    // Held by the background thread while writing to the underlying file.
+    std::mutex writeMutex;
+    std::thread thread;
+};
+
+// Starts writing out the current write buffer, replacing it by an empty one.
+static couchstore_error_t submit_write_buffer(couchstore_error_info_t *errinfo,
+                                              buffered_file_handle* h) {
+    if (!h->flusher) {
+        return flush_buffer(errinfo, h->write_buffer.get());
+    }
+    if (h->write_buffer->length == 0 || !h->write_buffer->dirty) {
+        return COUCHSTORE_SUCCESS;
+    }
+    return h->flusher->submit(errinfo, h->write_buffer);
+}
+
+// Writes out all buffered data, waiting until it has been written.
+static couchstore_error_t flush_write_buffers(couchstore_error_info_t *errinfo,
+                                              buffered_file_handle* h) {
+    if (h->flusher) {
+        couchstore_error_t err = h->flusher->drain(errinfo);
+        if (err < 0) {
+            return err;
+        }
+    }
+    return flush_buffer(errinfo, h->write_buffer.get());
+}
+
 
 //////// PARAMS:
 
 buffered_file_ops_params::buffered_file_ops_params() :
     readOnly(false),
     read_buffer_capacity(READ_BUFFER_CAPACITY),
-    max_read_buffers(MAX_READ_BUFFERS)
+    max_read_buffers(MAX_READ_BUFFERS),
+    shared_block_cache(false),
+    write_buffers(1),
+    write_buffer_capacity(WRITE_BUFFER_CAPACITY),
+    document_read_capacity(DOCUMENT_READ_BUFFER_CAPACITY)
 { }
 
 buffered_file_ops_params::buffered_file_ops_params(const buffered_file_ops_params& src) :
     readOnly(src.readOnly),
     read_buffer_capacity(src.read_buffer_capacity),
-    max_read_buffers(src.max_read_buffers)
+    max_read_buffers(src.max_read_buffers),
+    shared_block_cache(src.shared_block_cache),
+    write_buffers(src.write_buffers),
+    write_buffer_capacity(src.write_buffer_capacity),
+    document_read_capacity(src.document_read_capacity)
 { }
 
 buffered_file_ops_params::buffered_file_ops_params(const bool _read_only,
@@ -306,7 +1131,11 @@ buffered_file_ops_params::buffered_file_ops_params(const bool _read_only,
                                                    const uint32_t _max_read_buffers) :
     readOnly(_read_only),
     read_buffer_capacity(_read_buffer_capacity),
-    max_read_buffers(_max_read_buffers)
+    max_read_buffers(_max_read_buffers),
+    shared_block_cache(false),
+    write_buffers(1),
+    write_buffer_capacity(WRITE_BUFFER_CAPACITY),
+    document_read_capacity(DOCUMENT_READ_BUFFER_CAPACITY)
 { }
 
 
@@ -318,8 +1147,12 @@ void BufferedFileOps::destructor(couch_file_handle handle)
     if (!h) {
         return;
     }
+    h->flusher.reset();
     h->raw_ops->destructor(h->raw_ops_handle);
 
+    if (h->shared_file) {
+        SharedBlockCache::get().unregisterFile(h->shared_file);
+    }
     delete h->read_buffer_mgr;
     delete h;
 }
@@ -333,15 +1166,25 @@ couch_file_handle BufferedFileOps::constructor(couchstore_error_info_t* errinfo,
         h->raw_ops = raw_ops;
         h->raw_ops_handle = raw_ops->constructor(errinfo);
         h->nbuffers = 1;
+        h->shared_file = NULL;
+        h->tag = FileTag::Unknown;
         h->params = params;
 
         try {
             h->write_buffer = std::make_unique<file_buffer>(
-                    h, h->params.readOnly ? 0 : WRITE_BUFFER_CAPACITY);
+                    h, h->params.readOnly ? 0 : h->params.write_buffer_capacity);
             h->read_buffer_mgr = new ReadBufferManager();
+            if (!h->params.readOnly && h->params.write_buffers > 1) {
+                h->flusher = std::make_unique<BackgroundFlusher>(
+                        h, h->params.write_buffers - 1,
+                        h->params.write_buffer_capacity);
+            }
         } catch (const std::bad_alloc&) {
             destructor(reinterpret_cast<couch_file_handle>(h));
             return NULL;
+        } catch (const std::system_error&) {
+            destructor(reinterpret_cast<couch_file_handle>(h));
+            return NULL;
         }
     }
     return (couch_file_handle) h;
@@ -359,7 +1202,20 @@ couchstore_error_t BufferedFileOps::open(couchstore_error_info_t* errinfo,
                                          int oflag)
 {
     buffered_file_handle *h = (buffered_file_handle*)*handle;
-    return h->raw_ops->open(errinfo, &h->raw_ops_handle, path, oflag);
+    if (!h->params.shared_block_cache) {
+        return h->raw_ops->open(errinfo, &h->raw_ops_handle, path, oflag);
+    }
+
+    FileIdentity before;
+    bool have_before = SharedBlockCache::getFileIdentity(path, before);
+    couchstore_error_t err = h->raw_ops->open(errinfo, &h->raw_ops_handle,
+                                              path, oflag);
+    if (err == COUCHSTORE_SUCCESS) {
+        h->shared_file = SharedBlockCache::get().registerFile(path,
+                                                              have_before,
+                                                              before);
+    }
+    return err;
 }
 
 couchstore_error_t BufferedFileOps::close(couchstore_error_info_t* errinfo,
@@ -369,7 +1225,11 @@ couchstore_error_t BufferedFileOps::close(couchstore_error_info_t* errinfo,
     if (!h) {
         return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
     }
-    flush_buffer(errinfo, h->write_buffer.get());
+    flush_write_buffers(errinfo, h);
+    if (h->shared_file) {
+        SharedBlockCache::get().unregisterFile(h->shared_file);
+        h->shared_file = NULL;
+    }
     return h->raw_ops->close(errinfo, h->raw_ops_handle);
 }
 
@@ -391,35 +1251,36 @@ ssize_t BufferedFileOps::pread(couchstore_error_info_t* errinfo,
     //fprintf(stderr, "r");
 #endif
     buffered_file_handle *h = (buffered_file_handle*)handle;
-    // Flush the write buffer before trying to read anything:
-    couchstore_error_t err = flush_buffer(errinfo, h->write_buffer.get());
-    if (err < 0) {
-        return err;
-    }
+    file_buffer* write_buffer = h->write_buffer.get();
 
+    // Data not yet flushed is served from the write buffer (or from the
+    // buffers being written out in the background); everything before it
+    // is already on disk and read through the read buffers (or the shared
+    // block cache). The write buffer is only flushed when it fills up, on
+    // sync and on close.
     ssize_t total_read = 0;
     while (nbyte > 0) {
-        file_buffer* buffer = h->read_buffer_mgr->findBuffer(h, offset);
-
-        // Read as much as we can from the current buffer:
-        ssize_t nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
+        size_t nbyte_read = 0;
+        size_t limit = nbyte;
+        if (write_buffer->dirty) {
+            nbyte_read = read_from_buffer(write_buffer, buf, nbyte, offset);
+            if (offset < write_buffer->offset) {
+                limit = std::min(limit,
+                                 (size_t)(write_buffer->offset - offset));
+            }
+        }
+        if (nbyte_read == 0 && h->flusher) {
+            nbyte_read = h->flusher->read(buf, limit, offset, limit);
+        }
         if (nbyte_read == 0) {
-            // 'nbyte_read==0' means that the returned buffer contains
-            // data for other offset and needs to be recycled.
-
-            // Move the buffer to cover the remainder of the data to be read.
-            cs_off_t block_start = offset -
-                                   (offset % h->params.read_buffer_capacity);
-            h->read_buffer_mgr->relocateBuffer(buffer->offset, block_start);
-            err = load_buffer_from(errinfo, buffer, block_start,
-                                   (size_t)(offset + nbyte - block_start));
-            if (err < 0) {
-                return err;
+            ssize_t got = read_from_disk(errinfo, h, buf, limit, offset);
+            if (got < 0) {
+                return got;
             }
-
-            nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
-            if (nbyte_read == 0)
+            nbyte_read = got;
+            if (nbyte_read == 0) {
                 break;  // must be at EOF
+            }
         }
         buf = (char*)buf + nbyte_read;
         nbyte -= nbyte_read;
@@ -429,6 +1290,62 @@ ssize_t BufferedFileOps::pread(couchstore_error_info_t* errinfo,
     return total_read;
 }
 
+void BufferedFileOps::pread_batch(couchstore_error_info_t* errinfo,
+                                  couch_file_handle handle,
+                                  couch_read_request* reqs,
+                                  size_t count)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    if (count < 2) {
+        FileOpsInterface::pread_batch(errinfo, handle, reqs, count);
+        return;
+    }
+
+    // Reads already in memory are served from there; the rest are passed
+    // down as one batch. These are typically scattered across the file, so
+    // they bypass the read buffers rather than evicting them.
+    file_buffer* write_buffer = h->write_buffer.get();
+    cs_off_t unflushed = std::numeric_limits<cs_off_t>::max();
+    if (write_buffer->dirty) {
+        unflushed = write_buffer->offset;
+    }
+    if (h->flusher) {
+        unflushed = h->flusher->lowestOffset(unflushed);
+    }
+    std::vector<couch_read_request> misses;
+    std::vector<size_t> miss_index;
+    try {
+        misses.reserve(count);
+        miss_index.reserve(count);
+    } catch (const std::bad_alloc&) {
+        FileOpsInterface::pread_batch(errinfo, handle, reqs, count);
+        return;
+    }
+    for (size_t ii = 0; ii < count; ++ii) {
+        couch_read_request& req = reqs[ii];
+        if (req.offset + (cs_off_t)req.nbytes > unflushed) {
+            // Touches unflushed data:
+            req.result = pread(errinfo, handle, req.buf, req.nbytes,
+                               req.offset);
+        } else if (read_from_memory(h, req.buf, req.nbytes, req.offset) ==
+                   req.nbytes) {
+            req.result = req.nbytes;
+        } else {
+            misses.push_back(req);
+            miss_index.push_back(ii);
+        }
+    }
+    if (misses.empty()) {
+        return;
+    }
+
+    h->raw_ops->pread_batch(errinfo, h->raw_ops_handle, misses.data(),
+                            misses.size());
+    for (size_t ii = 0; ii < misses.size(); ++ii) {
+        reqs[miss_index[ii]].result = misses[ii].result;
+    }
+}
+
 ssize_t BufferedFileOps::pwrite(couchstore_error_info_t* errinfo,
                                 couch_file_handle handle,
                                 const void* buf,
@@ -455,9 +1372,10 @@ ssize_t BufferedFileOps::pwrite(couchstore_error_info_t* errinfo,
 
     // Flush the buffer if it's full, or if it isn't aligned with the current write:
     if (buffer->length == buffer->capacity || nbyte_written == 0) {
-        couchstore_error_t error = flush_buffer(errinfo, buffer);
+        couchstore_error_t error = submit_write_buffer(errinfo, h);
         if (error < 0)
             return error;
+        buffer = h->write_buffer.get();
     }
 
     if (nbyte > 0) {
@@ -466,6 +1384,12 @@ ssize_t BufferedFileOps::pwrite(couchstore_error_info_t* errinfo,
         if (nbyte <= (buffer->capacity - buffer->length)) {
             written = write_to_buffer(buffer, buf, nbyte, offset);
         } else {
+            if (h->flusher) {
+                couchstore_error_t error = h->flusher->drain(errinfo);
+                if (error < 0) {
+                    return error;
+                }
+            }
             written = h->raw_ops->pwrite(errinfo, h->raw_ops_handle, buf,
                                          nbyte, offset);
 #if defined(LOG_BUFFER)
@@ -475,6 +1399,10 @@ ssize_t BufferedFileOps::pwrite(couchstore_error_info_t* errinfo,
             if (written < 0) {
                 return written;
             }
+            if (h->shared_file) {
+                SharedBlockCache::get().invalidate(h->shared_file, offset,
+                                                   written);
+            }
         }
         nbyte_written += written;
     }
@@ -482,6 +1410,42 @@ ssize_t BufferedFileOps::pwrite(couchstore_error_info_t* errinfo,
     return nbyte_written;
 }
 
+ssize_t BufferedFileOps::pwritev(couchstore_error_info_t* errinfo,
+                                 couch_file_handle handle,
+                                 const couch_iovec* iov,
+                                 int iovcnt,
+                                 cs_off_t offset)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    file_buffer* buffer = h->write_buffer.get();
+
+    size_t nbyte = 0;
+    for (int ii = 0; ii < iovcnt; ++ii) {
+        nbyte += iov[ii].len;
+    }
+
+    // Anything that fits in the buffer is copied into it piece by piece:
+    if (nbyte <= buffer->capacity) {
+        return FileOpsInterface::pwritev(errinfo, handle, iov, iovcnt, offset);
+    }
+
+    // Otherwise flush what's buffered and hand the whole vector down at once:
+    couchstore_error_t error = flush_write_buffers(errinfo, h);
+    if (error < 0) {
+        return error;
+    }
+    ssize_t written = h->raw_ops->pwritev(errinfo, h->raw_ops_handle, iov,
+                                          iovcnt, offset);
+#if defined(LOG_BUFFER)
+    fprintf(stderr, "BUFFER: passthru %zu bytes (%d iovs) at %zd --> %zd\n",
+            nbyte, iovcnt, offset, written);
+#endif
+    if (written > 0 && h->shared_file) {
+        SharedBlockCache::get().invalidate(h->shared_file, offset, written);
+    }
+    return written;
+}
+
 cs_off_t BufferedFileOps::goto_eof(couchstore_error_info_t* errinfo,
                                   couch_file_handle handle)
 {
@@ -493,7 +1457,7 @@ couchstore_error_t BufferedFileOps::sync(couchstore_error_info_t* errinfo,
                                          couch_file_handle handle)
 {
     buffered_file_handle *h = (buffered_file_handle*)handle;
-    couchstore_error_t err = flush_buffer(errinfo, h->write_buffer.get());
+    couchstore_error_t err = flush_write_buffers(errinfo, h);
     if (err == COUCHSTORE_SUCCESS) {
         err = h->raw_ops->sync(errinfo, h->raw_ops_handle);
     }
@@ -510,6 +1474,17 @@ couchstore_error_t BufferedFileOps::advise(couchstore_error_info_t* errinfo,
     return h->raw_ops->advise(errinfo, h->raw_ops_handle, offs, len, adv);
 }
 
+void BufferedFileOps::tag(couch_file_handle handle, FileTag tag)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    h->tag = tag;
+    if (h->flusher) {
+        h->flusher->tag(tag);
+    } else {
+        h->raw_ops->tag(h->raw_ops_handle, tag);
+    }
+}
+
 FileOpsInterface::FHStats* BufferedFileOps::get_stats(
         couch_file_handle handle) {
     // Not implemeted ourselves, just forward to wrapped ops.
@@ -532,3 +1507,160 @@ FileOpsInterface* couch_get_buffered_file_ops(couchstore_error_info_t* errinfo,
         return NULL;
     }
 }
+
+//////// SNAPSHOTS:
+
+// How SnapshotFileOps interprets a couch_file_handle: the file handle the
+// snapshot was taken from, which it reads through but never closes.
+struct snapshot_file_handle {
+    FileOpsInterface* raw_ops;
+    couch_file_handle raw_ops_handle;
+    // Entry of the file in the shared block cache, or NULL.
+    shared_cache_file* shared_file;
+};
+
+/**
+ * Read-only file ops for snapshots (see couchstore_open_snapshot()). Reads
+ * go straight to the underlying file ops, or through the shared block
+ * cache, but never through the buffered handle's own buffers, as those
+ * belong to the thread using the database the snapshot was taken from.
+ */
+class SnapshotFileOps : public FileOpsInterface {
+public:
+    couch_file_handle constructor(couchstore_error_info_t* errinfo) override {
+        return NULL;
+    }
+
+    couchstore_error_t open(couchstore_error_info_t* errinfo,
+                            couch_file_handle* handle,
+                            const char* path,
+                            int oflag) override {
+        return COUCHSTORE_ERROR_NOT_SUPPORTED;
+    }
+
+    couchstore_error_t close(couchstore_error_info_t* errinfo,
+                             couch_file_handle handle) override {
+        // The file belongs to the database the snapshot was taken from.
+        return COUCHSTORE_SUCCESS;
+    }
+
+    couchstore_error_t set_periodic_sync(couch_file_handle handle,
+                                         uint64_t period_bytes) override {
+        return COUCHSTORE_ERROR_NOT_SUPPORTED;
+    }
+
+    ssize_t pread(couchstore_error_info_t* errinfo,
+                  couch_file_handle handle,
+                  void* buf,
+                  size_t nbytes,
+                  cs_off_t offset) override {
+        snapshot_file_handle* h = (snapshot_file_handle*)handle;
+        if (h->shared_file) {
+            return shared_cache_pread(errinfo, h->raw_ops, h->raw_ops_handle,
+                                      h->shared_file, buf, nbytes, offset);
+        }
+        return h->raw_ops->pread(errinfo, h->raw_ops_handle, buf, nbytes,
+                                 offset);
+    }
+
+    void pread_batch(couchstore_error_info_t* errinfo,
+                     couch_file_handle handle,
+                     couch_read_request* reqs,
+                     size_t count) override {
+        snapshot_file_handle* h = (snapshot_file_handle*)handle;
+        if (h->shared_file) {
+            FileOpsInterface::pread_batch(errinfo, handle, reqs, count);
+        } else {
+            h->raw_ops->pread_batch(errinfo, h->raw_ops_handle, reqs, count);
+        }
+    }
+
+    ssize_t pwrite(couchstore_error_info_t* errinfo,
+                   couch_file_handle handle,
+                   const void* buf,
+                   size_t nbytes,
+                   cs_off_t offset) override {
+        return COUCHSTORE_ERROR_WRITE;
+    }
+
+    ssize_t pwritev(couchstore_error_info_t* errinfo,
+                    couch_file_handle handle,
+                    const couch_iovec* iov,
+                    int iovcnt,
+                    cs_off_t offset) override {
+        return COUCHSTORE_ERROR_WRITE;
+    }
+
+    cs_off_t goto_eof(couchstore_error_info_t* errinfo,
+                      couch_file_handle handle) override {
+        snapshot_file_handle* h = (snapshot_file_handle*)handle;
+        return h->raw_ops->goto_eof(errinfo, h->raw_ops_handle);
+    }
+
+    couchstore_error_t sync(couchstore_error_info_t* errinfo,
+                            couch_file_handle handle) override {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    couchstore_error_t advise(couchstore_error_info_t* errinfo,
+                              couch_file_handle handle,
+                              cs_off_t offset,
+                              cs_off_t len,
+                              couchstore_file_advice_t advice) override {
+        snapshot_file_handle* h = (snapshot_file_handle*)handle;
+        return h->raw_ops->advise(errinfo, h->raw_ops_handle, offset, len,
+                                  advice);
+    }
+
+    void destructor(couch_file_handle handle) override {
+        snapshot_file_handle* h = (snapshot_file_handle*)handle;
+        if (!h) {
+            return;
+        }
+        if (h->shared_file) {
+            SharedBlockCache::get().unregisterFile(h->shared_file);
+        }
+        delete h;
+    }
+};
+
+static SnapshotFileOps snapshot_ops;
+
+FileOpsInterface* couch_get_snapshot_file_ops(couchstore_error_info_t* errinfo,
+                                              FileOpsInterface* source_ops,
+                                              couch_file_handle source_handle,
+                                              couch_file_handle* handle)
+{
+    snapshot_file_handle* h = new (std::nothrow) snapshot_file_handle();
+    if (!h) {
+        return NULL;
+    }
+    if (source_ops == &ops) {
+        buffered_file_handle* source = (buffered_file_handle*)source_handle;
+        // Everything written through the source so far must be visible
+        // to the snapshot.
+        couchstore_error_t err = flush_write_buffers(errinfo, source);
+        if (err != COUCHSTORE_SUCCESS) {
+            delete h;
+            return NULL;
+        }
+        h->raw_ops = source->raw_ops;
+        h->raw_ops_handle = source->raw_ops_handle;
+        h->shared_file = source->shared_file;
+        if (h->shared_file) {
+            SharedBlockCache::get().retainFile(h->shared_file);
+        }
+    } else {
+        h->raw_ops = source_ops;
+        h->raw_ops_handle = source_handle;
+        h->shared_file = NULL;
+    }
+    *handle = (couch_file_handle)h;
+    return &snapshot_ops;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_set_shared_block_cache_size(uint64_t capacity_bytes)
+{
+    SharedBlockCache::get().setCapacity(capacity_bytes);
+}
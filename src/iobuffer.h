@@ -34,6 +34,18 @@ struct buffered_file_ops_params {
     uint32_t read_buffer_capacity;
     // Max read buffer count.
     uint32_t max_read_buffers;
+    // Flag indicating whether reads should go through the process-wide
+    // shared block cache (if it has been given a non-zero size) instead of
+    // this handle's own read buffers.
+    bool shared_block_cache;
+    // Number of write buffers. With more than one, full buffers are written
+    // out by a background thread while the next one is being filled.
+    uint32_t write_buffers;
+    // Capacity of each write buffer.
+    uint32_t write_buffer_capacity;
+    // Capacity of the buffer that reads tagged FileTag::Document go
+    // through, instead of the read buffers.
+    uint32_t document_read_capacity;
 };
 
 /**
@@ -50,6 +62,23 @@ FileOpsInterface* couch_get_buffered_file_ops(couchstore_error_info_t *errinfo,
                                               couch_file_handle* handle,
                                               buffered_file_ops_params params);
 
+/**
+ * Returns read-only file ops for a snapshot of a file open through
+ * 'source_ops' and 'source_handle', and sets 'handle' to a handle for them.
+ * The snapshot reads the same open file, and may do so from another thread
+ * than the one using the source handle: if that is buffered, the snapshot
+ * bypasses its buffers (after writing out anything pending in them) but
+ * shares its entry in the shared block cache. Otherwise the source's file
+ * ops must support concurrent preads. The source handle must stay open for
+ * as long as the snapshot's is.
+ *
+ * @return the file ops, or NULL on failure
+ */
+FileOpsInterface* couch_get_snapshot_file_ops(couchstore_error_info_t* errinfo,
+                                              FileOpsInterface* source_ops,
+                                              couch_file_handle source_handle,
+                                              couch_file_handle* handle);
+
 class BufferedFileOps : public FileOpsInterface {
 public:
     BufferedFileOps() {}
@@ -65,9 +94,16 @@ public:
     ssize_t pread(couchstore_error_info_t* errinfo,
                   couch_file_handle handle, void* buf, size_t nbytes,
                   cs_off_t offset) override;
+    void pread_batch(couchstore_error_info_t* errinfo,
+                     couch_file_handle handle,
+                     couch_read_request* reqs,
+                     size_t count) override;
     ssize_t pwrite(couchstore_error_info_t* errinfo,
                    couch_file_handle handle, const void* buf,
                    size_t nbytes, cs_off_t offset) override;
+    ssize_t pwritev(couchstore_error_info_t* errinfo,
+                    couch_file_handle handle, const couch_iovec* iov,
+                    int iovcnt, cs_off_t offset) override;
     cs_off_t goto_eof(couchstore_error_info_t* errinfo,
                       couch_file_handle handle) override;
     couchstore_error_t sync(couchstore_error_info_t* errinfo,
@@ -76,6 +112,7 @@ public:
                               couch_file_handle handle, cs_off_t offset,
                               cs_off_t len,
                               couchstore_file_advice_t advice) override;
+    void tag(couch_file_handle handle, FileTag tag) override;
     FHStats* get_stats(couch_file_handle handle) override;
 
     void destructor(couch_file_handle handle) override;
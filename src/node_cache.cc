@@ -0,0 +1,250 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+#include "node_cache.h"
+#include "node_types.h"
+
+#include <cstring>
+#include <new>
+#include <vector>
+
+NodeCache::NodeCache(size_t _capacity)
+    : capacity(_capacity),
+      size(0),
+      hits(0),
+      misses(0) {
+}
+
+CachedNodePtr NodeCache::get(uint64_t pos) {
+    std::lock_guard<std::mutex> lh(mutex);
+    auto itr = index.find(pos);
+    if (itr == index.end()) {
+        ++misses;
+        return CachedNodePtr();
+    }
+    ++hits;
+    lru.splice(lru.begin(), lru, itr->second);
+    return itr->second->second;
+}
+
+void NodeCache::put(uint64_t pos, CachedNodePtr node) {
+    std::lock_guard<std::mutex> lh(mutex);
+    if (node->size > capacity || index.count(pos)) {
+        return;
+    }
+    while (size + node->size > capacity) {
+        size -= lru.back().second->size;
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+    lru.emplace_front(pos, node);
+    try {
+        index[pos] = lru.begin();
+    } catch (const std::bad_alloc&) {
+        lru.pop_front();
+        return;
+    }
+    size += node->size;
+}
+
+CachedNodePtr RightSpine::get(uint64_t pos) const {
+    for (const auto& node : edge) {
+        if (node.first == pos) {
+            return node.second;
+        }
+    }
+    return CachedNodePtr();
+}
+
+CachedNodePtr RightSpine::find(uint64_t pos) const {
+    for (const auto& node : written_nodes) {
+        if (node.first == pos) {
+            return node.second;
+        }
+    }
+    return get(pos);
+}
+
+void RightSpine::written(const compare_info& cmp,
+                         uint64_t pos,
+                         const char* buf,
+                         size_t size,
+                         const sized_buf& key) {
+    if (!written_nodes.empty()) {
+        sized_buf greatest = {const_cast<char*>(greatestKey.data()),
+                              greatestKey.size()};
+        int cmp_val = cmp.compare(&key, &greatest);
+        if (cmp_val < 0) {
+            return;
+        }
+        if (cmp_val > 0) {
+            written_nodes.clear();
+        }
+    }
+
+    char* copy = static_cast<char*>(cb_malloc(size));
+    if (!copy) {
+        // Not keeping the node only means reading it back later.
+        return;
+    }
+    memcpy(copy, buf, size);
+    try {
+        auto node = std::make_shared<CachedNode>(copy, size);
+        if (written_nodes.empty()) {
+            greatestKey.assign(key.buf, key.size);
+        }
+        written_nodes.emplace_back(pos, node);
+    } catch (const std::bad_alloc&) {
+        written_nodes.clear();
+    }
+}
+
+void RightSpine::finish(const node_pointer* root) {
+    Nodes new_edge;
+    try {
+        uint64_t pos = root ? root->pointer : 0;
+        CachedNodePtr node = root ? find(pos) : CachedNodePtr();
+        while (node) {
+            new_edge.emplace_back(pos, node);
+            if ((node->buf[0] & NODE_TYPE_MASK) != KP_NODE) {
+                break;
+            }
+            // Descend into the last child.
+            int end = node_entries_end(node->buf, int(node->size));
+            sized_buf key, value = {NULL, 0};
+            for (int bufpos = 1; bufpos < end;) {
+                bufpos += read_kv(node->buf + bufpos, &key, &value);
+            }
+            if (!value.buf) {
+                break;
+            }
+            pos = decode_raw48(((const raw_node_pointer*)value.buf)->pointer);
+            node = find(pos);
+        }
+    } catch (const std::bad_alloc&) {
+        new_edge.clear();
+    }
+    edge.swap(new_edge);
+    written_nodes.clear();
+}
+
+int pread_node(tree_file *file, cs_off_t pos, CachedNodePtr *node)
+{
+    NodeCache* cache = file->node_cache;
+    if (cache) {
+        *node = cache->get(pos);
+        if (*node) {
+            return static_cast<int>((*node)->size);
+        }
+    }
+
+    char *buf = NULL;
+    int len = pread_compressed(file, pos, &buf);
+    if (len < 0) {
+        return len;
+    }
+    len = expand_node(&buf, len);
+    if (len < 0) {
+        cb_free(buf);
+        return len;
+    }
+
+    try {
+        *node = std::make_shared<CachedNode>(buf, len);
+    } catch (const std::bad_alloc&) {
+        cb_free(buf);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    if (cache) {
+        try {
+            cache->put(pos, *node);
+        } catch (const std::bad_alloc&) {
+            // Not caching the node is harmless.
+        }
+    }
+    return len;
+}
+
+void pread_nodes(tree_file *file,
+                 size_t count,
+                 const cs_off_t *pos,
+                 CachedNodePtr *nodes,
+                 int *lens)
+{
+    NodeCache* cache = file->node_cache;
+    std::vector<cs_off_t> miss_pos;
+    std::vector<size_t> miss_index;
+    std::vector<char*> bufs;
+    std::vector<int> miss_lens;
+    try {
+        for (size_t ii = 0; ii < count; ++ii) {
+            if (cache) {
+                nodes[ii] = cache->get(pos[ii]);
+                if (nodes[ii]) {
+                    lens[ii] = static_cast<int>(nodes[ii]->size);
+                    continue;
+                }
+            }
+            miss_pos.push_back(pos[ii]);
+            miss_index.push_back(ii);
+        }
+        bufs.resize(miss_pos.size(), nullptr);
+        miss_lens.resize(miss_pos.size());
+    } catch (const std::bad_alloc&) {
+        for (size_t ii = 0; ii < count; ++ii) {
+            lens[ii] = COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        return;
+    }
+    if (miss_pos.empty()) {
+        return;
+    }
+
+    pread_compressed_batch(file, miss_pos.size(), miss_pos.data(),
+                           bufs.data(), miss_lens.data());
+
+    for (size_t ii = 0; ii < miss_pos.size(); ++ii) {
+        size_t index = miss_index[ii];
+        if (miss_lens[ii] >= 0) {
+            miss_lens[ii] = expand_node(&bufs[ii], miss_lens[ii]);
+            if (miss_lens[ii] < 0) {
+                cb_free(bufs[ii]);
+            }
+        }
+        lens[index] = miss_lens[ii];
+        if (miss_lens[ii] < 0) {
+            continue;
+        }
+        try {
+            nodes[index] = std::make_shared<CachedNode>(bufs[ii],
+                                                        miss_lens[ii]);
+        } catch (const std::bad_alloc&) {
+            cb_free(bufs[ii]);
+            lens[index] = COUCHSTORE_ERROR_ALLOC_FAIL;
+            continue;
+        }
+        if (cache) {
+            try {
+                cache->put(miss_pos[ii], nodes[index]);
+            } catch (const std::bad_alloc&) {
+                // Not caching the node is harmless.
+            }
+        }
+    }
+}
@@ -0,0 +1,209 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "couch_btree.h"
+#include "internal.h"
+
+#include <platform/cb_malloc.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A decompressed, checksum-verified B-tree node, as returned by
+ * pread_compressed(). Owns (and frees) the buffer, which is read-only as it
+ * may be shared through the cache.
+ */
+struct CachedNode {
+    CachedNode(char* _buf, size_t _size) : buf(_buf), size(_size) {
+    }
+
+    ~CachedNode() {
+        cb_free(const_cast<char*>(buf));
+    }
+
+    CachedNode(const CachedNode&) = delete;
+    CachedNode& operator=(const CachedNode&) = delete;
+
+    const char* buf;
+    size_t size;
+};
+
+using CachedNodePtr = std::shared_ptr<CachedNode>;
+
+/**
+ * LRU cache of decoded B-tree nodes for one open file, keyed by the node's
+ * file position.
+ *
+ * Nodes are never rewritten in place, so cached entries never need to be
+ * invalidated; they are only evicted once the total size of cached nodes
+ * exceeds the capacity. Entries are reference counted, so a node still in
+ * use by a traversal remains valid after eviction.
+ *
+ * The cache is shared with the snapshots of a Db (see
+ * couchstore_open_snapshot()), which may be used from other threads, so
+ * access to it is serialized.
+ */
+class NodeCache {
+public:
+    explicit NodeCache(size_t _capacity);
+
+    /**
+     * Looks up the node at 'pos'.
+     * @return the node, or an empty pointer on a miss.
+     */
+    CachedNodePtr get(uint64_t pos);
+
+    /**
+     * Adds the node at 'pos', evicting least recently used nodes to stay
+     * within the capacity. Nodes bigger than the capacity aren't cached.
+     */
+    void put(uint64_t pos, CachedNodePtr node);
+
+    uint64_t getHits() const {
+        std::lock_guard<std::mutex> lh(mutex);
+        return hits;
+    }
+
+    uint64_t getMisses() const {
+        std::lock_guard<std::mutex> lh(mutex);
+        return misses;
+    }
+
+    size_t getSize() const {
+        std::lock_guard<std::mutex> lh(mutex);
+        return size;
+    }
+
+private:
+    using LRUList = std::list<std::pair<uint64_t, CachedNodePtr>>;
+
+    mutable std::mutex mutex;
+    // Maximum total size of cached nodes, in bytes.
+    size_t capacity;
+    // Current total size of cached nodes, in bytes.
+    size_t size;
+    uint64_t hits;
+    uint64_t misses;
+    // Most recently used first.
+    LRUList lru;
+    // Map from file position to entry in 'lru'.
+    std::unordered_map<uint64_t, LRUList::iterator> index;
+};
+
+/**
+ * The nodes on the right edge of a B-tree that is mostly appended to at its
+ * right edge, such as the by-sequence tree, kept between modifications so
+ * that appending doesn't need to read them back from the file.
+ *
+ * modify_btree() records every node it writes. All nodes on the right edge
+ * end with the tree's greatest key, so only the nodes ending with the
+ * greatest key written so far are kept. Once the modification is complete,
+ * those of them on the new root's right edge, and any nodes of the previous
+ * edge still on it, become the edge.
+ *
+ * Only used by the writer of a Db, so not thread-safe.
+ */
+class RightSpine {
+public:
+    /**
+     * Looks up the edge node at 'pos'.
+     * @return the node's entries, or an empty pointer if it isn't an edge
+     *         node.
+     */
+    CachedNodePtr get(uint64_t pos) const;
+
+    /**
+     * Records a node written at 'pos', whose entries are 'buf' and whose
+     * greatest key is 'key'.
+     */
+    void written(const compare_info& cmp,
+                 uint64_t pos,
+                 const char* buf,
+                 size_t size,
+                 const sized_buf& key);
+
+    /**
+     * Makes the recorded nodes on the right edge of the tree rooted at
+     * 'root' the edge, forgetting any others. A NULL root (the
+     * modification failed) forgets all nodes.
+     */
+    void finish(const node_pointer* root);
+
+    size_t getDepth() const {
+        return edge.size();
+    }
+
+private:
+    using Nodes = std::vector<std::pair<uint64_t, CachedNodePtr>>;
+
+    CachedNodePtr find(uint64_t pos) const;
+
+    // The edge, from the root down.
+    Nodes edge;
+    // Nodes written by the current modification ending with 'greatestKey'.
+    Nodes written_nodes;
+    std::string greatestKey;
+};
+
+/**
+ * An entry of a by-sequence tree node, decoded for counting changes: the
+ * (greatest) sequence number of the entry and, for a KP node entry, the
+ * child node's position and number of changes. Leaf entries have a zero
+ * pointer (nothing but a header can be at position 0) and a count of 1.
+ *
+ * Decoded nodes are kept in a NodeCache as CachedNodes whose buffer is
+ * an array of these.
+ */
+struct seq_count_entry {
+    uint64_t seq;
+    uint64_t count;
+    uint64_t pointer;
+};
+
+/**
+ * Reads a compressed B-tree node from the file at a given position, using
+ * the file's node cache if it has one.
+ *
+ * @param file The tree_file to read from
+ * @param pos The byte position to read from
+ * @param node On success, set to the decompressed node. It must not be
+ *             modified, as it may be shared with the cache.
+ * @return The length of the node, or a negative error code
+ */
+int pread_node(tree_file *file, cs_off_t pos, CachedNodePtr *node);
+
+/**
+ * Reads several B-tree nodes at once, as by pread_node(), issuing the reads
+ * for nodes not in the cache as one batch.
+ *
+ * @param count Number of nodes to read
+ * @param pos The byte positions to read from
+ * @param nodes On success, set to the decompressed node, for each position
+ * @param lens Set to what pread_node would return, for each position
+ */
+void pread_nodes(tree_file *file,
+                 size_t count,
+                 const cs_off_t *pos,
+                 CachedNodePtr *nodes,
+                 int *lens);
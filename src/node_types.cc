@@ -36,6 +36,169 @@ void* write_kv(void *buf, sized_buf key, sized_buf value)
     return dst;
 }
 
+size_t node_directory_size(size_t count)
+{
+    return (count + 1) * sizeof(raw_32);
+}
+
+size_t write_node_directory(char *node, size_t size)
+{
+    char *dst = node + size;
+    uint32_t count = 0;
+    size_t pos = 1;
+    while (pos < size) {
+        sized_buf key, value;
+        raw_32 offset = encode_raw32(static_cast<uint32_t>(pos));
+        memcpy(dst, &offset, sizeof(offset));
+        dst += sizeof(offset);
+        pos += read_kv(node + pos, &key, &value);
+        count++;
+    }
+    raw_32 raw_count = encode_raw32(count);
+    memcpy(dst, &raw_count, sizeof(raw_count));
+    dst += sizeof(raw_count);
+    node[0] |= NODE_DIRECTORY_FLAG;
+    return dst - node;
+}
+
+size_t prefix_compress_node(const char *node, size_t size, char *out)
+{
+    sized_buf first = {NULL, 0};
+    size_t prefix = 0;
+    size_t count = 0;
+    size_t pos = 1;
+    while (pos < size) {
+        sized_buf key, value;
+        pos += read_kv(node + pos, &key, &value);
+        if (count++ == 0) {
+            first = key;
+            prefix = key.size;
+        } else {
+            size_t ii = 0;
+            while (ii < prefix && ii < key.size && key.buf[ii] == first.buf[ii]) {
+                ii++;
+            }
+            prefix = ii;
+        }
+    }
+    // The prefix is stored once, plus its length, instead of in every key.
+    if (count < 2 || prefix * count <= prefix + sizeof(raw_16)) {
+        return 0;
+    }
+
+    char *dst = out;
+    *(dst++) = node[0] | NODE_PREFIX_FLAG;
+    raw_16 prefix_len = encode_raw16(static_cast<uint16_t>(prefix));
+    memcpy(dst, &prefix_len, sizeof(prefix_len));
+    dst += sizeof(prefix_len);
+    memcpy(dst, first.buf, prefix);
+    dst += prefix;
+    pos = 1;
+    while (pos < size) {
+        sized_buf key, value;
+        pos += read_kv(node + pos, &key, &value);
+        key.buf += prefix;
+        key.size -= prefix;
+        dst = static_cast<char*>(write_kv(dst, key, value));
+    }
+    return dst - out;
+}
+
+int expand_node(char **node, int size)
+{
+    const char *src = *node;
+    if (size < 1 || !(src[0] & NODE_PREFIX_FLAG)) {
+        return size;
+    }
+    if (size < int(1 + sizeof(raw_16))) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    raw_16 prefix_len;
+    memcpy(&prefix_len, src + 1, sizeof(prefix_len));
+    const size_t prefix = decode_raw16(prefix_len);
+    const char *prefix_buf = src + 1 + sizeof(prefix_len);
+    const size_t start = 1 + sizeof(prefix_len) + prefix;
+    if (start > size_t(size)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    size_t count = 0;
+    size_t pos = start;
+    while (pos < size_t(size)) {
+        sized_buf key, value;
+        if (pos + sizeof(raw_kv_length) > size_t(size)) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        pos += read_kv(src + pos, &key, &value);
+        if (prefix + key.size > 0xfff) { // 12-bit key length
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        count++;
+    }
+    if (pos != size_t(size)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    size_t entries_size = 1 + (size - start) + count * prefix;
+    char *expanded = static_cast<char*>(
+            cb_malloc(entries_size + node_directory_size(count)));
+    if (!expanded) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    char *dst = expanded;
+    *(dst++) = src[0] & ~(NODE_PREFIX_FLAG | NODE_DIRECTORY_FLAG);
+    pos = start;
+    while (pos < size_t(size)) {
+        sized_buf key, value;
+        pos += read_kv(src + pos, &key, &value);
+        *(raw_kv_length*)dst = encode_kv_length(prefix + key.size, value.size);
+        dst += sizeof(raw_kv_length);
+        memcpy(dst, prefix_buf, prefix);
+        dst += prefix;
+        memcpy(dst, key.buf, key.size);
+        dst += key.size;
+        memcpy(dst, value.buf, value.size);
+        dst += value.size;
+    }
+
+    size_t expanded_size = write_node_directory(expanded, entries_size);
+    cb_free(*node);
+    *node = expanded;
+    return int(expanded_size);
+}
+
+uint32_t node_directory_count(const char *node, int size)
+{
+    raw_32 count;
+    if (!(node[0] & NODE_DIRECTORY_FLAG) || size < int(1 + sizeof(count))) {
+        return 0;
+    }
+    memcpy(&count, node + size - sizeof(count), sizeof(count));
+    return decode_raw32(count);
+}
+
+int node_entries_end(const char *node, int size)
+{
+    if (!(node[0] & NODE_DIRECTORY_FLAG)) {
+        return size;
+    }
+    uint64_t dirsize = node_directory_size(node_directory_count(node, size));
+    if (dirsize > uint64_t(size - 1)) {
+        return 0;
+    }
+    return size - int(dirsize);
+}
+
+int node_directory_entry(const char *node, int size, uint32_t index)
+{
+    raw_32 offset;
+    memcpy(&offset, node + node_entries_end(node, size) + index * sizeof(offset),
+           sizeof(offset));
+    return int(decode_raw32(offset));
+}
+
 node_pointer *read_root(void *buf, int size)
 {
     if (size == 0) {
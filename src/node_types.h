@@ -38,6 +38,25 @@ typedef struct {
     /* Variable-size reduce value follows */
 } raw_btree_root;
 
+/* Follows the roots in a file header, from disk version 16 on */
+typedef struct {
+    raw_48 height;
+    raw_48 prev_pos;
+    raw_48 skip_pos;
+} raw_header_chain;
+
+/* Follows the header chain in a file header, from disk version 17 on */
+typedef struct {
+    raw_08 doc_codec;
+} raw_header_codecs;
+
+/* Follows the roots (and header chain and codecs) in a file header, from
+ * disk version 15 on, if the file has a Bloom filter */
+typedef struct {
+    raw_48 pointer;
+    raw_48 update_seq;
+} raw_bloom_filter_root;
+
 /** Packed key-and-value length type. Key length is 12 bits, value length is 28. */
 typedef struct {
     uint8_t raw_kv[5];
@@ -103,6 +122,71 @@ size_t read_kv(const void *buf, sized_buf *key, sized_buf *value);
 
 void* write_kv(void *buf, sized_buf key, sized_buf value);
 
+/* The first byte of a B-tree node holds its type, KP_NODE or KV_NODE.
+ * From disk version 13 on, NODE_DIRECTORY_FLAG is also set in it when the
+ * node's key/value entries are followed by an offset directory: the
+ * 32-bit big-endian offset of each entry within the node, in order,
+ * then the 32-bit number of entries. */
+#define NODE_TYPE_MASK 0x0f
+#define NODE_DIRECTORY_FLAG 0x10
+
+/* From disk version 14 on, NODE_PREFIX_FLAG is set in the type byte of a
+ * node whose keys share a common prefix that is stored only once: the
+ * type byte is followed by the 16-bit prefix length and the prefix, then
+ * by the entries, whose keys have the prefix stripped. Such nodes don't
+ * have an offset directory on disk; expand_node() restores the full keys
+ * and adds one. */
+#define NODE_PREFIX_FLAG 0x20
+
+/**
+ * Returns the number of bytes needed for the offset directory of a node
+ * with the given number of entries.
+ */
+size_t node_directory_size(size_t count);
+
+/**
+ * Appends an offset directory for the entries in the first 'size' bytes of
+ * 'node' (including the type byte), and flags the node as having one.
+ * The buffer must have node_directory_size() bytes free past 'size'.
+ * @return The new size of the node
+ */
+size_t write_node_directory(char *node, size_t size);
+
+/**
+ * Writes to 'out' a prefix-compressed copy of the 'size' byte node, if
+ * its keys have a common prefix long enough to make it smaller.
+ * 'out' must have room for 'size' bytes.
+ * @return The size of the compressed node, or 0 if it wasn't compressed
+ */
+size_t prefix_compress_node(const char *node, size_t size, char *out);
+
+/**
+ * If '*node' is prefix-compressed, replaces it with a newly allocated copy
+ * that has the full keys and an offset directory, and frees the original.
+ * @return The new size of the node, or a negative error code in which case
+ *         '*node' is left as it is
+ */
+int expand_node(char **node, int size);
+
+/**
+ * Returns the offset just past the last key/value entry of a node of
+ * 'size' bytes, i.e. where its offset directory starts, if it has one.
+ * Returns 0 if the offset directory is malformed.
+ */
+int node_entries_end(const char *node, int size);
+
+/**
+ * Returns the number of entries listed in a node's offset directory, or 0
+ * if it doesn't have one.
+ */
+uint32_t node_directory_count(const char *node, int size);
+
+/**
+ * Returns the offset within the node of entry 'index' of its offset
+ * directory.
+ */
+int node_directory_entry(const char *node, int size, uint32_t index);
+
 
 /**
  * Reads a 48-bit sequence number out of a sized_buf.
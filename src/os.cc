@@ -19,8 +19,15 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <platform/cbassert.h>
+#ifdef HAVE_PWRITEV
+#include <limits.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <vector>
+#endif
 
 #include "internal.h"
+#include "os_uring.h"
 
 #undef LOG_IO
 #ifdef LOG_IO
@@ -48,9 +55,18 @@ public:
     ssize_t pread(couchstore_error_info_t* errinfo,
                   couch_file_handle handle, void* buf, size_t nbytes,
                   cs_off_t offset) override;
+    void pread_batch(couchstore_error_info_t* errinfo,
+                     couch_file_handle handle,
+                     couch_read_request* reqs,
+                     size_t count) override;
     ssize_t pwrite(couchstore_error_info_t* errinfo,
                    couch_file_handle handle, const void* buf,
                    size_t nbytes, cs_off_t offset) override;
+#ifdef HAVE_PWRITEV
+    ssize_t pwritev(couchstore_error_info_t* errinfo,
+                    couch_file_handle handle, const couch_iovec* iov,
+                    int iovcnt, cs_off_t offset) override;
+#endif
     cs_off_t goto_eof(couchstore_error_info_t* errinfo,
                       couch_file_handle handle) override;
     couchstore_error_t sync(couchstore_error_info_t* errinfo,
@@ -82,6 +98,12 @@ private:
     {
         return reinterpret_cast<File*>(handle);
     }
+
+    // Accounts for `nbytes` just written to the file, calling sync() if the
+    // periodic sync threshold has been reached.
+    couchstore_error_t add_bytes_written(couchstore_error_info_t* errinfo,
+                                         couch_file_handle handle,
+                                         size_t nbytes);
 };
 
 ssize_t PosixFileOps::pread(couchstore_error_info_t* errinfo,
@@ -107,6 +129,25 @@ ssize_t PosixFileOps::pread(couchstore_error_info_t* errinfo,
     return rv;
 }
 
+void PosixFileOps::pread_batch(couchstore_error_info_t* errinfo,
+                               couch_file_handle handle,
+                               couch_read_request* reqs,
+                               size_t count)
+{
+    auto* file = to_file(handle);
+    if (count > 1 && uring_pread_batch(file->fd, reqs, count)) {
+        // Retry failed reads individually; that also records the error.
+        for (size_t ii = 0; ii < count; ++ii) {
+            if (reqs[ii].result < 0) {
+                reqs[ii].result = pread(errinfo, handle, reqs[ii].buf,
+                                        reqs[ii].nbytes, reqs[ii].offset);
+            }
+        }
+        return;
+    }
+    FileOpsInterface::pread_batch(errinfo, handle, reqs, count);
+}
+
 ssize_t PosixFileOps::pwrite(couchstore_error_info_t* errinfo,
                              couch_file_handle handle,
                              const void* buf,
@@ -128,17 +169,70 @@ ssize_t PosixFileOps::pwrite(couchstore_error_info_t* errinfo,
         return (ssize_t) COUCHSTORE_ERROR_WRITE;
     }
 
-    file->bytes_written_since_last_sync += rv;
+    couchstore_error_t sync_rv = add_bytes_written(errinfo, handle, rv);
+    if (sync_rv != COUCHSTORE_SUCCESS) {
+        return sync_rv;
+    }
+
+    return rv;
+}
+
+#ifdef HAVE_PWRITEV
+ssize_t PosixFileOps::pwritev(couchstore_error_info_t* errinfo,
+                              couch_file_handle handle,
+                              const couch_iovec* iov,
+                              int iovcnt,
+                              cs_off_t offset)
+{
+    auto* file = to_file(handle);
+
+    // Anything beyond IOV_MAX elements is left for the caller to resubmit
+    // after the short write.
+    std::vector<struct iovec> vec(std::min(iovcnt, IOV_MAX));
+    size_t nbyte = 0;
+    for (size_t ii = 0; ii < vec.size(); ++ii) {
+        vec[ii].iov_base = const_cast<void*>(iov[ii].base);
+        vec[ii].iov_len = iov[ii].len;
+        nbyte += iov[ii].len;
+    }
+#ifdef LOG_IO
+    fprintf(stderr, "PWRITEV %8llx -- %8llx  (%6.1f kbytes, %d iovs)\n",
+            offset, offset+nbyte, nbyte/1024.0, int(vec.size()));
+#endif
+
+    ssize_t rv;
+    do {
+        rv = ::pwritev(file->fd, vec.data(), int(vec.size()), offset);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv < 0) {
+        save_errno(errinfo);
+        return (ssize_t) COUCHSTORE_ERROR_WRITE;
+    }
+
+    couchstore_error_t sync_rv = add_bytes_written(errinfo, handle, rv);
+    if (sync_rv != COUCHSTORE_SUCCESS) {
+        return sync_rv;
+    }
+
+    return rv;
+}
+#endif
+
+couchstore_error_t PosixFileOps::add_bytes_written(
+        couchstore_error_info_t* errinfo,
+        couch_file_handle handle,
+        size_t nbytes)
+{
+    auto* file = to_file(handle);
+    file->bytes_written_since_last_sync += nbytes;
     if ((file->periodic_sync_bytes > 0) &&
         (file->bytes_written_since_last_sync >= file->periodic_sync_bytes)) {
         couchstore_error_t sync_rv = sync(errinfo, handle);
         file->bytes_written_since_last_sync = 0;
-        if (sync_rv != COUCHSTORE_SUCCESS) {
-            return sync_rv;
-        }
+        return sync_rv;
     }
-
-    return rv;
+    return COUCHSTORE_SUCCESS;
 }
 
 couchstore_error_t PosixFileOps::open(couchstore_error_info_t* errinfo,
@@ -0,0 +1,369 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <platform/cbassert.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "internal.h"
+
+static void save_errno(couchstore_error_info_t *errinfo) {
+    if (errinfo) {
+        errinfo->error = errno;
+    }
+}
+
+/**
+ * File operations for read-only access to a file through a memory mapping
+ * of it: pread() is a memcpy out of the mapping, and borrow() hands out
+ * pointers into it directly.
+ *
+ * The file may be appended to by another process while it is open; the
+ * mapping is extended when a read goes past its end. The file is mapped
+ * into a range of address space reserved for it to grow into, about twice
+ * its size, so extending the mapping only maps the new part and borrowed
+ * pointers stay valid. Only once the file outgrows the reservation is it
+ * mapped again into a new one sized from its new size, the old one being
+ * kept until the file is closed.
+ * Truncating the file while it is mapped is not supported.
+ *
+ * A handle may be read from several threads at once (see
+ * couchstore_open_snapshot()).
+ */
+class MmapFileOps : public FileOpsInterface {
+public:
+    MmapFileOps() {}
+
+    couch_file_handle constructor(couchstore_error_info_t* errinfo) override;
+    couchstore_error_t open(couchstore_error_info_t* errinfo,
+                            couch_file_handle* handle, const char* path,
+                            int oflag) override;
+    couchstore_error_t close(couchstore_error_info_t* errinfo,
+                             couch_file_handle handle) override;
+    ssize_t pread(couchstore_error_info_t* errinfo,
+                  couch_file_handle handle, void* buf, size_t nbytes,
+                  cs_off_t offset) override;
+    ssize_t pwrite(couchstore_error_info_t* errinfo,
+                   couch_file_handle handle, const void* buf,
+                   size_t nbytes, cs_off_t offset) override;
+    const char* borrow(couch_file_handle handle, size_t nbytes,
+                       cs_off_t offset) override;
+    cs_off_t goto_eof(couchstore_error_info_t* errinfo,
+                      couch_file_handle handle) override;
+    couchstore_error_t sync(couchstore_error_info_t* errinfo,
+                            couch_file_handle handle) override;
+    couchstore_error_t advise(couchstore_error_info_t* errinfo,
+                              couch_file_handle handle, cs_off_t offset,
+                              cs_off_t len,
+                              couchstore_file_advice_t advice) override;
+    void destructor(couch_file_handle handle) override;
+
+private:
+    // The first `size` bytes of the file, mapped at `base`.
+    struct View {
+        const char* base;
+        size_t size;
+    };
+
+    // State of a single file handle.
+    struct File {
+        /// File descriptor the mapping was made from.
+        int fd = -1;
+
+        /// Current view of the file, replaced (never modified) by remap()
+        /// so that readers see a consistent base and size.
+        std::atomic<const View*> view{nullptr};
+
+        /// Serializes remap().
+        std::mutex mutex;
+        /// Every view published, freed on close().
+        std::vector<std::unique_ptr<View>> views;
+        /// Reserved address ranges (the last one being the current
+        /// view's), unmapped on close().
+        std::vector<std::pair<char*, size_t>> reservations;
+        /// Bytes of the last reservation mapped, a multiple of the page
+        /// size.
+        size_t mapped = 0;
+    };
+
+    static File* to_file(couch_file_handle handle)
+    {
+        return reinterpret_cast<File*>(handle);
+    }
+
+    // Maps the whole file if it has grown past the current view, and sets
+    // 'view' to the current view.
+    static couchstore_error_t remap(couchstore_error_info_t* errinfo,
+                                    File* file,
+                                    const View** view);
+};
+
+couchstore_error_t MmapFileOps::remap(couchstore_error_info_t* errinfo,
+                                      File* file,
+                                      const View** view)
+{
+    std::lock_guard<std::mutex> lh(file->mutex);
+    *view = file->view.load();
+    size_t size = *view ? (*view)->size : 0;
+
+    struct stat st;
+    if (fstat(file->fd, &st) < 0) {
+        save_errno(errinfo);
+        return COUCHSTORE_ERROR_READ;
+    }
+    if (size_t(st.st_size) <= size) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t map_size = (size_t(st.st_size) + page_size - 1) /
+                            page_size * page_size;
+    try {
+        std::unique_ptr<View> next(new View());
+        file->views.reserve(file->views.size() + 1);
+        file->reservations.reserve(file->reservations.size() + 1);
+
+        if (file->reservations.empty() ||
+            map_size > file->reservations.back().second) {
+            const size_t headroom = std::min(
+                    std::max(map_size, size_t(MMAP_MIN_HEADROOM)),
+                    size_t(MMAP_MAX_HEADROOM));
+            const size_t capacity = map_size + (headroom + page_size - 1) /
+                                               page_size * page_size;
+            void* reserved = mmap(nullptr, capacity, PROT_NONE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                  -1, 0);
+            if (reserved == MAP_FAILED) {
+                save_errno(errinfo);
+                return COUCHSTORE_ERROR_READ;
+            }
+            file->reservations.emplace_back(static_cast<char*>(reserved),
+                                            capacity);
+            file->mapped = 0;
+        }
+
+        // Map the part of the file past what is already mapped, in place.
+        char* base = file->reservations.back().first;
+        void* tail = mmap(base + file->mapped, map_size - file->mapped,
+                          PROT_READ, MAP_SHARED | MAP_FIXED, file->fd,
+                          file->mapped);
+        if (tail == MAP_FAILED) {
+            save_errno(errinfo);
+            return COUCHSTORE_ERROR_READ;
+        }
+        file->mapped = map_size;
+
+        next->base = base;
+        next->size = st.st_size;
+        *view = next.get();
+        file->views.push_back(std::move(next));
+        file->view.store(*view);
+    } catch (const std::bad_alloc&) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+couch_file_handle MmapFileOps::constructor(couchstore_error_info_t* errinfo)
+{
+    (void)errinfo;
+    return reinterpret_cast<couch_file_handle>(new File());
+}
+
+couchstore_error_t MmapFileOps::open(couchstore_error_info_t* errinfo,
+                                     couch_file_handle* handle,
+                                     const char* path,
+                                     int oflag)
+{
+    if ((oflag & O_ACCMODE) != O_RDONLY || (oflag & O_CREAT)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+
+    auto* file = to_file(*handle);
+    cb_assert(file && file->fd == -1);
+
+    int fd;
+    do {
+        fd = ::open(path, oflag | O_LARGEFILE);
+    } while (fd == -1 && errno == EINTR);
+
+    if (fd < 0) {
+        save_errno(errinfo);
+        if (errno == ENOENT) {
+            return COUCHSTORE_ERROR_NO_SUCH_FILE;
+        } else {
+            return COUCHSTORE_ERROR_OPEN_FILE;
+        }
+    }
+    file->fd = fd;
+
+    const View* view;
+    couchstore_error_t error = remap(errinfo, file, &view);
+    if (error != COUCHSTORE_SUCCESS) {
+        close(nullptr, *handle);
+    }
+    return error;
+}
+
+couchstore_error_t MmapFileOps::close(couchstore_error_info_t* errinfo,
+                                      couch_file_handle handle)
+{
+    auto* file = to_file(handle);
+    int rv = 0;
+    couchstore_error_t error = COUCHSTORE_SUCCESS;
+
+    for (auto& reservation : file->reservations) {
+        munmap(reservation.first, reservation.second);
+    }
+    file->view.store(nullptr);
+    file->views.clear();
+    file->reservations.clear();
+    file->mapped = 0;
+
+    if (file->fd != -1) {
+        do {
+            rv = ::close(file->fd);
+        } while (rv == -1 && errno == EINTR);
+    }
+    if (rv < 0) {
+        save_errno(errinfo);
+        error = COUCHSTORE_ERROR_FILE_CLOSE;
+    }
+    file->fd = -1;
+    return error;
+}
+
+ssize_t MmapFileOps::pread(couchstore_error_info_t* errinfo,
+                           couch_file_handle handle,
+                           void* buf,
+                           size_t nbyte,
+                           cs_off_t offset)
+{
+    auto* file = to_file(handle);
+    const View* view = file->view.load();
+    if (!view || offset + nbyte > view->size) {
+        couchstore_error_t error = remap(errinfo, file, &view);
+        if (error != COUCHSTORE_SUCCESS) {
+            return error;
+        }
+    }
+    if (!view || size_t(offset) >= view->size) {
+        return 0;
+    }
+
+    nbyte = std::min(nbyte, size_t(view->size - offset));
+    memcpy(buf, view->base + offset, nbyte);
+    return nbyte;
+}
+
+ssize_t MmapFileOps::pwrite(couchstore_error_info_t* errinfo,
+                            couch_file_handle handle,
+                            const void* buf,
+                            size_t nbyte,
+                            cs_off_t offset)
+{
+    if (errinfo) {
+        errinfo->error = EBADF;
+    }
+    return (ssize_t) COUCHSTORE_ERROR_WRITE;
+}
+
+const char* MmapFileOps::borrow(couch_file_handle handle,
+                                size_t nbytes,
+                                cs_off_t offset)
+{
+    auto* file = to_file(handle);
+    const View* view = file->view.load();
+    if ((!view || offset + nbytes > view->size) &&
+        remap(nullptr, file, &view) != COUCHSTORE_SUCCESS) {
+        return nullptr;
+    }
+    if (!view || offset + nbytes > view->size) {
+        return nullptr;
+    }
+    return view->base + offset;
+}
+
+cs_off_t MmapFileOps::goto_eof(couchstore_error_info_t* errinfo,
+                               couch_file_handle handle)
+{
+    auto* file = to_file(handle);
+    struct stat st;
+    if (fstat(file->fd, &st) < 0) {
+        save_errno(errinfo);
+        return static_cast<cs_off_t>(COUCHSTORE_ERROR_READ);
+    }
+    return st.st_size;
+}
+
+couchstore_error_t MmapFileOps::sync(couchstore_error_info_t* errinfo,
+                                     couch_file_handle handle)
+{
+    // Nothing is ever written through this handle.
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t MmapFileOps::advise(couchstore_error_info_t* errinfo,
+                                       couch_file_handle handle,
+                                       cs_off_t offset,
+                                       cs_off_t len,
+                                       couchstore_file_advice_t advice)
+{
+#ifdef POSIX_FADV_NORMAL
+    auto* file = to_file(handle);
+    int error = posix_fadvise(file->fd, offset, len, (int) advice);
+    if (error != 0) {
+        save_errno(errinfo);
+    }
+    switch(error) {
+        case EINVAL:
+        case ESPIPE:
+            return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+        case EBADF:
+            return COUCHSTORE_ERROR_OPEN_FILE;
+    }
+#else
+    (void) handle; (void)offset; (void)len; (void)advice;
+    (void)errinfo;
+#endif
+    return COUCHSTORE_SUCCESS;
+}
+
+void MmapFileOps::destructor(couch_file_handle handle)
+{
+    auto* file = to_file(handle);
+    delete file;
+}
+
+static MmapFileOps mmap_file_ops;
+
+FileOpsInterface* couch_get_mmap_file_ops(void)
+{
+    return &mmap_file_ops;
+}
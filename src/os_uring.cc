@@ -0,0 +1,247 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+#include "os_uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+/**
+ * Minimal io_uring, driven through the raw system calls: just enough to
+ * submit a batch of reads and wait for all of them to complete.
+ */
+class IoUring {
+public:
+    // Number of reads submitted at once.
+    static const unsigned ENTRIES = 64;
+
+    IoUring() = default;
+
+    ~IoUring() {
+        if (sqes) {
+            munmap(sqes, sqes_len);
+        }
+        if (cq_ptr && cq_ptr != sq_ptr) {
+            munmap(cq_ptr, cq_len);
+        }
+        if (sq_ptr) {
+            munmap(sq_ptr, sq_len);
+        }
+        if (ring_fd >= 0) {
+            ::close(ring_fd);
+        }
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool setup() {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring_fd = int(syscall(__NR_io_uring_setup, ENTRIES, &p));
+        if (ring_fd < 0) {
+            return false;
+        }
+
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        }
+        sq_ptr = map(sq_len, IORING_OFF_SQ_RING);
+        if (!sq_ptr) {
+            return false;
+        }
+        cq_ptr = single_mmap ? sq_ptr : map(cq_len, IORING_OFF_CQ_RING);
+        if (!cq_ptr) {
+            return false;
+        }
+        sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe*>(map(sqes_len,
+                                                     IORING_OFF_SQES));
+        if (!sqes) {
+            return false;
+        }
+
+        char* sq = static_cast<char*>(sq_ptr);
+        sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        char* cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    /**
+     * Reads up to ENTRIES requests, returning once all have completed.
+     * Returns false if the ring failed, in which case it must not be used
+     * again. Even then, no read submitted is still in flight, unless the
+     * ring can't be waited on either: then it must be torn down (by
+     * destroying it) before the requests' buffers are released.
+     */
+    bool read(int fd, couch_read_request* reqs, unsigned count) {
+        struct iovec iov[ENTRIES];
+        unsigned tail = *sq_tail;
+        for (unsigned ii = 0; ii < count; ++ii) {
+            iov[ii].iov_base = reqs[ii].buf;
+            iov[ii].iov_len = reqs[ii].nbytes;
+
+            unsigned index = tail & sq_mask;
+            struct io_uring_sqe* sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(&iov[ii]);
+            sqe->len = 1;
+            sqe->off = reqs[ii].offset;
+            sqe->user_data = ii;
+            sq_array[index] = index;
+            ++tail;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned to_submit = count;
+        unsigned completed = 0;
+        while (completed < count) {
+            unsigned head = *cq_head;
+            unsigned ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == ready) {
+                int rv = int(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                     count - completed,
+                                     IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (rv < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    // Reads already submitted would still complete into
+                    // the caller's buffers.
+                    wait_for_submitted(count - to_submit - completed);
+                    return false;
+                }
+                to_submit -= std::min(unsigned(rv), to_submit);
+                continue;
+            }
+            for (; head != ready; ++head, ++completed) {
+                const struct io_uring_cqe* cqe = &cqes[head & cq_mask];
+                reqs[cqe->user_data].result = cqe->res;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        return true;
+    }
+
+private:
+    // Waits for 'pending' submitted reads to complete, discarding their
+    // results, unless the ring can't be waited on.
+    void wait_for_submitted(unsigned pending) {
+        while (pending > 0) {
+            unsigned head = *cq_head;
+            unsigned ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == ready) {
+                int rv = int(syscall(__NR_io_uring_enter, ring_fd, 0, pending,
+                                     IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (rv < 0 && errno != EINTR) {
+                    return;
+                }
+                continue;
+            }
+            pending -= std::min(ready - head, pending);
+            __atomic_store_n(cq_head, ready, __ATOMIC_RELEASE);
+        }
+    }
+
+    void* map(size_t len, off_t offset) {
+        void* ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    int ring_fd = -1;
+    void* sq_ptr = nullptr;
+    size_t sq_len = 0;
+    void* cq_ptr = nullptr;
+    size_t cq_len = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    size_t sqes_len = 0;
+
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe* cqes = nullptr;
+};
+
+// Per-thread ring; set up on first use.
+static thread_local std::unique_ptr<IoUring> thread_ring;
+// Set once setting up a ring has failed, so it isn't retried on every batch.
+static thread_local bool thread_ring_unavailable = false;
+
+bool uring_pread_batch(int fd, couch_read_request* reqs, size_t count)
+{
+    if (thread_ring_unavailable) {
+        return false;
+    }
+    if (!thread_ring) {
+        thread_ring.reset(new (std::nothrow) IoUring());
+        if (!thread_ring || !thread_ring->setup()) {
+            thread_ring.reset();
+            thread_ring_unavailable = true;
+            return false;
+        }
+    }
+
+    for (size_t done = 0; done < count; done += IoUring::ENTRIES) {
+        unsigned batch = unsigned(std::min(count - done,
+                                           size_t(IoUring::ENTRIES)));
+        if (!thread_ring->read(fd, reqs + done, batch)) {
+            // Tearing the ring down also cancels any read still in flight.
+            thread_ring.reset();
+            thread_ring_unavailable = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+#else
+
+bool uring_pread_batch(int fd, couch_read_request* reqs, size_t count)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include <libcouchstore/couch_db.h>
+
+/**
+ * Performs a batch of reads from `fd` through a Linux io_uring, so that
+ * they are all in flight at once.
+ *
+ * Each thread gets its own ring on first use, shared by every file it
+ * reads. The `result` of each request is set to the number of bytes read,
+ * or to -errno if that read failed.
+ *
+ * @return false if io_uring isn't available (not built in, or refused by
+ *         the kernel), in which case the requests must be read some
+ *         other way.
+ */
+bool uring_pread_batch(int fd, couch_read_request* reqs, size_t count);
@@ -279,3 +279,8 @@ FileOpsInterface* create_default_file_ops(void)
 {
     return new WindowsFileOps();
 }
+
+FileOpsInterface* couch_get_mmap_file_ops(void)
+{
+    return NULL;
+}
@@ -34,6 +34,7 @@ struct TreeWriter {
     reduce_fn reduce;
     reduce_fn rereduce;
     void *user_reduce_ctx;
+    bool unique_keys;
 };
 
 
@@ -98,6 +99,12 @@ cleanup:
 }
 
 
+void TreeWriterRequireUniqueKeys(TreeWriter* writer)
+{
+    writer->unique_keys = true;
+}
+
+
 couchstore_error_t TreeWriterSort(TreeWriter* writer)
 {
     rewind(writer->file);
@@ -127,10 +134,17 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
     uint16_t klen;
     uint32_t vlen;
     sized_buf k, v;
+    // Copy of the previous key, if keys must be unique
+    sized_buf last = {NULL, 0};
+    bool have_last = false;
     int readerr;
     couchfile_modify_result* target_mr;
 
     error_unless(transient_arena && persistent_arena, COUCHSTORE_ERROR_ALLOC_FAIL);
+    if (writer->unique_keys) {
+        last.buf = static_cast<char*>(cb_malloc(UINT16_MAX));
+        error_unless(last.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    }
 
     rewind(writer->file);
 
@@ -168,6 +182,14 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
             error_pass(COUCHSTORE_ERROR_READ);
         }
         //printf("K: '%.*s'\n", k.size, k.buf);
+        if (last.buf) {
+            // The keys are sorted, so a repeated one follows itself.
+            error_unless(!have_last || writer->key_compare(&last, &k) != 0,
+                         COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+            memcpy(last.buf, k.buf, k.size);
+            last.size = k.size;
+            have_last = true;
+        }
         mr_push_item(&k, &v, target_mr);
         if (target_mr->count == 0) {
             /* No items queued, we must have just flushed. We can safely rewind the transient arena. */
@@ -188,6 +210,7 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
     *out_root = complete_new_btree(target_mr, &errcode);
 
 cleanup:
+    cb_free(last.buf);
     delete_arena(transient_arena);
     delete_arena(persistent_arena);
     return errcode;
@@ -37,6 +37,12 @@ void TreeWriterFree(TreeWriter* writer);
  */
 couchstore_error_t TreeWriterAddItem(TreeWriter* writer, sized_buf key, sized_buf value);
 
+/**
+ * Makes TreeWriterWrite() fail with COUCHSTORE_ERROR_INVALID_ARGUMENTS if
+ * a key was added more than once.
+ */
+void TreeWriterRequireUniqueKeys(TreeWriter* writer);
+
 /**
  * Sorts the key/value pairs already added.
  * The keys are sorted by ebin_cmp (basic lexicographic order by byte values).
@@ -976,7 +976,7 @@ static couchstore_error_t cleanup_btree(tree_file *file,
                                         node_pointer **out_root)
 {
     couchstore_error_t errcode;
-    couchfile_modify_request rq;
+    couchfile_modify_request rq{};
 
     rq.cmp = *cmp;
     rq.file = file;
@@ -987,6 +987,7 @@ static couchstore_error_t cleanup_btree(tree_file *file,
     rq.compacting = 0;
     rq.kv_chunk_threshold = VIEW_KV_CHUNK_THRESHOLD;
     rq.kp_chunk_threshold = VIEW_KP_CHUNK_THRESHOLD;
+    rq.spine = NULL;
     rq.purge_kp = purge_kp;
     rq.purge_kv = purge_kv;
     rq.enable_purging = 1;
@@ -1210,7 +1211,7 @@ static couchstore_error_t update_btree(const char *source_file,
                                        node_pointer **out_root)
 {
     couchstore_error_t ret = COUCHSTORE_SUCCESS;
-    couchfile_modify_request rq;
+    couchfile_modify_request rq{};
     node_pointer *newroot = (node_pointer *) root;
     arena *transient_arena = new_arena(0);
     FILE *f = NULL;
@@ -1259,6 +1260,7 @@ static couchstore_error_t update_btree(const char *source_file,
     rq.compacting = 0;
     rq.kv_chunk_threshold = VIEW_KV_CHUNK_THRESHOLD;
     rq.kp_chunk_threshold = VIEW_KP_CHUNK_THRESHOLD;
+    rq.spine = NULL;
     rq.purge_kp = purge_kp;
     rq.purge_kv = purge_kv;
     rq.guided_purge_ctx = purge_ctx;
@@ -449,7 +449,7 @@ static node_pointer *insert_items(tree_file *file, node_pointer *root,
 
     couchstore_error_t errcode;
     int i;
-    couchfile_modify_request rq;
+    couchfile_modify_request rq{};
     couchfile_modify_action *acts;
     node_pointer *nroot = NULL;
     int *arr1, *arr2;
@@ -558,7 +558,7 @@ void test_no_purge_items()
     int purge_sum[2] = {0, 0};
     Db *db = NULL;
     node_pointer *root = NULL, *newroot = NULL;
-    couchfile_modify_request purge_rq;
+    couchfile_modify_request purge_rq{};
     fprintf(stderr, "\nExecuting test_no_purge_items...\n");
 
     N = 211341;
@@ -605,7 +605,7 @@ void test_all_purge_items()
     int purge_sum[2] = {0, 0};
     Db *db = NULL;
     node_pointer *root = NULL, *newroot = NULL;
-    couchfile_modify_request purge_rq;
+    couchfile_modify_request purge_rq{};
     fprintf(stderr, "\nExecuting test_all_purge_items...\n");
 
     N = 211341;
@@ -649,7 +649,7 @@ void test_partial_purge_items()
     int purge_count = 0;
     Db *db = NULL;
     node_pointer *root = NULL, *newroot = NULL;
-    couchfile_modify_request purge_rq;
+    couchfile_modify_request purge_rq{};
     fprintf(stderr, "\nExecuting test_partial_purge_items...\n");
 
     N = 211341;
@@ -693,7 +693,7 @@ void test_partial_purge_items2()
     node_pointer *root = NULL, *newroot = NULL;
     int range_start, range_end;
     int count, purge_count = 0, iter_context = -1;
-    couchfile_modify_request purge_rq;
+    couchfile_modify_request purge_rq{};
     fprintf(stderr, "\nExecuting test_partial_purge_items2...\n");
 
     N = 320000;
@@ -742,7 +742,7 @@ void test_partial_purge_with_stop()
     int purge_count = 0;
     Db *db = NULL;
     node_pointer *root = NULL, *newroot = NULL;
-    couchfile_modify_request purge_rq;
+    couchfile_modify_request purge_rq{};
     fprintf(stderr, "\nExecuting test_partial_purge_items...\n");
 
     N = 211341;
@@ -787,7 +787,7 @@ void test_add_remove_purge()
     int purge_count = 0;
     Db *db = NULL;
     node_pointer *root = NULL, *newroot = NULL;
-    couchfile_modify_request purge_rq;
+    couchfile_modify_request purge_rq{};
     int *arr = NULL;
     couchfile_modify_action *acts = NULL;
     sized_buf *keys = NULL;
@@ -870,7 +870,7 @@ void test_only_single_leafnode()
     int purge_sum[2] = {0,0};
     Db *db = NULL;
     node_pointer *root = NULL, *newroot = NULL;
-    couchfile_modify_request purge_rq;
+    couchfile_modify_request purge_rq{};
 
     fprintf(stderr, "\nExecuting test_only_single_leafnode...\n");
     N = 2;
@@ -23,6 +23,7 @@
  */
 
 #include <gtest/gtest.h>
+#include <fcntl.h>
 
 #include "couchstoretest.h"
 #include "couchstoredoctest.h"
@@ -30,6 +31,10 @@
 
 #include <libcouchstore/couch_db.h>
 
+#include <mutex>
+#include <set>
+#include <thread>
+
 /**
  * Note: below internal Couchstore header files should be located
  *       at the end of all above includes. Otherwise it causes
@@ -37,6 +42,7 @@
  */
 #include "src/couch_btree.h"
 #include "src/internal.h"
+#include "src/node_cache.h"
 
 using namespace testing;
 
@@ -634,6 +640,775 @@ TEST_F(CouchstoreInternalTest, unbuffered_fileops) {
     EXPECT_EQ(db->file.ops, couchstore_get_default_file_ops());
 }
 
+/**
+ * Tests that a chunk spanning many blocks is read with at most two preads
+ * (the block holding its header, then the rest of its extent).
+ */
+TEST_F(CouchstoreInternalTest, large_chunk_read) {
+    ASSERT_EQ(COUCHSTORE_SUCCESS, open_db(COUCHSTORE_OPEN_FLAG_CREATE));
+    documents = Documents(1);
+    documents.setDoc(0, "big", std::string(200 * 1024, 'x'));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, documents.getDocs(),
+                                        documents.getDocInfos(), 1, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfo_by_id(db, "big", 3, &info));
+    {
+        EXPECT_CALL(ops, pread(_, _, _, _, _)).Times(2);
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_doc_with_docinfo(db, info, &doc, 0));
+    }
+    EXPECT_EQ(200 * 1024, doc->data.size);
+    EXPECT_EQ(std::string(200 * 1024, 'x'),
+              std::string(doc->data.buf, doc->data.size));
+    couchstore_free_document(doc);
+    couchstore_free_docinfo(info);
+}
+
+/**
+ * Tests that documents and headers written with vectored writes, both
+ * directly and through the write buffer, read back intact.
+ */
+TEST_F(CouchstoreInternalTest, vectored_write) {
+    std::string value(300 * 1024, '\0');
+    for (size_t ii = 0; ii < value.size(); ++ii) {
+        value[ii] = char(ii % 251);
+    }
+    for (couchstore_open_flags flags :
+         {couchstore_open_flags(0),
+          couchstore_open_flags(COUCHSTORE_OPEN_FLAG_UNBUFFERED)}) {
+        remove(filePath.c_str());
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_db(filePath.c_str(),
+                                     COUCHSTORE_OPEN_FLAG_CREATE | flags,
+                                     &db));
+        documents = Documents(2);
+        documents.setDoc(0, "small", "value");
+        documents.setDoc(1, "big", value);
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_save_documents(db, documents.getDocs(),
+                                            documents.getDocInfos(), 2, 0));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_db(filePath.c_str(),
+                                     COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_document(db, "big", 3, &doc, 0));
+        EXPECT_EQ(value, std::string(doc->data.buf, doc->data.size));
+        couchstore_free_document(doc);
+        doc = nullptr;
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_document(db, "small", 5, &doc, 0));
+        EXPECT_EQ("value", std::string(doc->data.buf, doc->data.size));
+        couchstore_free_document(doc);
+        doc = nullptr;
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+        db = nullptr;
+    }
+}
+
+/**
+ * Tests that a second handle on the same file is served entirely from
+ * blocks loaded into the shared block cache by the first one.
+ */
+TEST_F(CouchstoreInternalTest, shared_block_cache) {
+    const size_t docsInTest = 100;
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, docsInTest);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    couchstore_set_shared_block_cache_size(1024 * 1024);
+
+    std::vector<sized_buf> ids(docsInTest);
+    for (size_t ii = 0; ii < docsInTest; ++ii) {
+        ids[ii] = documents.getDoc(ii)->id;
+    }
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db_ex(filePath.c_str(),
+                                    COUCHSTORE_OPEN_WITH_SHARED_BLOCK_CACHE,
+                                    &ops, &db));
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfos_by_id(db, ids.data(), docsInTest, 0,
+                                        &Documents::docIterCheckCallback,
+                                        &documents));
+    EXPECT_EQ(static_cast<int>(docsInTest), documents.getCallbacks());
+
+    // Searching for the header isn't cached, so opening reads the file.
+    Db* db2 = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db_ex(filePath.c_str(),
+                                    COUCHSTORE_OPEN_WITH_SHARED_BLOCK_CACHE,
+                                    &ops, &db2));
+    {
+        EXPECT_CALL(ops, pread(_, _, _, _, _)).Times(0);
+        documents.resetCounters();
+        EXPECT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_docinfos_by_id(db2, ids.data(), docsInTest, 0,
+                                            &Documents::docIterCheckCallback,
+                                            &documents));
+        EXPECT_EQ(static_cast<int>(docsInTest), documents.getCallbacks());
+    }
+    EXPECT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db2));
+    EXPECT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db2));
+
+    couchstore_set_shared_block_cache_size(0);
+}
+
+/**
+ * Tests that a database opened read-only through a memory mapping can be
+ * read, and that the flag is refused for writable databases.
+ */
+TEST_F(CouchstoreInternalTest, mmap_read) {
+    const size_t docsInTest = 100;
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, docsInTest);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    EXPECT_EQ(COUCHSTORE_ERROR_INVALID_ARGUMENTS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_MMAP, &db));
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_RDONLY |
+                                 COUCHSTORE_OPEN_FLAG_MMAP,
+                                 &db));
+    std::vector<sized_buf> ids(docsInTest);
+    for (size_t ii = 0; ii < docsInTest; ++ii) {
+        ids[ii] = documents.getDoc(ii)->id;
+    }
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfos_by_id(db, ids.data(), docsInTest, 0,
+                                        &Documents::docIterCheckCallback,
+                                        &documents));
+    EXPECT_EQ(static_cast<int>(docsInTest), documents.getCallbacks());
+}
+
+/**
+ * Tests that the memory mapped file ops follow a file which is appended
+ * to, and that borrowed pointers survive the mapping being extended.
+ */
+TEST_F(CouchstoreInternalTest, mmap_file_growth) {
+    FileOpsInterface* mmap_ops = couch_get_mmap_file_ops();
+    if (!mmap_ops) {
+        return;
+    }
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, 10);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    couchstore_error_info_t errinfo;
+    couch_file_handle handle = mmap_ops->constructor(&errinfo);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              mmap_ops->open(&errinfo, &handle, filePath.c_str(), O_RDONLY));
+    cs_off_t size = mmap_ops->goto_eof(&errinfo, handle);
+    ASSERT_GT(size, 0);
+    const char* before = mmap_ops->borrow(handle, size, 0);
+    ASSERT_NE(nullptr, before);
+    std::string contents(before, size);
+    EXPECT_EQ(nullptr, mmap_ops->borrow(handle, size + 1, 0));
+    EXPECT_EQ(COUCHSTORE_ERROR_WRITE,
+              mmap_ops->pwrite(&errinfo, handle, "x", 1, size));
+
+    documents = Documents(1);
+    documents.setDoc(0, "grown", "value");
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_document(db, documents.getDoc(0),
+                                       documents.getDocInfo(0), 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    cs_off_t new_size = mmap_ops->goto_eof(&errinfo, handle);
+    ASSERT_GT(new_size, size);
+    std::vector<char> tail(new_size - size);
+    EXPECT_EQ(ssize_t(tail.size()),
+              mmap_ops->pread(&errinfo, handle, tail.data(), tail.size(),
+                              size));
+    // The mapping is extended in place, rather than mapped again.
+    EXPECT_EQ(before, mmap_ops->borrow(handle, new_size, 0));
+    EXPECT_EQ(contents, std::string(before, size));
+    EXPECT_EQ(0, mmap_ops->pread(&errinfo, handle, tail.data(), 1,
+                                 new_size));
+
+    EXPECT_EQ(COUCHSTORE_SUCCESS, mmap_ops->close(&errinfo, handle));
+    mmap_ops->destructor(handle);
+}
+
+/**
+ * Tests that a memory-mapped file that outgrows the address space reserved
+ * for it is mapped again, leaving what was borrowed before readable.
+ */
+TEST_F(CouchstoreInternalTest, mmap_file_outgrows_reservation) {
+    FileOpsInterface* mmap_ops = couch_get_mmap_file_ops();
+    if (!mmap_ops) {
+        return;
+    }
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, 10);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    couchstore_error_info_t errinfo;
+    couch_file_handle handle = mmap_ops->constructor(&errinfo);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              mmap_ops->open(&errinfo, &handle, filePath.c_str(), O_RDONLY));
+    cs_off_t size = mmap_ops->goto_eof(&errinfo, handle);
+    const char* before = mmap_ops->borrow(handle, size, 0);
+    ASSERT_NE(nullptr, before);
+    std::string contents(before, size);
+
+    // Grow the file well past its size plus MMAP_MIN_HEADROOM.
+    const int count = 64;
+    documents = Documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "big" + std::to_string(ii),
+                         std::string(64 * 1024, 'a' + ii % 26));
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, documents.getDocs(),
+                                        documents.getDocInfos(), count, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    cs_off_t new_size = mmap_ops->goto_eof(&errinfo, handle);
+    ASSERT_GT(new_size, size + MMAP_MIN_HEADROOM);
+    const char* after = mmap_ops->borrow(handle, new_size, 0);
+    ASSERT_NE(nullptr, after);
+    EXPECT_NE(before, after);
+    EXPECT_EQ(contents, std::string(before, size));
+    EXPECT_EQ(contents, std::string(after, size));
+
+    EXPECT_EQ(COUCHSTORE_SUCCESS, mmap_ops->close(&errinfo, handle));
+    mmap_ops->destructor(handle);
+}
+
+/**
+ * Tests that a batch of reads returns the same data as individual preads,
+ * including for batches larger than can be submitted at once.
+ */
+TEST_F(CouchstoreInternalTest, pread_batch) {
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, 100);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    FileOpsInterface* file_ops = couchstore_get_default_file_ops();
+    couchstore_error_info_t errinfo;
+    couch_file_handle handle = file_ops->constructor(&errinfo);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              file_ops->open(&errinfo, &handle, filePath.c_str(), O_RDONLY));
+    cs_off_t size = file_ops->goto_eof(&errinfo, handle);
+    std::vector<char> contents(size);
+    ASSERT_EQ(ssize_t(size),
+              file_ops->pread(&errinfo, handle, contents.data(), size, 0));
+
+    const size_t count = 200;
+    const size_t nbytes = 100;
+    std::vector<char> bufs(count * nbytes);
+    std::vector<couch_read_request> reqs(count);
+    for (size_t ii = 0; ii < count; ++ii) {
+        reqs[ii] = {&bufs[ii * nbytes], nbytes,
+                    cs_off_t((ii * 7919) % (size - nbytes)), 0};
+    }
+    reqs.back().offset = size;
+    file_ops->pread_batch(&errinfo, handle, reqs.data(), count);
+
+    for (size_t ii = 0; ii + 1 < count; ++ii) {
+        ASSERT_EQ(ssize_t(nbytes), reqs[ii].result);
+        EXPECT_EQ(0, memcmp(reqs[ii].buf, &contents[reqs[ii].offset], nbytes));
+    }
+    EXPECT_EQ(0, reqs.back().result);
+
+    EXPECT_EQ(COUCHSTORE_SUCCESS, file_ops->close(&errinfo, handle));
+    file_ops->destructor(handle);
+}
+
+/**
+ * Tests multi-key lookups, whose child nodes are read in batches, through
+ * each of the read paths.
+ */
+TEST_F(CouchstoreInternalTest, batched_multi_get) {
+    const size_t docsInTest = 5000;
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, docsInTest);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    std::vector<sized_buf> ids(docsInTest);
+    for (size_t ii = 0; ii < docsInTest; ++ii) {
+        ids[ii] = documents.getDoc(ii)->id;
+    }
+
+    for (couchstore_open_flags flags :
+         {couchstore_open_flags(0),
+          couchstore_open_flags(COUCHSTORE_OPEN_FLAG_UNBUFFERED),
+          couchstore_open_flags(1 << 5)}) {
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_db(filePath.c_str(),
+                                     COUCHSTORE_OPEN_FLAG_RDONLY | flags,
+                                     &db));
+        documents.resetCounters();
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_docinfos_by_id(db, ids.data(), docsInTest, 0,
+                                            &Documents::docIterCheckCallback,
+                                            &documents));
+        EXPECT_EQ(static_cast<int>(docsInTest), documents.getCallbacks());
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+        db = nullptr;
+    }
+}
+
+/**
+ * Tests that scans of a database opened with COUCHSTORE_OPEN_WITH_PREFETCH
+ * advise the file ops of upcoming child nodes, and that other scans don't.
+ */
+TEST_F(CouchstoreInternalTest, prefetch_children) {
+    const size_t docsInTest = 2000;
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, docsInTest);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    for (bool prefetch : {false, true}) {
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_db_ex(filePath.c_str(),
+                                        prefetch ? couchstore_open_flags(
+                                                           COUCHSTORE_OPEN_WITH_PREFETCH)
+                                                 : couchstore_open_flags(0),
+                                        &ops, &db));
+        {
+            EXPECT_CALL(ops, advise(_, _, _, _,
+                                    COUCHSTORE_FILE_ADVICE_WILLNEED))
+                    .Times(prefetch ? AtLeast(2) : Exactly(0));
+            documents.resetCounters();
+            ASSERT_EQ(COUCHSTORE_SUCCESS,
+                      couchstore_changes_since(db, 0, 0,
+                                               &Documents::countCallback,
+                                               &documents));
+            EXPECT_EQ(static_cast<int>(docsInTest), documents.getCallbacks());
+        }
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+        db = nullptr;
+    }
+}
+
+/**
+ * Tests that a Bloom filter built by compaction answers lookups of missing
+ * IDs without reading the by-id index, and that documents saved after the
+ * filter was written are still found once the database is reopened.
+ */
+TEST_F(CouchstoreInternalTest, bloom_filter) {
+    const size_t docsInTest = 2000;
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, docsInTest);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_compact_db_ex(db, compactPath.c_str(),
+                                       COUCHSTORE_COMPACT_WITH_BLOOM_FILTER,
+                                       nullptr, nullptr, nullptr,
+                                       couchstore_get_default_file_ops()));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    std::vector<std::string> missing(docsInTest);
+    std::vector<sized_buf> ids(docsInTest);
+    for (size_t ii = 0; ii < docsInTest; ++ii) {
+        missing[ii] = "missing" + std::to_string(ii);
+        ids[ii] = {&missing[ii][0], missing[ii].size()};
+    }
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db_ex(compactPath.c_str(),
+                                    COUCHSTORE_OPEN_FLAG_UNBUFFERED,
+                                    &ops, &db));
+    EXPECT_NE(0u, db->header.bloom_filter_pos);
+    {
+        // Only the filter itself, and the by-id index for the odd false
+        // positive, should be read.
+        EXPECT_CALL(ops, pread(_, _, _, _, _)).Times(AtMost(docsInTest / 10));
+        for (size_t ii = 0; ii < docsInTest; ++ii) {
+            EXPECT_EQ(COUCHSTORE_ERROR_DOC_NOT_FOUND,
+                      couchstore_docinfo_by_id(db, ids[ii].buf, ids[ii].size,
+                                               &info));
+        }
+        documents.resetCounters();
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_docinfos_by_id(db, ids.data(), docsInTest, 0,
+                                            &Documents::countCallback,
+                                            &documents));
+        EXPECT_EQ(0, documents.getCallbacks());
+    }
+    for (size_t ii = 0; ii < docsInTest; ii += 100) {
+        ids[ii] = documents.getDoc(ii)->id;
+    }
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfos_by_id(db, ids.data(), docsInTest, 0,
+                                        &Documents::countCallback,
+                                        &documents));
+    EXPECT_EQ(static_cast<int>(docsInTest / 100), documents.getCallbacks());
+
+    // Save IDs the filter hasn't seen; they are added back from the
+    // by-sequence index when the filter is next loaded.
+    Documents added(10);
+    for (int ii = 0; ii < 10; ++ii) {
+        added.setDoc(ii, "added" + std::to_string(ii), "data");
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, added.getDocs(),
+                                        added.getDocInfos(), 10, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(compactPath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    for (int ii = 0; ii < 10; ++ii) {
+        sized_buf id = added.getDoc(ii)->id;
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_docinfo_by_id(db, id.buf, id.size, &info));
+        couchstore_free_docinfo(info);
+        info = nullptr;
+    }
+    EXPECT_NE(0u, db->header.bloom_filter_pos);
+}
+
+/**
+ * Tests that the header is found behind a long run of uncommitted data
+ * with a handful of large reads, rather than one per block.
+ */
+TEST_F(CouchstoreInternalTest, find_header_behind_uncommitted_data) {
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, 10);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    const int uncommitted = 1000;
+    Documents tail(uncommitted);
+    for (int ii = 0; ii < uncommitted; ++ii) {
+        tail.setDoc(ii, "tail" + std::to_string(ii), std::string(4096, 'x'));
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, tail.getDocs(), tail.getDocInfos(),
+                                        uncommitted, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    {
+        // Windows growing from one block to HEADER_SEARCH_WINDOW over the
+        // ~4MB tail, then the header itself.
+        EXPECT_CALL(ops, pread(_, _, _, _, _)).Times(AtMost(16));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, open_db(COUCHSTORE_OPEN_FLAG_RDONLY));
+    }
+    EXPECT_EQ(10u, db->header.update_seq);
+}
+
+/**
+ * Tests that a window which can't be read doesn't stop the header search;
+ * its blocks are checked one at a time instead.
+ */
+TEST_F(CouchstoreInternalTest, find_header_after_failed_window_read) {
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, 10);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    const int uncommitted = 10;
+    Documents tail(uncommitted);
+    for (int ii = 0; ii < uncommitted; ++ii) {
+        tail.setDoc(ii, "tail" + std::to_string(ii), std::string(4096, 'x'));
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, tail.getDocs(), tail.getDocInfos(),
+                                        uncommitted, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    {
+        InSequence s;
+        EXPECT_CALL(ops, pread(_, _, _, _, _))
+                .Times(2)
+                .WillRepeatedly(Return(COUCHSTORE_ERROR_READ));
+        EXPECT_CALL(ops, pread(_, _, _, _, _)).Times(AnyNumber());
+        ASSERT_EQ(COUCHSTORE_SUCCESS, open_db(COUCHSTORE_OPEN_FLAG_RDONLY));
+    }
+    EXPECT_EQ(10u, db->header.update_seq);
+}
+
+/**
+ * Tests that rewinding to a sequence number follows the header chain with
+ * a logarithmic number of reads rather than scanning back through the file.
+ */
+TEST_F(CouchstoreInternalTest, rewind_to_seq_reads) {
+    const int commits = 500;
+    Documents docs(commits);
+    docs.generateDocs();
+    ASSERT_EQ(COUCHSTORE_SUCCESS, open_db(COUCHSTORE_OPEN_FLAG_CREATE));
+    for (int ii = 0; ii < commits; ++ii) {
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_save_document(db, docs.getDoc(ii),
+                                           docs.getDocInfo(ii), 0));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, open_db(COUCHSTORE_OPEN_FLAG_RDONLY));
+    {
+        EXPECT_CALL(ops, pread(_, _, _, _, _)).Times(AtMost(60));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_rewind_to_seq(db, 7));
+    }
+    EXPECT_EQ(7u, db->header.update_seq);
+}
+
+/**
+ * Tests that a commit whose header chain ancestor can't be read still
+ * succeeds, restarting the chain at its header.
+ */
+TEST_F(CouchstoreInternalTest, commit_restarts_unreadable_chain) {
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, 10);
+    for (int ii = 0; ii < 3; ++ii) {
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    }
+    ASSERT_EQ(3u, db->header.chain.height);
+
+    {
+        EXPECT_CALL(ops, pread(_, _, _, _, _))
+                .WillRepeatedly(Return(COUCHSTORE_ERROR_READ));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    }
+    EXPECT_EQ(0u, db->header.chain.height);
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    EXPECT_EQ(1u, db->header.chain.height);
+}
+
+/**
+ * Tests the buffered IO settings: the write buffer capacity can be set
+ * when opening, and document bodies are read through a buffer of their
+ * own, so that reading consecutive documents takes few reads.
+ */
+TEST_F(CouchstoreInternalTest, buffer_policies) {
+    const int count = 200;
+    documents = Documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(ii),
+                         std::string(1024, 'a' + ii % 26));
+    }
+
+    {
+        // 4KB write buffers.
+        EXPECT_CALL(ops, pwrite(_, _, _, _, _))
+                .Times(AtLeast(count * 1024 / (4 * 1024)));
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_db_ex(filePath.c_str(),
+                                        COUCHSTORE_OPEN_FLAG_CREATE |
+                                        (uint64_t(1) << 32),
+                                        &ops, &db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_save_documents(db, documents.getDocs(),
+                                            documents.getDocInfos(), count,
+                                            0));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+        db = nullptr;
+    }
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db_ex(filePath.c_str(), 0, &ops, &db));
+    {
+        // About 200KB of bodies, read in 64KB units, plus the by-seq
+        // index.
+        EXPECT_CALL(ops, pread(_, _, _, _, _)).Times(AtMost(count / 8));
+        documents.resetCounters();
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                           &documents));
+        EXPECT_EQ(count, documents.getCallbacks());
+    }
+}
+
+/**
+ * Tests that scanning the by-sequence index, whose nodes were written out
+ * one after the other, is detected as a stream and read ahead in growing
+ * chunks instead of one read buffer at a time.
+ */
+TEST_F(CouchstoreInternalTest, readahead) {
+    const size_t docsInTest = 5000;
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, docsInTest);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db_ex(filePath.c_str(), 0, &ops, &db));
+    {
+        EXPECT_CALL(ops, pread(_, _, _, _, _)).Times(AtMost(10));
+        documents.resetCounters();
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_changes_since(db, 0, 0, &Documents::countCallback,
+                                           &documents));
+        EXPECT_EQ(static_cast<int>(docsInTest), documents.getCallbacks());
+    }
+}
+
+/**
+ * Tests that the right edge of the by-sequence tree is kept between saves,
+ * so that appending to it reads less than when it has to be read back.
+ */
+TEST_F(CouchstoreInternalTest, seq_tree_right_spine) {
+    const int batches = 20;
+    const int batch = 100;
+    const int count = batches * batch;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, open_db(COUCHSTORE_OPEN_FLAG_CREATE));
+    documents = Documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(ii), "value");
+    }
+
+    size_t reads = 0;
+    ON_CALL(ops, pread(_, _, _, _, _))
+            .WillByDefault(Invoke([this, &reads](
+                    couchstore_error_info_t* errinfo, couch_file_handle handle,
+                    void* buf, size_t nbytes, cs_off_t offset) -> ssize_t {
+                ++reads;
+                return ops.get_wrapped()->pread(errinfo, handle, buf, nbytes,
+                                                offset);
+            }));
+    auto save_batch = [this, &reads](int first) -> size_t {
+        reads = 0;
+        EXPECT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_save_documents(db,
+                                            documents.getDocs() + first,
+                                            documents.getDocInfos() + first,
+                                            batch, 0));
+        EXPECT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+        return reads;
+    };
+
+    for (int ii = 0; ii < batches - 2; ++ii) {
+        save_batch(ii * batch);
+    }
+    ASSERT_NE(nullptr, db->seq_spine);
+    EXPECT_LT(1u, db->seq_spine->getDepth());
+    size_t kept_reads = save_batch((batches - 2) * batch);
+
+    // Forget the edge: the next save has to read it back.
+    delete db->seq_spine;
+    db->seq_spine = nullptr;
+    size_t cold_reads = save_batch((batches - 1) * batch);
+    EXPECT_LT(kept_reads, cold_reads);
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(), 0, &db));
+    EXPECT_EQ(uint64_t(count), db->header.update_seq);
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                       &documents));
+    EXPECT_EQ(count, documents.getCallbacks());
+}
+
+/**
+ * Tests that the by-sequence nodes read to count changes are kept, so that
+ * counting the changes in similar ranges again doesn't read the file.
+ */
+TEST_F(CouchstoreInternalTest, changes_count_cache) {
+    const size_t docsInTest = 5000;
+    open_db_and_populate(COUCHSTORE_OPEN_FLAG_CREATE, docsInTest);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db_ex(filePath.c_str(), 0, &ops, &db));
+    uint64_t count;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_count(db, 1000, docsInTest, &count));
+    EXPECT_EQ(docsInTest - 999, count);
+    {
+        EXPECT_CALL(ops, pread(_, _, _, _, _)).Times(0);
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_changes_count(db, 1000, docsInTest, &count));
+        EXPECT_EQ(docsInTest - 999, count);
+        // Both edges are in the same leaves as before.
+        uint64_t min_seqs[] = {1001, 1002};
+        uint64_t max_seqs[] = {docsInTest - 1, docsInTest};
+        uint64_t counts[2];
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_changes_counts(db, min_seqs, max_seqs, 2,
+                                            counts));
+        EXPECT_EQ(docsInTest - 1001, counts[0]);
+        EXPECT_EQ(docsInTest - 1001, counts[1]);
+    }
+}
+
+/**
+ * Tests that with background flushing the IO buffer is written out on
+ * another thread, and that an error doing so is returned to the caller,
+ * along with its OS error, no later than the next commit. No further
+ * buffers are written once one has failed, and every later commit fails
+ * too, even once the file can be written again.
+ */
+TEST_F(CouchstoreInternalTest, background_flush_write_error) {
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db_ex(filePath.c_str(),
+                                    COUCHSTORE_OPEN_FLAG_CREATE |
+                                    COUCHSTORE_OPEN_WITH_BACKGROUND_FLUSH,
+                                    &ops, &db));
+    const int count = 500;
+    documents = Documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(ii),
+                         std::string(1024, 'x'));
+    }
+
+    std::mutex mutex;
+    std::multiset<std::thread::id> writers;
+    ON_CALL(ops, pwrite(_, _, _, _, _))
+            .WillByDefault(Invoke([&mutex, &writers](
+                    couchstore_error_info_t* errinfo, couch_file_handle,
+                    const void*, size_t, cs_off_t) -> ssize_t {
+                std::lock_guard<std::mutex> lh(mutex);
+                writers.insert(std::this_thread::get_id());
+                errinfo->error = ENOSPC;
+                return COUCHSTORE_ERROR_WRITE;
+            }));
+
+    couchstore_error_t err = couchstore_save_documents(
+            db, documents.getDocs(), documents.getDocInfos(), count, 0);
+    if (err == COUCHSTORE_SUCCESS) {
+        err = couchstore_commit(db);
+    }
+    EXPECT_EQ(COUCHSTORE_ERROR_WRITE, err);
+    EXPECT_EQ(ENOSPC, db->file.lastError.error);
+
+    {
+        std::lock_guard<std::mutex> lh(mutex);
+        ASSERT_EQ(1u, writers.size());
+        EXPECT_EQ(0u, writers.count(std::this_thread::get_id()));
+    }
+
+    ops.DelegateToFake();
+    EXPECT_EQ(COUCHSTORE_ERROR_WRITE, couchstore_commit(db));
+}
+
 TEST_F(FileOpsErrorInjectionTest, dbopen_fileopen_fail) {
     EXPECT_CALL(ops, open(_, _, _, _)).WillOnce(Return(COUCHSTORE_ERROR_OPEN_FILE));
     EXPECT_EQ(COUCHSTORE_ERROR_OPEN_FILE, open_db(COUCHSTORE_OPEN_FLAG_CREATE));
@@ -768,7 +1543,7 @@ TEST_P(DocInfoById, fail) {
     }
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, DocInfoById,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 typedef ParameterisedFileOpsErrorInjectionTest DocInfoBySeq;
@@ -788,7 +1563,7 @@ TEST_P(DocInfoBySeq, fail) {
     couchstore_free_docinfo(info);
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, DocInfoBySeq,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 typedef ParameterisedFileOpsErrorInjectionTest OpenDocRead;
@@ -826,7 +1601,7 @@ TEST_P(DocByInfoRead, fail) {
     couchstore_free_docinfo(info);
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, DocByInfoRead,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 static int changes_callback(Db *db, DocInfo *docinfo, void *ctx) {
@@ -851,7 +1626,7 @@ TEST_P(ChangesSinceRead, fail) {
     couchstore_free_docinfo(info);
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, ChangesSinceRead,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 typedef ParameterisedFileOpsErrorInjectionTest AllDocsRead;
@@ -872,7 +1647,7 @@ TEST_P(AllDocsRead, fail) {
     couchstore_free_docinfo(info);
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, AllDocsRead,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 typedef ParameterisedFileOpsErrorInjectionTest DocInfosByIdRead;
@@ -891,7 +1666,7 @@ TEST_P(DocInfosByIdRead, fail) {
     }
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, DocInfosByIdRead,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 typedef ParameterisedFileOpsErrorInjectionTest DocInfosBySeqRead;
@@ -912,7 +1687,7 @@ TEST_P(DocInfosBySeqRead, fail) {
     couchstore_free_docinfo(info);
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, DocInfosBySeqRead,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 static int tree_walk_callback(Db *db, int depth, const DocInfo* doc_info,
@@ -939,7 +1714,7 @@ TEST_P(WalkIdTreeRead, fail) {
     couchstore_free_docinfo(info);
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, WalkIdTreeRead,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 typedef ParameterisedFileOpsErrorInjectionTest WalkSeqTreeRead;
@@ -960,7 +1735,7 @@ TEST_P(WalkSeqTreeRead, fail) {
     couchstore_free_docinfo(info);
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, WalkSeqTreeRead,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 typedef ParameterisedFileOpsErrorInjectionTest LocalDocFileWrite;
@@ -1001,7 +1776,7 @@ TEST_P(LocalDocFileRead, fail) {
     }
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, LocalDocFileRead,
-                        ::testing::Range(0, 2),
+                        ::testing::Range(0, 1),
                         ::testing::PrintToStringParamName());
 
 typedef ParameterisedFileOpsErrorInjectionTest CompactSourceRead;
@@ -1019,7 +1794,7 @@ TEST_P(CompactSourceRead, fail) {
     }
 }
 INSTANTIATE_TEST_CASE_P(Parameterised, CompactSourceRead,
-                        ::testing::Range(0, 4),
+                        ::testing::Range(0, 2),
                         ::testing::PrintToStringParamName());
 
 typedef ParameterisedFileOpsErrorInjectionTest CompactTargetWrite;
@@ -11,14 +11,19 @@
 #include "internal.h"
 #include "node_types.h"
 #include "reduces.h"
+#include "util.h"
 
 #include <gtest/gtest.h>
 #include <libcouchstore/couch_db.h>
+#include <platform/cb_malloc.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <fstream>
 #include <limits>
 #include <random>
 #include <thread>
+#include <vector>
 
 using ::testing::_;
 
@@ -325,6 +330,348 @@ TEST_F(CouchstoreTest, compressed_doc_body)
     EXPECT_EQ(0, documents.getDeleted());
 }
 
+/**
+ * Tests that in files older than disk version 17, which only hold Snappy
+ * compressed bodies, the codec bits of content_meta are left as they are
+ * and aren't taken for a codec.
+ */
+TEST_F(CouchstoreTest, compressed_doc_body_without_codec_ids)
+{
+    const auto content_meta = couchstore_content_meta_flags(
+            COUCH_DOC_IS_COMPRESSED | 0x20);
+    Documents documents(1);
+    documents.setDoc(0, "doc1", std::string(512, 'a'));
+    documents.setContentMeta(0, content_meta);
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE |
+                                 COUCHSTORE_OPEN_WITH_LEGACY_CRC,
+                                 &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, documents.getDocs(),
+                                        documents.getDocInfos(), 1,
+                                        COMPRESS_DOC_BODIES));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    DocInfo* info = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfo_by_id(db, "doc1", 4, &info));
+    EXPECT_EQ(int(content_meta), int(info->content_meta));
+    Doc* doc = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_doc_with_docinfo(db, info, &doc,
+                                               DECOMPRESS_DOC_BODIES));
+    EXPECT_EQ(std::string(512, 'a'),
+              std::string(doc->data.buf, doc->data.size));
+    couchstore_free_document(doc);
+    couchstore_free_docinfo(info);
+
+    // Upgrading the file clears the bits, which now hold the codec.
+    std::string target = filePath + ".upgraded";
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_compact_db_ex(db, target.c_str(),
+                                       COUCHSTORE_COMPACT_FLAG_UPGRADE_DB,
+                                       nullptr, nullptr, nullptr,
+                                       couchstore_get_default_file_ops()));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_db(target.c_str(), 0, &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfo_by_id(db, "doc1", 4, &info));
+    EXPECT_EQ(int(COUCH_DOC_IS_COMPRESSED), int(info->content_meta));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_doc_with_docinfo(db, info, &doc,
+                                               DECOMPRESS_DOC_BODIES));
+    EXPECT_EQ(std::string(512, 'a'),
+              std::string(doc->data.buf, doc->data.size));
+    couchstore_free_document(doc);
+    couchstore_free_docinfo(info);
+    ASSERT_EQ(0, remove(target.c_str()));
+}
+
+/**
+ * Tests that compressing document bodies in parallel writes the same file
+ * as compressing them one by one.
+ */
+TEST_F(CouchstoreTest, compressed_doc_body_in_parallel)
+{
+    const int count = 500;
+    Documents documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(ii),
+                         std::string(2048, 'a' + ii % 26));
+        if (ii % 3) {
+            documents.setContentMeta(ii, COUCH_DOC_IS_COMPRESSED);
+        }
+    }
+
+    std::string serialPath = filePath + ".serial";
+    for (auto* path : {&filePath, &serialPath}) {
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_db(path->c_str(),
+                                     COUCHSTORE_OPEN_FLAG_CREATE, &db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_save_documents(
+                          db, documents.getDocs(), documents.getDocInfos(),
+                          count,
+                          path == &filePath ? COMPRESS_DOC_BODIES_IN_PARALLEL
+                                            : COMPRESS_DOC_BODIES));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+        db = nullptr;
+    }
+
+    std::ifstream parallelFile(filePath, std::ios::binary);
+    std::ifstream serialFile(serialPath, std::ios::binary);
+    std::string parallel((std::istreambuf_iterator<char>(parallelFile)),
+                         std::istreambuf_iterator<char>());
+    std::string serial((std::istreambuf_iterator<char>(serialFile)),
+                       std::istreambuf_iterator<char>());
+    EXPECT_EQ(serial.size(), parallel.size());
+    EXPECT_TRUE(serial == parallel);
+    ASSERT_EQ(0, remove(serialPath.c_str()));
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_db(filePath.c_str(), 0, &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                       &documents));
+    EXPECT_EQ(count, documents.getCallbacks());
+}
+
+/**
+ * Tests that B-tree nodes and document bodies are compressed with the
+ * codecs selected when opening the file, are read back without selecting
+ * them, and are converted to other codecs by compaction.
+ */
+TEST_F(CouchstoreTest, codecs)
+{
+#ifdef HAVE_ZSTD
+    const couchstore_codec coldCodec = COUCHSTORE_CODEC_ZSTD;
+#else
+    const couchstore_codec coldCodec = COUCHSTORE_CODEC_LZ4;
+#endif
+    const int count = 200;
+    Documents documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(1000 + ii),
+                         std::string(512, 'a' + ii % 26));
+        if (ii % 2) {
+            documents.setContentMeta(ii, COUCH_DOC_IS_COMPRESSED);
+        }
+    }
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE |
+                                 couchstore_encode_codec_flags(
+                                         COUCHSTORE_CODEC_LZ4, coldCodec),
+                                 &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, documents.getDocs(),
+                                        documents.getDocInfos(), count,
+                                        COMPRESS_DOC_BODIES));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    // Each node starts with its codec, and each compressed body's codec
+    // is in its content_meta.
+    auto checkCodecs = [this](couchstore_codec nodeCodec,
+                              couchstore_codec docCodec) {
+        char* node = nullptr;
+        ASSERT_LT(0, pread_bin(&db->file, db->header.by_id_root->pointer,
+                               &node));
+        EXPECT_EQ(nodeCodec, couchstore_codec(node[0]));
+        cb_free(node);
+
+        DocInfo* info = nullptr;
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_docinfo_by_id(db, "doc1001", 7, &info));
+        EXPECT_EQ(COUCH_DOC_IS_COMPRESSED | (docCodec << 4),
+                  int(info->content_meta));
+        couchstore_free_docinfo(info);
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_docinfo_by_id(db, "doc1000", 7, &info));
+        EXPECT_EQ(0, int(info->content_meta));
+        couchstore_free_docinfo(info);
+    };
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_db(filePath.c_str(), 0, &db));
+    checkCodecs(COUCHSTORE_CODEC_LZ4, coldCodec);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                       &documents));
+    EXPECT_EQ(count, documents.getCallbacks());
+
+    // Compaction writes nodes with the codec the source was opened with
+    // (Snappy), and converts the bodies.
+    std::string target = filePath + ".compacted";
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_compact_db_ex(db, target.c_str(),
+                                       COUCHSTORE_COMPACT_CONVERT_DOC_BODIES |
+                                       couchstore_encode_codec_flags(
+                                               COUCHSTORE_CODEC_SNAPPY,
+                                               COUCHSTORE_CODEC_LZ4),
+                                       nullptr, nullptr, nullptr,
+                                       couchstore_get_default_file_ops()));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_db(target.c_str(), 0, &db));
+    checkCodecs(COUCHSTORE_CODEC_SNAPPY, COUCHSTORE_CODEC_LZ4);
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                       &documents));
+    EXPECT_EQ(count, documents.getCallbacks());
+
+    // Bodies saved afterwards are compressed with the document codec the
+    // compacted file records.
+    Documents more(1);
+    more.setDoc(0, "doc2000", std::string(512, 'z'));
+    more.setContentMeta(0, COUCH_DOC_IS_COMPRESSED);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, more.getDocs(),
+                                        more.getDocInfos(), 1,
+                                        COMPRESS_DOC_BODIES));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    DocInfo* info = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfo_by_id(db, "doc2000", 7, &info));
+    EXPECT_EQ(COUCH_DOC_IS_COMPRESSED | (COUCHSTORE_CODEC_LZ4 << 4),
+              int(info->content_meta));
+    couchstore_free_docinfo(info);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+    ASSERT_EQ(0, remove(target.c_str()));
+}
+
+#ifdef HAVE_ZSTD
+TEST_F(CouchstoreTest, doc_dictionary)
+{
+    const int count = 2000;
+    Documents documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(10000 + ii),
+                         "{\"name\":\"user" + std::to_string(ii) +
+                         "\",\"email\":\"user" + std::to_string(ii) +
+                         "@example.com\",\"active\":" +
+                         (ii % 3 ? "true" : "false") +
+                         ",\"score\":" + std::to_string(ii * 7 % 1000) + "}");
+        documents.setContentMeta(ii, COUCH_DOC_IS_COMPRESSED);
+    }
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE |
+                                 couchstore_encode_codec_flags(
+                                         COUCHSTORE_CODEC_SNAPPY,
+                                         COUCHSTORE_CODEC_ZSTD_DICT),
+                                 &db));
+    // Without a dictionary, bodies are compressed with plain Zstandard.
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, documents.getDocs(),
+                                        documents.getDocInfos(), count,
+                                        COMPRESS_DOC_BODIES));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    DocInfo* info = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfo_by_id(db, "doc10000", 8, &info));
+    EXPECT_EQ(COUCHSTORE_CODEC_ZSTD,
+              (info->content_meta & COUCH_DOC_CODEC_MASK) >> 4);
+    couchstore_free_docinfo(info);
+
+    std::string plain = filePath + ".plain";
+    std::string trained = filePath + ".trained";
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_compact_db_ex(db, plain.c_str(), 0,
+                                       nullptr, nullptr, nullptr,
+                                       couchstore_get_default_file_ops()));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_compact_db_ex(db, trained.c_str(),
+                                       COUCHSTORE_COMPACT_TRAIN_DICTIONARY,
+                                       nullptr, nullptr, nullptr,
+                                       couchstore_get_default_file_ops()));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    DbInfo dbInfo;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_db(plain.c_str(), 0, &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_db_info(db, &dbInfo));
+    const uint64_t plainSize = dbInfo.space_used;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    // The compacted file records its document codec, so it needn't be
+    // selected again.
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_db(trained.c_str(), 0, &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_db_info(db, &dbInfo));
+    EXPECT_LT(dbInfo.space_used, plainSize);
+
+    LocalDoc* ldoc = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_local_document(
+                      db, DOC_DICTIONARY_ID, sizeof(DOC_DICTIONARY_ID) - 1,
+                      &ldoc));
+    EXPECT_LT(0u, ldoc->json.size);
+    couchstore_free_local_document(ldoc);
+
+    // Only compaction may replace or delete the dictionary.
+    LocalDoc replacement;
+    replacement.id = {const_cast<char*>(DOC_DICTIONARY_ID),
+                      sizeof(DOC_DICTIONARY_ID) - 1};
+    replacement.json = {const_cast<char*>("{}"), 2};
+    for (int deleted : {0, 1}) {
+        replacement.deleted = deleted;
+        EXPECT_EQ(COUCHSTORE_ERROR_INVALID_ARGUMENTS,
+                  couchstore_save_local_document(db, &replacement));
+    }
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfo_by_id(db, "doc10000", 8, &info));
+    EXPECT_EQ(COUCHSTORE_CODEC_ZSTD_DICT,
+              (info->content_meta & COUCH_DOC_CODEC_MASK) >> 4);
+    couchstore_free_docinfo(info);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                       &documents));
+    EXPECT_EQ(count, documents.getCallbacks());
+
+    // Documents saved afterwards are compressed with the dictionary too.
+    Documents more(1);
+    more.setDoc(0, "doc20000",
+                "{\"name\":\"user20000\",\"email\":\"user20000@example.com\"}");
+    more.setContentMeta(0, COUCH_DOC_IS_COMPRESSED);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, more.getDocs(),
+                                        more.getDocInfos(), 1,
+                                        COMPRESS_DOC_BODIES));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfo_by_id(db, "doc20000", 8, &info));
+    EXPECT_EQ(COUCHSTORE_CODEC_ZSTD_DICT,
+              (info->content_meta & COUCH_DOC_CODEC_MASK) >> 4);
+    couchstore_free_docinfo(info);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, count + 1, 0,
+                                       &Documents::checkCallback, &more));
+    EXPECT_EQ(1, more.getCallbacks());
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+    ASSERT_EQ(0, remove(plain.c_str()));
+    ASSERT_EQ(0, remove(trained.c_str()));
+}
+#endif
+
 TEST_F(CouchstoreTest, dump_empty_db)
 {
     DbInfo info;
@@ -676,7 +1023,7 @@ TEST_F(CouchstoreTest, legacy_crc_flags) {
 
     // Should be in crc32c
     EXPECT_EQ(CRC32C, db->file.crc_mode);
-    EXPECT_GE(uint64_t(COUCH_DISK_VERSION_12), db->header.disk_version);
+    EXPECT_GE(db->header.disk_version, uint64_t(COUCH_DISK_VERSION_12));
 
     ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
     ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
@@ -879,6 +1226,204 @@ TEST_F(CouchstoreTest, crc_upgrade2) {
     ASSERT_EQ(0, remove(target.c_str()));
 }
 
+// Test that compacting with the upgrade flag gives version 13 B-tree nodes,
+// with an offset directory, and that lookups using it find the same
+// documents.
+TEST_F(CouchstoreTest, node_directory_upgrade) {
+    const int docCount = 5000;
+    Documents documents(docCount);
+    documents.generateDocs();
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE |
+                                 COUCHSTORE_OPEN_WITH_LEGACY_CRC,
+                                 &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_save_documents(db,
+                                                            documents.getDocs(),
+                                                            documents.getDocInfos(),
+                                                            docCount,
+                                                            0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    char* node = nullptr;
+    ASSERT_LT(0, pread_compressed(&db->file,
+                                  db->header.by_id_root->pointer,
+                                  &node));
+    EXPECT_EQ(0, node[0] & NODE_DIRECTORY_FLAG);
+    cb_free(node);
+
+    std::string target("compacted.couch");
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_compact_db_ex(db,
+                                                           target.c_str(),
+                                                           COUCHSTORE_COMPACT_FLAG_UPGRADE_DB,
+                                                           nullptr,
+                                                           nullptr,
+                                                           nullptr,
+                                                           couchstore_get_default_file_ops()));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(target.c_str(), COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    EXPECT_EQ(CRC32C, db->file.crc_mode);
+    EXPECT_EQ(uint64_t(COUCH_DISK_VERSION), db->header.disk_version);
+
+    int nodelen = pread_compressed(&db->file,
+                                   db->header.by_id_root->pointer,
+                                   &node);
+    ASSERT_LT(0, nodelen);
+    nodelen = expand_node(&node, nodelen);
+    ASSERT_LT(0, nodelen);
+    EXPECT_EQ(NODE_DIRECTORY_FLAG, node[0] & NODE_DIRECTORY_FLAG);
+    EXPECT_LT(1u, node_directory_count(node, nodelen));
+    cb_free(node);
+
+    for (int ii = 0; ii < docCount; ++ii) {
+        DocInfo* info = nullptr;
+        const sized_buf& id = documents.getDoc(ii)->id;
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_docinfo_by_id(db, id.buf, id.size, &info));
+        EXPECT_EQ(0, memcmp(id.buf, info->id.buf, id.size));
+        couchstore_free_docinfo(info);
+    }
+
+    // Bulk lookup with a key that doesn't exist after each one that does.
+    std::vector<std::string> missing(docCount);
+    std::vector<sized_buf> ids;
+    for (int ii = 0; ii < docCount; ++ii) {
+        const sized_buf& id = documents.getDoc(ii)->id;
+        missing[ii] = std::string(id.buf, id.size) + "-missing";
+        ids.push_back(id);
+        ids.push_back({&missing[ii][0], missing[ii].size()});
+    }
+    std::sort(ids.begin(), ids.end(), [](const sized_buf& a, const sized_buf& b) {
+        return ebin_cmp(&a, &b) < 0;
+    });
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_docinfos_by_id(db,
+                                                            ids.data(),
+                                                            ids.size(),
+                                                            0,
+                                                            &Documents::docIterCheckCallback,
+                                                            &documents));
+    EXPECT_EQ(docCount, documents.getCallbacks());
+
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_changes_since(db,
+                                                           0,
+                                                           0,
+                                                           &Documents::checkCallback,
+                                                           &documents));
+    EXPECT_EQ(docCount, documents.getCallbacks());
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+    ASSERT_EQ(0, remove(target.c_str()));
+}
+
+// Test that keys with a long common prefix are stored once per node, and
+// that documents can be found, updated and compacted as usual.
+TEST_F(CouchstoreTest, prefix_compressed_keys) {
+    const int docCount = 2000;
+    const std::string prefix = "namespace::collection::user::";
+    Documents documents(docCount);
+    for (int ii = 0; ii < docCount; ++ii) {
+        std::string id = prefix + std::to_string(ii);
+        documents.setDoc(ii, id, id + "-data");
+    }
+
+    // Same documents in a version 11 file, for comparison.
+    std::string legacy("legacy.couch");
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(legacy.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE |
+                                 COUCHSTORE_OPEN_WITH_LEGACY_CRC,
+                                 &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_save_documents(db,
+                                                            documents.getDocs(),
+                                                            documents.getDocInfos(),
+                                                            docCount,
+                                                            0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    const uint64_t legacy_size = db->file.pos;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(), COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    EXPECT_GE(db->header.disk_version, uint64_t(COUCH_DISK_VERSION_14));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_save_documents(db,
+                                                            documents.getDocs(),
+                                                            documents.getDocInfos(),
+                                                            docCount,
+                                                            0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    EXPECT_LT(db->file.pos, legacy_size);
+
+    char* node = nullptr;
+    int nodelen = pread_compressed(&db->file,
+                                   db->header.by_id_root->pointer,
+                                   &node);
+    ASSERT_LT(0, nodelen);
+    EXPECT_EQ(NODE_PREFIX_FLAG, node[0] & NODE_PREFIX_FLAG);
+    nodelen = expand_node(&node, nodelen);
+    ASSERT_LT(0, nodelen);
+    EXPECT_EQ(0, node[0] & NODE_PREFIX_FLAG);
+    sized_buf key, value;
+    read_kv(node + 1, &key, &value);
+    EXPECT_EQ(prefix, std::string(key.buf, prefix.size()));
+    cb_free(node);
+
+    // Delete every other document, going through modify_node.
+    for (int ii = 0; ii < docCount; ii += 2) {
+        documents.getDocInfo(ii)->deleted = 1;
+        documents.getDocInfo(ii)->db_seq = 0;
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_save_documents(db,
+                                                            documents.getDocs(),
+                                                            documents.getDocInfos(),
+                                                            docCount,
+                                                            0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    std::string target("compacted.couch");
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_compact_db_ex(db,
+                                                           target.c_str(),
+                                                           COUCHSTORE_COMPACT_FLAG_DROP_DELETES,
+                                                           nullptr,
+                                                           nullptr,
+                                                           nullptr,
+                                                           couchstore_get_default_file_ops()));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(target.c_str(), COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    for (int ii = 0; ii < docCount; ++ii) {
+        DocInfo* info = nullptr;
+        const sized_buf& id = documents.getDoc(ii)->id;
+        EXPECT_EQ(ii % 2 ? COUCHSTORE_SUCCESS : COUCHSTORE_ERROR_DOC_NOT_FOUND,
+                  couchstore_docinfo_by_id(db, id.buf, id.size, &info));
+        if (info) {
+            EXPECT_EQ(0, memcmp(id.buf, info->id.buf, id.size));
+            couchstore_free_docinfo(info);
+        }
+    }
+    DbInfo info;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_db_info(db, &info));
+    EXPECT_EQ(uint64_t(docCount / 2), info.doc_count);
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+    ASSERT_EQ(0, remove(target.c_str()));
+    ASSERT_EQ(0, remove(legacy.c_str()));
+}
+
 // Parameters for MT_save_worker.
 struct MT_save_args {
     size_t worker_id;
@@ -1088,6 +1633,106 @@ TEST_F(CouchstoreTest, compact_need_body) {
 }
 
 
+static int compact_parallel_hook(Db* target, DocInfo* info, sized_buf item,
+                                 void* ctx_p) {
+    if (info == nullptr) {
+        return COUCHSTORE_COMPACT_KEEP_ITEM;
+    }
+    auto* seqs = reinterpret_cast<std::vector<uint64_t>*>(ctx_p);
+    // Ask for every other body, dropping every tenth item once given it.
+    if (item.buf == nullptr && info->db_seq % 2) {
+        return COUCHSTORE_COMPACT_NEED_BODY;
+    }
+    seqs->push_back(info->db_seq);
+    if (item.buf != nullptr) {
+        EXPECT_EQ(std::string(512, 'a' + (info->db_seq - 1) % 26),
+                  std::string(item.buf, item.size));
+    }
+    return info->db_seq % 10 == 1 ? COUCHSTORE_COMPACT_DROP_ITEM
+                                  : COUCHSTORE_COMPACT_KEEP_ITEM;
+}
+
+/* Compacting with parallel reads gives the same file as without, and
+ * passes the items to the hooks in sequence order.
+ */
+TEST_F(CouchstoreTest, compact_parallel_reads) {
+    const int count = 3000;
+    Documents documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(ii),
+                         std::string(512, 'a' + ii % 26));
+        if (ii % 7 == 0) {
+            documents.getDocInfo(ii)->deleted = 1;
+        }
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, documents.getDocs(),
+                                        documents.getDocInfos(), count, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    auto readFile = [](const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in),
+                           std::istreambuf_iterator<char>());
+    };
+
+    for (couchstore_compact_flags flags :
+         {couchstore_compact_flags(0),
+          couchstore_compact_flags(COUCHSTORE_COMPACT_FLAG_DROP_DELETES)}) {
+        std::string serial = filePath + ".serial";
+        std::string parallel = filePath + ".parallel";
+        std::vector<uint64_t> serialSeqs;
+        std::vector<uint64_t> parallelSeqs;
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_compact_db_ex(db, serial.c_str(), flags,
+                                           compact_parallel_hook, nullptr,
+                                           &serialSeqs,
+                                           couchstore_get_default_file_ops()));
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_compact_db_ex(
+                          db, parallel.c_str(),
+                          flags | COUCHSTORE_COMPACT_WITH_PARALLEL_READS,
+                          compact_parallel_hook, nullptr, &parallelSeqs,
+                          couchstore_get_default_file_ops()));
+        EXPECT_EQ(size_t(count), parallelSeqs.size());
+        EXPECT_TRUE(std::is_sorted(parallelSeqs.begin(), parallelSeqs.end()));
+        EXPECT_EQ(serialSeqs, parallelSeqs);
+        EXPECT_EQ(readFile(serial), readFile(parallel));
+        ASSERT_EQ(0, remove(serial.c_str()));
+        ASSERT_EQ(0, remove(parallel.c_str()));
+    }
+
+    // Without a hook, deleted items are dropped before being read.
+    std::string target = filePath + ".compacted";
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_compact_db_ex(
+                      db, target.c_str(),
+                      COUCHSTORE_COMPACT_FLAG_DROP_DELETES |
+                      COUCHSTORE_COMPACT_WITH_PARALLEL_READS,
+                      nullptr, nullptr, nullptr,
+                      couchstore_get_default_file_ops()));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_db(target.c_str(), 0, &db));
+    DbInfo info;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_db_info(db, &info));
+    EXPECT_EQ(uint64_t(count - (count + 6) / 7), info.doc_count);
+    EXPECT_EQ(0u, info.deleted_count);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, 0, 0, &Documents::countCallback,
+                                       &documents));
+    EXPECT_EQ(count - (count + 6) / 7, documents.getCallbacks());
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+    ASSERT_EQ(0, remove(target.c_str()));
+}
+
 /** verify couchstore_changes_count() returns correct values
  *
  * couchstore_changes_count() will return the # of unique documents
@@ -1221,6 +1866,70 @@ TEST_F(CouchstoreTest, test_changes_count) {
     db = nullptr;
 }
 
+/**
+ * Tests that couchstore_changes_counts() counts the same changes in many
+ * ranges at once as counting them one by one.
+ */
+TEST_F(CouchstoreTest, changes_counts) {
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(
+                      filePath.c_str(), COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    const int ndocs = 3000;
+    Documents documents(ndocs);
+    for (int ii = 0; ii < ndocs; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(ii), "value");
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, documents.getDocs(),
+                                        documents.getDocInfos(), ndocs, 0));
+    // Update every third document, moving it to a later sequence number.
+    Documents updates(ndocs / 3);
+    for (int ii = 0; ii < ndocs / 3; ++ii) {
+        updates.setDoc(ii, "doc" + std::to_string(ii * 3), "updated");
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, updates.getDocs(),
+                                        updates.getDocInfos(), ndocs / 3, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    const uint64_t last = db->header.update_seq;
+    std::vector<uint64_t> min_seqs = {0, 1, last, last + 1, 10, 500, 2000};
+    std::vector<uint64_t> max_seqs = {last, last, last, last + 10, 5, 3500,
+                                      std::numeric_limits<uint64_t>::max()};
+    std::mt19937 twister(ndocs);
+    std::uniform_int_distribution<uint64_t> dist(0, last + 1);
+    for (int ii = 0; ii < 100; ++ii) {
+        uint64_t a = dist(twister);
+        uint64_t b = dist(twister);
+        min_seqs.push_back(std::min(a, b));
+        max_seqs.push_back(std::max(a, b));
+    }
+
+    std::vector<uint64_t> counts(min_seqs.size());
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_counts(db, min_seqs.data(), max_seqs.data(),
+                                        min_seqs.size(), counts.data()));
+    for (size_t ii = 0; ii < min_seqs.size(); ++ii) {
+        uint64_t count = 0;
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_changes_count(db, min_seqs[ii], max_seqs[ii],
+                                           &count));
+        EXPECT_EQ(count, counts[ii]) << "range " << min_seqs[ii] << "-"
+                                     << max_seqs[ii];
+        // Every sequence number from ndocs + 1 up is an update, and of
+        // those up to ndocs, every one not a multiple of 3 remains.
+        uint64_t expected = 0;
+        for (uint64_t seq = std::max<uint64_t>(min_seqs[ii], 1);
+             seq <= std::min(max_seqs[ii], last); ++seq) {
+            if (seq > uint64_t(ndocs) || (seq - 1) % 3 != 0) {
+                ++expected;
+            }
+        }
+        EXPECT_EQ(expected, counts[ii]) << "range " << min_seqs[ii] << "-"
+                                        << max_seqs[ii];
+    }
+}
+
 /**
  * verify that couchstore_set_purge_seq() sets the purge_seq and retains
  * that value if the file is closed and reopened.
@@ -1280,6 +1989,577 @@ TEST_F(CouchstoreTest, test_set_purge_seq) {
     db = nullptr;
 }
 
+TEST_F(CouchstoreTest, node_cache) {
+    const uint32_t ndocs = 1000;
+    Documents documents(ndocs);
+    documents.generateDocs();
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(
+                      filePath.c_str(), COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db,
+                                        documents.getDocs(),
+                                        documents.getDocInfos(),
+                                        ndocs,
+                                        0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    /**
+     * without the flag there is no cache
+     */
+    couchstore_node_cache_stats stats;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_get_node_cache_stats(db, &stats));
+    EXPECT_EQ(0, stats.hits);
+    EXPECT_EQ(0, stats.misses);
+    EXPECT_EQ(0, stats.size);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+
+    /**
+     * reopen with a 256KB node cache (N=1)
+     */
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(), 1 << 5, &db));
+    std::vector<sized_buf> ids(ndocs);
+    for (uint32_t ii = 0; ii < ndocs; ++ii) {
+        ids[ii] = documents.getDoc(ii)->id;
+    }
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfos_by_id(db, ids.data(), ndocs, 0,
+                                        &Documents::docIterCheckCallback,
+                                        &documents));
+    EXPECT_EQ(static_cast<int>(ndocs), documents.getCallbacks());
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_get_node_cache_stats(db, &stats));
+    EXPECT_NE(0, stats.misses);
+    EXPECT_NE(0, stats.size);
+    EXPECT_GE(256 * 1024, stats.size);
+
+    /**
+     * the second pass over the same keys is served from the cache
+     */
+    const uint64_t misses = stats.misses;
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfos_by_id(db, ids.data(), ndocs, 0,
+                                        &Documents::docIterCheckCallback,
+                                        &documents));
+    EXPECT_EQ(static_cast<int>(ndocs), documents.getCallbacks());
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_get_node_cache_stats(db, &stats));
+    EXPECT_EQ(misses, stats.misses);
+    EXPECT_NE(0, stats.hits);
+
+    /**
+     * changes_count reads the by-seq tree through the cache too, once:
+     * counting again uses the nodes it decoded the first time
+     */
+    uint64_t count;
+    uint64_t lookups = stats.hits + stats.misses;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_count(db, 0, db->header.update_seq, &count));
+    EXPECT_EQ(ndocs, count);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_get_node_cache_stats(db, &stats));
+    EXPECT_LT(lookups, stats.hits + stats.misses);
+    lookups = stats.hits + stats.misses;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_count(db, 0, db->header.update_seq, &count));
+    EXPECT_EQ(ndocs, count);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_get_node_cache_stats(db, &stats));
+    EXPECT_EQ(lookups, stats.hits + stats.misses);
+}
+
+/**
+ * Compacting a database, with or without reading the bodies in parallel,
+ * leaves the by-sequence nodes in its node cache as they were, so its
+ * documents can still be read afterwards.
+ */
+TEST_F(CouchstoreTest, node_cache_compact) {
+    const int ndocs = 200;
+    Documents documents(ndocs);
+    documents.generateDocs();
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE | (1 << 5),
+                                 &db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, documents.getDocs(),
+                                        documents.getDocInfos(), ndocs, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+    std::string target = filePath + ".compacted";
+    for (couchstore_compact_flags flags :
+         {couchstore_compact_flags(0),
+          couchstore_compact_flags(COUCHSTORE_COMPACT_WITH_PARALLEL_READS)}) {
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_compact_db_ex(db, target.c_str(), flags,
+                                           nullptr, nullptr, nullptr,
+                                           couchstore_get_default_file_ops()));
+        documents.resetCounters();
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                           &documents));
+        EXPECT_EQ(ndocs, documents.getCallbacks());
+        ASSERT_EQ(0, remove(target.c_str()));
+    }
+}
+
+/**
+ * Tests that documents saved while the IO buffer is written out in the
+ * background read back correctly before and after committing, and that
+ * compacting with background flushing copies all of them.
+ */
+TEST_F(CouchstoreTest, background_flush) {
+    const int count = 2000;
+    const int batch = 100;
+    Documents documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(ii),
+                         std::string(1024, 'a' + ii % 26));
+    }
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE |
+                                 COUCHSTORE_OPEN_WITH_BACKGROUND_FLUSH,
+                                 &db));
+    for (int ii = 0; ii < count; ii += batch) {
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_save_documents(db, documents.getDocs() + ii,
+                                            documents.getDocInfos() + ii,
+                                            batch, 0));
+        // Read back the batch before anything has been committed.
+        for (int jj = ii; jj < ii + batch; ++jj) {
+            Doc* doc = nullptr;
+            sized_buf& id = documents.getDoc(jj)->id;
+            ASSERT_EQ(COUCHSTORE_SUCCESS,
+                      couchstore_open_document(db, id.buf, id.size, &doc,
+                                               DECOMPRESS_DOC_BODIES));
+            sized_buf& data = documents.getDoc(jj)->data;
+            EXPECT_EQ(data.size, doc->data.size);
+            EXPECT_EQ(0, memcmp(data.buf, doc->data.buf, data.size));
+            couchstore_free_document(doc);
+        }
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(), 0, &db));
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                       &documents));
+    EXPECT_EQ(count, documents.getCallbacks());
+
+    std::string target("compacted.couch");
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_compact_db_ex(db,
+                                       target.c_str(),
+                                       COUCHSTORE_COMPACT_WITH_BACKGROUND_FLUSH,
+                                       nullptr,
+                                       nullptr,
+                                       nullptr,
+                                       couchstore_get_default_file_ops()));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_db(target.c_str(), 0, &db));
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                       &documents));
+    EXPECT_EQ(count, documents.getCallbacks());
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+    ASSERT_EQ(0, remove(target.c_str()));
+}
+
+/**
+ * Tests that a snapshot reads the database as of when it was opened, from
+ * another thread, while more documents are saved and committed, sharing
+ * the database's node cache.
+ */
+TEST_F(CouchstoreTest, open_snapshot) {
+    const int ndocs = 1000;
+    Documents documents(ndocs);
+    documents.generateDocs();
+    Documents later(ndocs);
+    for (int ii = 0; ii < ndocs; ++ii) {
+        later.setDoc(ii, "later" + std::to_string(ii), "data");
+    }
+    std::vector<sized_buf> ids(ndocs);
+    std::vector<sized_buf> later_ids(ndocs);
+    for (int ii = 0; ii < ndocs; ++ii) {
+        ids[ii] = documents.getDoc(ii)->id;
+        later_ids[ii] = later.getDoc(ii)->id;
+    }
+
+    for (couchstore_open_flags flags :
+         {couchstore_open_flags(COUCHSTORE_OPEN_FLAG_CREATE |
+                                (1 << 5)),
+          couchstore_open_flags(COUCHSTORE_OPEN_FLAG_CREATE |
+                                COUCHSTORE_OPEN_FLAG_UNBUFFERED)}) {
+        remove(filePath.c_str());
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_db(filePath.c_str(), flags, &db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_save_documents(db, documents.getDocs(),
+                                            documents.getDocInfos(), ndocs,
+                                            0));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+
+        Db* snapshot = nullptr;
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_snapshot(db, &snapshot));
+
+        int found = 0;
+        int found_later = 0;
+        int changes = 0;
+        std::thread reader([&]() {
+            for (int pass = 0; pass < 10; ++pass) {
+                Documents counter(0);
+                couchstore_docinfos_by_id(snapshot, ids.data(), ndocs, 0,
+                                          &Documents::countCallback, &counter);
+                couchstore_docinfos_by_id(snapshot, later_ids.data(), ndocs,
+                                          0, &Documents::countCallback,
+                                          &counter);
+                found += counter.getCallbacks();
+                counter.resetCounters();
+                couchstore_changes_since(snapshot, 0, 0,
+                                         &Documents::countCallback, &counter);
+                changes += counter.getCallbacks();
+            }
+        });
+        for (int ii = 0; ii < ndocs; ii += 100) {
+            ASSERT_EQ(COUCHSTORE_SUCCESS,
+                      couchstore_save_documents(db, later.getDocs() + ii,
+                                                later.getDocInfos() + ii, 100,
+                                                0));
+            ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+        }
+        reader.join();
+        found_later = found - 10 * ndocs;
+
+        EXPECT_EQ(10 * ndocs, found);
+        EXPECT_EQ(0, found_later);
+        EXPECT_EQ(10 * ndocs, changes);
+        EXPECT_EQ(uint64_t(ndocs), snapshot->header.update_seq);
+        EXPECT_EQ(uint64_t(2 * ndocs), db->header.update_seq);
+
+        // Writes through the snapshot are refused
+        EXPECT_NE(COUCHSTORE_SUCCESS,
+                  couchstore_save_document(snapshot, later.getDoc(0),
+                                           later.getDocInfo(0), 0));
+
+        if (!(flags & COUCHSTORE_OPEN_FLAG_UNBUFFERED)) {
+            couchstore_node_cache_stats stats;
+            ASSERT_EQ(COUCHSTORE_SUCCESS,
+                      couchstore_get_node_cache_stats(db, &stats));
+            EXPECT_NE(0u, stats.hits);
+        }
+
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(snapshot));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(snapshot));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+        db = nullptr;
+    }
+}
+
+/**
+ * Tests rewinding to a sequence number, both through the header chain and
+ * (with a legacy file) by scanning back for headers, including across a
+ * branch committed on top of an earlier header.
+ */
+TEST_F(CouchstoreTest, rewind_to_seq) {
+    const int commits = 200;
+    Documents documents(commits);
+    documents.generateDocs();
+    Documents branch(10);
+    for (int ii = 0; ii < 10; ++ii) {
+        branch.setDoc(ii, "branch" + std::to_string(ii), "data");
+    }
+    DbInfo info;
+
+    for (bool legacy : {false, true}) {
+        remove(filePath.c_str());
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_db(filePath.c_str(),
+                                     COUCHSTORE_OPEN_FLAG_CREATE |
+                                     (legacy ? couchstore_open_flags(
+                                                       COUCHSTORE_OPEN_WITH_LEGACY_CRC)
+                                             : couchstore_open_flags(0)),
+                                     &db));
+        for (int ii = 0; ii < commits; ++ii) {
+            ASSERT_EQ(COUCHSTORE_SUCCESS,
+                      couchstore_save_document(db, documents.getDoc(ii),
+                                               documents.getDocInfo(ii), 0));
+            ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+        }
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_db(filePath.c_str(), 0, &db));
+
+        // Already there
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_rewind_to_seq(db, commits));
+        EXPECT_EQ(uint64_t(commits), db->header.update_seq);
+
+        // Roll back and commit a branch on top of seq 120
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_rewind_to_seq(db, 120));
+        EXPECT_EQ(120u, db->header.update_seq);
+        for (int ii = 0; ii < 10; ++ii) {
+            ASSERT_EQ(COUCHSTORE_SUCCESS,
+                      couchstore_save_document(db, branch.getDoc(ii),
+                                               branch.getDocInfo(ii), 0));
+            ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+        }
+        EXPECT_EQ(130u, db->header.update_seq);
+
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_rewind_to_seq(db, 125));
+        EXPECT_EQ(125u, db->header.update_seq);
+        DocInfo* docinfo = nullptr;
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_docinfo_by_id(db, branch.getDoc(4)->id.buf,
+                                           branch.getDoc(4)->id.size,
+                                           &docinfo));
+        couchstore_free_docinfo(docinfo);
+
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_rewind_to_seq(db, 50));
+        EXPECT_EQ(50u, db->header.update_seq);
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_db_info(db, &info));
+        EXPECT_EQ(50u, info.doc_count);
+
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_rewind_db_header(db));
+        EXPECT_EQ(49u, db->header.update_seq);
+
+        ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_rewind_to_seq(db, 0));
+        EXPECT_EQ(0u, db->header.update_seq);
+        EXPECT_EQ(0u, couchstore_get_header_position(db));
+
+        // Nothing before the first header
+        EXPECT_EQ(COUCHSTORE_ERROR_DB_NO_LONGER_VALID,
+                  couchstore_rewind_db_header(db));
+        db = nullptr;
+    }
+}
+
+/**
+ * Tests that documents saved concurrently through a group committer are
+ * all committed, including repeated saves of the same ID from several
+ * threads.
+ */
+TEST_F(CouchstoreTest, group_commit) {
+    const int threads = 8;
+    const int batches = 50;
+    const int batch = 10;
+    const int count = threads * batches * batch;
+    Documents documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(ii),
+                         "data" + std::to_string(ii));
+    }
+    // Each thread also saves its own version of one shared document.
+    Documents shared(threads);
+    for (int ii = 0; ii < threads; ++ii) {
+        shared.setDoc(ii, "shared", "thread" + std::to_string(ii));
+    }
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    GroupCommit* group = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_group_commit(db, &group));
+
+    std::vector<std::thread> writers;
+    std::vector<couchstore_error_t> results(threads, COUCHSTORE_SUCCESS);
+    for (int tt = 0; tt < threads; ++tt) {
+        writers.emplace_back([&, tt]() {
+            for (int bb = 0; bb < batches; ++bb) {
+                int first = (tt * batches + bb) * batch;
+                couchstore_error_t err =
+                        couchstore_group_commit_save_documents(
+                                group,
+                                documents.getDocs() + first,
+                                documents.getDocInfos() + first,
+                                batch,
+                                0);
+                if (err == COUCHSTORE_SUCCESS) {
+                    err = couchstore_group_commit_save_documents(
+                            group,
+                            shared.getDocs() + tt,
+                            shared.getDocInfos() + tt,
+                            1,
+                            0);
+                }
+                if (err != COUCHSTORE_SUCCESS) {
+                    results[tt] = err;
+                    return;
+                }
+            }
+        });
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    for (auto result : results) {
+        EXPECT_EQ(COUCHSTORE_SUCCESS, result);
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_group_commit(group));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(), 0, &db));
+    EXPECT_EQ(uint64_t(count + threads * batches), db->header.update_seq);
+    DbInfo info;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_db_info(db, &info));
+    EXPECT_EQ(uint64_t(count + 1), info.doc_count);
+    for (int ii = 0; ii < count; ++ii) {
+        Doc* doc = nullptr;
+        sized_buf& id = documents.getDoc(ii)->id;
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_open_document(db, id.buf, id.size, &doc, 0));
+        sized_buf& data = documents.getDoc(ii)->data;
+        EXPECT_EQ(data.size, doc->data.size);
+        EXPECT_EQ(0, memcmp(data.buf, doc->data.buf, data.size));
+        couchstore_free_document(doc);
+    }
+    DocInfo* docInfo = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_docinfo_by_id(db, "shared", 6, &docInfo));
+    EXPECT_EQ(db->header.update_seq, docInfo->db_seq);
+    couchstore_free_docinfo(docInfo);
+}
+
+/**
+ * Tests that documents bulk loaded with IDs out of order can be read back
+ * by sequence and by ID, and that the db can then be written as normal.
+ */
+TEST_F(CouchstoreTest, bulk_load) {
+    const int count = 5000;
+    const int batch = 500;
+    Documents documents(count);
+    for (int ii = 0; ii < count; ++ii) {
+        documents.setDoc(ii, "doc" + std::to_string(ii),
+                         std::string(100 + ii % 100, 'a' + ii % 26));
+        if (ii % 2) {
+            documents.setContentMeta(ii, COUCH_DOC_IS_COMPRESSED);
+        }
+    }
+    documents.shuffle();
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    BulkLoad* load = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_bulk_load(db, &load));
+    for (int ii = 0; ii < count; ii += batch) {
+        ASSERT_EQ(COUCHSTORE_SUCCESS,
+                  couchstore_bulk_load_documents(load,
+                                                 documents.getDocs() + ii,
+                                                 documents.getDocInfos() + ii,
+                                                 batch,
+                                                 COMPRESS_DOC_BODIES));
+    }
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_finish_bulk_load(load));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_bulk_load(load));
+    EXPECT_EQ(uint64_t(count), db->header.update_seq);
+    EXPECT_EQ(uint64_t(count), documents.getDocInfo(count - 1)->db_seq);
+
+    // Only an empty db can be bulk loaded.
+    EXPECT_EQ(COUCHSTORE_ERROR_INVALID_ARGUMENTS,
+              couchstore_open_bulk_load(db, &load));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_close_file(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_db(db));
+    db = nullptr;
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_db(filePath.c_str(), 0, &db));
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_since(db, 0, 0, &Documents::checkCallback,
+                                       &documents));
+    EXPECT_EQ(count, documents.getCallbacks());
+    documents.resetCounters();
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_all_docs(db, nullptr, 0,
+                                  &Documents::docIterCheckCallback,
+                                  &documents));
+    EXPECT_EQ(count, documents.getCallbacks());
+    DbInfo info;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_db_info(db, &info));
+    EXPECT_EQ(uint64_t(count), info.doc_count);
+    uint64_t changes;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_changes_count(db, 0, count, &changes));
+    EXPECT_EQ(uint64_t(count), changes);
+
+    // Updating a loaded document replaces it.
+    Documents update(1);
+    update.setDoc(0, "doc42", "updated");
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_save_documents(db, update.getDocs(),
+                                        update.getDocInfos(), 1, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_commit(db));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_db_info(db, &info));
+    EXPECT_EQ(uint64_t(count), info.doc_count);
+    Doc* doc = nullptr;
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_document(db, "doc42", 5, &doc, 0));
+    EXPECT_EQ(std::string("updated"), std::string(doc->data.buf, doc->data.size));
+    couchstore_free_document(doc);
+}
+
+/**
+ * Tests that a bulk load rejects an ID loaded twice, whether or not the
+ * IDs are loaded in order, and commits nothing.
+ */
+TEST_F(CouchstoreTest, bulk_load_duplicate_id) {
+    Documents documents(3);
+    documents.setDoc(0, "doc1", "one");
+    documents.setDoc(1, "doc2", "two");
+    documents.setDoc(2, "doc1", "again");
+
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_open_db(filePath.c_str(),
+                                 COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    BulkLoad* load = nullptr;
+
+    // In order: the repeated ID is rejected as it is loaded.
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_bulk_load(db, &load));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_bulk_load_documents(load, documents.getDocs(),
+                                             documents.getDocInfos(), 1, 0));
+    EXPECT_EQ(COUCHSTORE_ERROR_INVALID_ARGUMENTS,
+              couchstore_bulk_load_documents(load, documents.getDocs() + 2,
+                                             documents.getDocInfos() + 2,
+                                             1, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_bulk_load(load));
+
+    // Out of order: finishing the load finds it.
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_open_bulk_load(db, &load));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_bulk_load_documents(load, documents.getDocs() + 1,
+                                             documents.getDocInfos() + 1,
+                                             2, 0));
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              couchstore_bulk_load_documents(load, documents.getDocs(),
+                                             documents.getDocInfos(), 1, 0));
+    EXPECT_EQ(COUCHSTORE_ERROR_INVALID_ARGUMENTS,
+              couchstore_finish_bulk_load(load));
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_free_bulk_load(load));
+
+    DbInfo info;
+    ASSERT_EQ(COUCHSTORE_SUCCESS, couchstore_db_info(db, &info));
+    EXPECT_EQ(0u, info.doc_count);
+    EXPECT_EQ(0u, db->header.update_seq);
+}
 
 INSTANTIATE_TEST_CASE_P(DocTest,
                         CouchstoreDoctest,
@@ -131,6 +131,8 @@ TYPED_TEST_P(WrappedOpsTest, pread_single) {
               this->ops.open(&this->errinfo, &this->handle,
                              this->file_path.c_str(), FILE_FLAGS));
     this->populate(1);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              this->ops.sync(&this->errinfo, this->handle));
     EXPECT_CALL(*this->mock_ops,
                 pread(_, _, _, _, _)).WillOnce(Return(COUCHSTORE_ERROR_FILE_CLOSE));
 
@@ -182,6 +184,8 @@ TYPED_TEST_P(UnbufferedWrappedOpsTest, pread_double_cacheable) {
               this->ops.open(&this->errinfo, &this->handle,
                              this->file_path.c_str(), FILE_FLAGS));
     this->populate(1);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              this->ops.sync(&this->errinfo, this->handle));
     ASSERT_EQ(1,
               this->ops.pread(&this->errinfo, this->handle, &this->buf, 1, 0));
 
@@ -201,6 +205,8 @@ TYPED_TEST_P(WrappedOpsTest, pread_double_cachebuster) {
               this->ops.open(&this->errinfo, &this->handle,
                              this->file_path.c_str(), FILE_FLAGS));
     this->populate(17000);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              this->ops.sync(&this->errinfo, this->handle));
     ASSERT_EQ(1,
               this->ops.pread(&this->errinfo, this->handle, &this->buf, 1, 0));
 
@@ -250,6 +256,41 @@ TYPED_TEST_P(BufferedWrappedOpsTest, sync_bufferflush) {
               this->ops.sync(&this->errinfo, this->handle));
 }
 
+/**
+ * Data still in the write buffer should be read back from memory, without
+ * flushing the buffer or reading from the underlying file.
+ */
+TYPED_TEST_P(BufferedWrappedOpsTest, pread_from_write_buffer) {
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              this->ops.open(&this->errinfo, &this->handle,
+                             this->file_path.c_str(), FILE_FLAGS));
+    this->populate(4096);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              this->ops.sync(&this->errinfo, this->handle));
+    std::vector<char> inp(4096, 'W');
+    ASSERT_EQ(4096,
+              this->ops.pwrite(&this->errinfo, this->handle, &inp.front(),
+                               4096, 4096));
+
+    EXPECT_CALL(*this->mock_ops, pwrite(_, _, _, _, _)).Times(0);
+    // Only the part of the read before the write buffer touches the file.
+    EXPECT_CALL(*this->mock_ops, pread(_, _, _, _, _)).Times(1);
+
+    ASSERT_EQ(2048,
+              this->ops.pread(&this->errinfo, this->handle, &this->buf, 2048,
+                              5000));
+    EXPECT_EQ('W', this->buf[0]);
+    EXPECT_EQ('W', this->buf[2047]);
+
+    ASSERT_EQ(2048,
+              this->ops.pread(&this->errinfo, this->handle, &this->buf, 2048,
+                              3072));
+    EXPECT_EQ('H', this->buf[0]);
+    EXPECT_EQ('H', this->buf[1023]);
+    EXPECT_EQ('W', this->buf[1024]);
+    EXPECT_EQ('W', this->buf[2047]);
+}
+
 REGISTER_TYPED_TEST_CASE_P(
     WrappedOpsTest,
     open, close, pread_single, sync, goto_eof,
@@ -261,4 +302,4 @@ REGISTER_TYPED_TEST_CASE_P(
 
 REGISTER_TYPED_TEST_CASE_P(
     BufferedWrappedOpsTest,
-    sync_bufferflush);
+    sync_bufferflush, pread_from_write_buffer);